@@ -0,0 +1,201 @@
+package main
+
+import (
+	"net"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+const WORKER_IDLE_TIMEOUT = 10 * time.Second
+
+/*
+ * Admission Control
+ *
+ * At most `maxConns` workers handle connections. Once all of them are busy,
+ * accepted connections wait in a bounded queue, and anything past that is
+ * refused right away instead of piling up goroutines and FDs. A tunnel
+ * handed to an event loop takes its worker and address slots along, its
+ * worker goroutine quits and the loop gives the slots back on close.
+ */
+type queuedConn struct {
+	conn        net.Conn
+	queuedAt    time.Time
+	transparent bool
+}
+
+type admission struct {
+	maxConns  int32
+	maxPerIp  int
+	queueWait time.Duration
+	queue     chan queuedConn
+	workers   atomic.Int32
+
+	perIpMutex sync.Mutex
+	perIp      map[string]int
+}
+
+func newAdmission(c *config) *admission {
+	return &admission{
+		maxConns:  int32(c.maxConns),
+		maxPerIp:  c.maxPerIp,
+		queueWait: c.queueWait,
+		queue:     make(chan queuedConn, c.maxQueue),
+		perIp:     make(map[string]int),
+	}
+}
+
+func (self *admission) admit(conn net.Conn, transparent bool) {
+	if !self.acquireIp(conn) {
+		perror("%s: too many connections from this address", conn.RemoteAddr())
+		conn.Close()
+		return
+	}
+
+	q := queuedConn{conn, time.Now(), transparent}
+	if self.maxConns == 0 {
+		go func() {
+			self.serve(q, nil)
+		}()
+		return
+	}
+
+	if self.spawnWorker(&q) {
+		return
+	}
+
+	select {
+	case self.queue <- q:
+		// a worker might have quit between the check above and the send
+		self.spawnWorker(nil)
+	default:
+		perror("%s: connection queue is full", conn.RemoteAddr())
+		self.releaseIp(conn)
+		conn.Close()
+	}
+}
+
+func (self *admission) spawnWorker(q *queuedConn) bool {
+	for {
+		n := self.workers.Load()
+		if n >= self.maxConns {
+			return false
+		}
+
+		if self.workers.CompareAndSwap(n, n+1) {
+			break
+		}
+	}
+
+	go self.worker(q)
+	return true
+}
+
+func (self *admission) worker(q *queuedConn) {
+	if q != nil && self.serve(*q, self.releaseWorker) {
+		return
+	}
+
+	idle := time.NewTimer(WORKER_IDLE_TIMEOUT)
+	defer idle.Stop()
+
+	for {
+		select {
+		case q := <-self.queue:
+			if self.queueWait > 0 && time.Since(q.queuedAt) > self.queueWait {
+				perror("%s: waited too long in the queue", q.conn.RemoteAddr())
+				self.releaseIp(q.conn)
+				q.conn.Close()
+				continue
+			}
+
+			if self.serve(q, self.releaseWorker) {
+				return
+			}
+
+			idle.Reset(WORKER_IDLE_TIMEOUT)
+		case <-idle.C:
+			self.releaseWorker()
+			return
+		}
+	}
+}
+
+func (self *admission) releaseWorker() {
+	self.workers.Add(-1)
+
+	// the queue may have filled up while we were leaving
+	if len(self.queue) > 0 {
+		self.spawnWorker(nil)
+	}
+}
+
+// serve handles `q` and reports whether an event loop took the tunnel, and
+// with it the address slot and `slot`, which it releases on close.
+func (self *admission) serve(q queuedConn, slot func()) bool {
+	client := NewClient(q.conn, q.transparent)
+	client.trace = connTraces.start(q.conn, q.queuedAt)
+	client.release = func() {
+		self.releaseIp(q.conn)
+		if slot != nil {
+			slot()
+		}
+	}
+
+	// a panicking handler still gives its address slot back
+	defer func() {
+		if client.release != nil {
+			self.releaseIp(q.conn)
+		}
+	}()
+	defer recoverConn(q.conn)
+
+	client.handle()
+	return client.release == nil
+}
+
+func (self *admission) acquireIp(conn net.Conn) bool {
+	if self.maxPerIp == 0 {
+		return true
+	}
+
+	ip := remoteIp(conn)
+
+	self.perIpMutex.Lock()
+	defer self.perIpMutex.Unlock()
+
+	if self.perIp[ip] >= self.maxPerIp {
+		return false
+	}
+
+	self.perIp[ip]++
+	return true
+}
+
+func (self *admission) releaseIp(conn net.Conn) {
+	if self.maxPerIp == 0 {
+		return
+	}
+
+	ip := remoteIp(conn)
+
+	self.perIpMutex.Lock()
+	defer self.perIpMutex.Unlock()
+
+	if self.perIp[ip]--; self.perIp[ip] <= 0 {
+		delete(self.perIp, ip)
+	}
+}
+
+func remoteIp(conn net.Conn) string {
+	if addr, ok := conn.RemoteAddr().(*net.TCPAddr); ok {
+		return addr.IP.String()
+	}
+
+	host, _, err := net.SplitHostPort(conn.RemoteAddr().String())
+	if err != nil {
+		return conn.RemoteAddr().String()
+	}
+
+	return host
+}
@@ -0,0 +1,430 @@
+package main
+
+import (
+	"bytes"
+	"encoding/binary"
+	"flag"
+	"io"
+	"net"
+	"os"
+	"path/filepath"
+	"runtime"
+	"sort"
+	"strings"
+	"sync"
+	"testing"
+	"time"
+)
+
+/*
+ * Load Benchmarks
+ *
+ * The proxy runs in process through runServer, in front of a fake TLS
+ * origin: it reads a ClientHello however it was cut into records and
+ * segments, answers with one handshake record and then serves byte counts
+ * it is asked for, up to a request for zero bytes. The driver opens CONNECT tunnels like a browser would,
+ * with the canned hello of newClientHello, so the allocations reported are
+ * the proxy's and the driver's, not crypto/tls's.
+ *
+ *	go test -run XXX -bench . -benchmem -count 10 > new.txt
+ *
+ * and benchstat against a run of the previous commit. Extra proxy options
+ * go through -proxy-args, e.g. -proxy-args "-listeners 4". "direct.test" is
+ * a [direct] rule, the other names get the default bypass.
+ */
+const (
+	BENCH_RECORD_HEADER_SIZE = 5
+	BENCH_RECORD_HANDSHAKE   = 0x16
+	BENCH_HANDSHAKE_HDR_SIZE = 4
+	BENCH_HELLO_SIZE         = 512
+	BENCH_SERVER_HELLO_SIZE  = 64
+	BENCH_BULK_SIZE          = 1 << 20
+)
+
+var benchProxyArgs = flag.String("proxy-args", "", "extra options of the benchmarked proxy")
+var benchTunnels = flag.Int("tunnels", 1000, "concurrent tunnels of BenchmarkIdleTunnels")
+
+var benchModes = []struct {
+	name, sni, splitMode string
+	pipeline             bool
+}{
+	{"direct", "direct.test", SPLIT_MODE_TCP, false},
+	{"tcp-split", "split.test", SPLIT_MODE_TCP, false},
+	{"tls-split", "split.test", SPLIT_MODE_TLS, false},
+	{"pipeline", "split.test", SPLIT_MODE_TCP, true},
+}
+
+var bench struct {
+	once   sync.Once
+	proxy  string
+	origin string
+	err    error
+}
+
+var idle struct {
+	once        sync.Once
+	heap, stack float64
+	err         error
+}
+
+// the origin only ever sends zeros, all connections share them
+var benchBulk = make([]byte, 32<<10)
+
+// startBench brings the proxy and the origin up once per test binary.
+func startBench(b *testing.B) {
+	bench.once.Do(func() {
+		dir, err := os.MkdirTemp("", "holytunnel-bench")
+		if err != nil {
+			bench.err = err
+			return
+		}
+
+		rules := filepath.Join(dir, "rules.txt")
+		if bench.err = os.WriteFile(rules, []byte("[direct]\ndirect.test\n"), 0o600); bench.err != nil {
+			return
+		}
+
+		origin, err := net.Listen("tcp", "127.0.0.1:0")
+		if err != nil {
+			bench.err = err
+			return
+		}
+
+		go serveBenchOrigin(origin)
+		bench.origin = origin.Addr().String()
+
+		// runServer listens itself, take a port that was free a moment ago
+		l, err := net.Listen("tcp", "127.0.0.1:0")
+		if err != nil {
+			bench.err = err
+			return
+		}
+
+		bench.proxy = l.Addr().String()
+		l.Close()
+
+		// one line per connection would be most of the work
+		args := append([]string{"-log-level", "error", "-rules", rules}, strings.Fields(*benchProxyArgs)...)
+		args = append(args, bench.proxy)
+		if bench.err = parseArgs(args); bench.err != nil {
+			return
+		}
+
+		go func() {
+			if err := runServer(bench.proxy); err != nil {
+				perror("bench: %s", err)
+			}
+		}()
+
+		for i := 0; i < 100; i++ {
+			if conn, err := net.Dial("tcp", bench.proxy); err == nil {
+				conn.Close()
+				return
+			}
+
+			time.Sleep(10 * time.Millisecond)
+		}
+
+		bench.err = os.ErrDeadlineExceeded
+	})
+
+	if bench.err != nil {
+		b.Fatal(bench.err)
+	}
+}
+
+// newClientHello builds a ClientHello record asking for `name`, padded to
+// the BENCH_HELLO_SIZE of a browser's.
+func newClientHello(name string) []byte {
+	var ext []byte
+	ext = binary.BigEndian.AppendUint16(ext, 0x000a) // supported groups
+	ext = append(ext, 0, 4, 0, 2, 0, 0x1d)
+	ext = binary.BigEndian.AppendUint16(ext, 0x0000) // server name
+	ext = binary.BigEndian.AppendUint16(ext, uint16(5+len(name)))
+	ext = binary.BigEndian.AppendUint16(ext, uint16(3+len(name)))
+	ext = append(ext, 0) // host name
+	ext = binary.BigEndian.AppendUint16(ext, uint16(len(name)))
+	ext = append(ext, name...)
+
+	// the fixed 52 bytes, the extensions so far and the padding's header
+	pad := BENCH_HELLO_SIZE - 52 - len(ext) - 4
+	if pad >= 0 {
+		ext = binary.BigEndian.AppendUint16(ext, 0x0015) // padding
+		ext = binary.BigEndian.AppendUint16(ext, uint16(pad))
+		ext = append(ext, make([]byte, pad)...)
+	}
+
+	body := []byte{0x03, 0x03}
+	body = append(body, make([]byte, 32)...) // random
+	body = append(body, 0)                   // session id
+	body = append(body, 0, 2, 0x13, 0x01)    // cipher suites
+	body = append(body, 1, 0)                // compression methods
+	body = binary.BigEndian.AppendUint16(body, uint16(len(ext)))
+	body = append(body, ext...)
+
+	hs := []byte{0x01, 0, byte(len(body) >> 8), byte(len(body))}
+	hs = append(hs, body...)
+
+	rec := []byte{BENCH_RECORD_HANDSHAKE, 0x03, 0x01, byte(len(hs) >> 8), byte(len(hs))}
+	return append(rec, hs...)
+}
+
+func serveBenchOrigin(l net.Listener) {
+	for {
+		conn, err := l.Accept()
+		if err != nil {
+			return
+		}
+
+		go func() {
+			defer conn.Close()
+			benchOriginConn(conn)
+		}()
+	}
+}
+
+// benchOriginConn reads straight from `conn`, a per-connection reader would
+// show up in BenchmarkIdleTunnels.
+func benchOriginConn(conn net.Conn) {
+	// the hello, in as many records as it came
+	var hdr [BENCH_RECORD_HEADER_SIZE]byte
+	var hello []byte
+	for len(hello) < BENCH_HANDSHAKE_HDR_SIZE ||
+		len(hello) < BENCH_HANDSHAKE_HDR_SIZE+int(binary.BigEndian.Uint16(hello[2:])) {
+		if _, err := io.ReadFull(conn, hdr[:]); err != nil || hdr[0] != BENCH_RECORD_HANDSHAKE {
+			return
+		}
+
+		rec := make([]byte, binary.BigEndian.Uint16(hdr[3:]))
+		if _, err := io.ReadFull(conn, rec); err != nil {
+			return
+		}
+
+		hello = append(hello, rec...)
+	}
+
+	res := make([]byte, BENCH_SERVER_HELLO_SIZE)
+	copy(res, []byte{BENCH_RECORD_HANDSHAKE, 3, 3, 0, BENCH_SERVER_HELLO_SIZE - BENCH_RECORD_HEADER_SIZE})
+	if _, err := conn.Write(res); err != nil {
+		return
+	}
+
+	var want [8]byte
+	for {
+		if _, err := io.ReadFull(conn, want[:]); err != nil {
+			return
+		}
+
+		n := int64(binary.BigEndian.Uint64(want[:]))
+		if n == 0 {
+			return
+		}
+
+		for n > 0 {
+			chunk := int64(len(benchBulk))
+			if n < chunk {
+				chunk = n
+			}
+
+			if _, err := conn.Write(benchBulk[:chunk]); err != nil {
+				return
+			}
+
+			n -= chunk
+		}
+	}
+}
+
+// openBenchTunnel connects through the proxy and completes the fake
+// handshake.
+func openBenchTunnel(hello []byte) (net.Conn, error) {
+	conn, err := net.Dial("tcp", bench.proxy)
+	if err != nil {
+		return nil, err
+	}
+
+	req := "CONNECT " + bench.origin + " HTTP/1.1\r\nHost: " + bench.origin + "\r\n\r\n"
+	if _, err = conn.Write([]byte(req)); err != nil {
+		conn.Close()
+		return nil, err
+	}
+
+	// "HTTP/1.1 200 OK\r\n\r\n" and the like
+	var res [BENCH_SERVER_HELLO_SIZE]byte
+	if err = readBenchReply(conn, res[:]); err != nil {
+		conn.Close()
+		return nil, err
+	}
+
+	if _, err = conn.Write(hello); err != nil {
+		conn.Close()
+		return nil, err
+	}
+
+	if _, err = io.ReadFull(conn, res[:]); err != nil {
+		conn.Close()
+		return nil, err
+	}
+
+	return conn, nil
+}
+
+// closeBenchTunnel has the origin hang up too, each end of the tunnel then
+// goes away on its own.
+func closeBenchTunnel(conn net.Conn) {
+	var bye [8]byte
+	conn.Write(bye[:])
+	conn.Close()
+}
+
+// readBenchReply reads up to the blank line, the origin speaks only after
+// the hello.
+func readBenchReply(conn net.Conn, b []byte) error {
+	n := 0
+	for {
+		r, err := conn.Read(b[n:])
+		n += r
+		if bytes.Contains(b[:n], []byte("\r\n\r\n")) {
+			return nil
+		}
+
+		if err != nil {
+			return err
+		}
+
+		if n == len(b) {
+			return errHttpRequestInval
+		}
+	}
+}
+
+func percentile(sorted []time.Duration, p int) time.Duration {
+	if len(sorted) == 0 {
+		return 0
+	}
+
+	return sorted[(len(sorted)-1)*p/100]
+}
+
+// BenchmarkConnect opens and closes tunnels from parallel clients, one op is
+// one tunnel up to the first response record.
+func BenchmarkConnect(b *testing.B) {
+	startBench(b)
+	for _, mode := range benchModes {
+		b.Run(mode.name, func(b *testing.B) {
+			hello := newClientHello(mode.sni)
+			c := *currentCfg()
+			c.splitMode = mode.splitMode
+			c.pipelineConnect = mode.pipeline
+			liveCfg.Store(&c) // the way a reload would
+
+			var mutex sync.Mutex
+			latencies := make([]time.Duration, 0, b.N)
+			b.ReportAllocs()
+			b.ResetTimer()
+			start := time.Now()
+			b.RunParallel(func(pb *testing.PB) {
+				var local []time.Duration
+				for pb.Next() {
+					t := time.Now()
+					conn, err := openBenchTunnel(hello)
+					if err != nil {
+						b.Error(err)
+						return
+					}
+
+					local = append(local, time.Since(t))
+					closeBenchTunnel(conn)
+				}
+
+				mutex.Lock()
+				latencies = append(latencies, local...)
+				mutex.Unlock()
+			})
+
+			elapsed := time.Since(start)
+			b.StopTimer()
+
+			sort.Slice(latencies, func(i, j int) bool { return latencies[i] < latencies[j] })
+			b.ReportMetric(float64(percentile(latencies, 50).Microseconds()), "p50-µs")
+			b.ReportMetric(float64(percentile(latencies, 99).Microseconds()), "p99-µs")
+			b.ReportMetric(float64(len(latencies))/elapsed.Seconds(), "conns/s")
+		})
+	}
+}
+
+// BenchmarkThroughput pulls BENCH_BULK_SIZE per op through one tunnel, the
+// bypass only touches the hello and should cost nothing here.
+func BenchmarkThroughput(b *testing.B) {
+	startBench(b)
+	conn, err := openBenchTunnel(newClientHello("example.com"))
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer closeBenchTunnel(conn)
+
+	buffer := make([]byte, 64<<10)
+	var want [8]byte
+	binary.BigEndian.PutUint64(want[:], BENCH_BULK_SIZE)
+	b.SetBytes(BENCH_BULK_SIZE)
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if _, err = conn.Write(want[:]); err != nil {
+			b.Fatal(err)
+		}
+
+		for n := 0; n < BENCH_BULK_SIZE; {
+			r, err := conn.Read(buffer)
+			if err != nil {
+				b.Fatal(err)
+			}
+
+			n += r
+		}
+	}
+}
+
+// BenchmarkIdleTunnels holds -tunnels established tunnels open and reports
+// the memory they pin after a GC. The numbers include the driver's and the
+// origin's end of each tunnel, so they are for comparing commits. It
+// measures once per test binary, whatever b.N is.
+func BenchmarkIdleTunnels(b *testing.B) {
+	startBench(b)
+	idle.once.Do(func() {
+		hello := newClientHello("example.com")
+		conns := make([]net.Conn, 0, *benchTunnels)
+		defer func() {
+			for _, conn := range conns {
+				closeBenchTunnel(conn)
+			}
+		}()
+
+		var before, after runtime.MemStats
+		runtime.GC()
+		runtime.ReadMemStats(&before)
+		for len(conns) < *benchTunnels {
+			conn, err := openBenchTunnel(hello)
+			if err != nil {
+				idle.err = err
+				return
+			}
+
+			conns = append(conns, conn)
+		}
+
+		runtime.GC()
+		runtime.ReadMemStats(&after)
+
+		n := float64(len(conns))
+		idle.heap = float64(int64(after.HeapInuse)-int64(before.HeapInuse)) / n
+		idle.stack = float64(int64(after.StackInuse)-int64(before.StackInuse)) / n
+	})
+
+	if idle.err != nil {
+		b.Fatal(idle.err)
+	}
+
+	b.ReportMetric(idle.heap, "heap-B/tunnel")
+	b.ReportMetric(idle.stack, "stack-B/tunnel")
+}
@@ -0,0 +1,485 @@
+package main
+
+import (
+	"encoding/json"
+	"errors"
+	"flag"
+	"fmt"
+	"os"
+	"os/signal"
+	"runtime"
+	"sync/atomic"
+	"syscall"
+	"time"
+)
+
+/*
+ * Config
+ */
+type config struct {
+	configFile    string
+	listenAddr    string
+	listeners     int
+	bufferSize    int
+	maxHeaderSize int
+	idleTimeout   time.Duration
+	maxLifetime   time.Duration
+	drainTimeout  time.Duration
+	metricsAddr   string
+	debugAddr     string
+	relayEngine   string
+	relayLoops    int
+	logLevel      string
+	logFormat     string
+	logRate       int
+
+	// admission control, 0 means unlimited
+	maxConns  int
+	maxQueue  int
+	queueWait time.Duration
+	maxPerIp  int
+
+	// bytes per second each way, 0 means unlimited
+	ratePerIp byteRate
+	rateBurst byteRate
+
+	dnsUpstream  string
+	dnsCacheSize int
+	dnsSysTtl    time.Duration
+	dnsNegTtl    time.Duration
+
+	dialTimeout time.Duration
+	dialDelay   time.Duration
+
+	poolSize  int
+	poolTtl   time.Duration
+	poolHosts int
+
+	pipelineConnect bool
+
+	// transparent listener for a Linux gateway, REDIRECT unless tproxy
+	transparentAddr string
+	tproxy          bool
+
+	splitDelay      time.Duration
+	splitMode       string
+	helloSplitSize  int
+	headerSplitSize int
+
+	quicMode string
+
+	// compiled from rulesFile on every load
+	rulesFile string
+	rules     *ruleSet
+
+	// default chain for hosts without a rule, nil: direct
+	upstreamSpec string
+	upstream     *upstreamChain
+
+	// accept multiplexed tunnels from other holytunnel instances
+	muxListen string
+	muxCert   string
+	muxKey    string
+	muxSecret string
+
+	adaptive        bool
+	strategyFile    string
+	strategyTimeout time.Duration
+}
+
+const (
+	SPLIT_MODE_TCP = "tcp"
+	SPLIT_MODE_TLS = "tls"
+
+	QUIC_MODE_RELAY = "relay"
+	QUIC_MODE_BLOCK = "block"
+	QUIC_MODE_AUTO  = "auto"
+
+	RELAY_ENGINE_GOROUTINE = "goroutine"
+	RELAY_ENGINE_EPOLL     = "epoll"
+)
+
+var errArgInval = errors.New("invalid argument")
+var errConfigFile = errors.New("config file")
+
+var defaultCfg = config{
+	configFile: "",
+	listenAddr: "127.0.0.1:8001",
+	listeners:  1,
+
+	bufferSize:    BUFFER_SIZE,
+	maxHeaderSize: 65536,
+	idleTimeout:   10 * time.Minute,
+	maxLifetime:   0,
+	drainTimeout:  30 * time.Second,
+	metricsAddr:   "",
+	debugAddr:     "",
+	relayEngine:   RELAY_ENGINE_GOROUTINE,
+	relayLoops:    0,
+	logLevel:      "info",
+	logFormat:     "text",
+	logRate:       20,
+	maxConns:      0,
+	maxQueue:      1024,
+	queueWait:     5 * time.Second,
+	maxPerIp:      0,
+
+	ratePerIp: 0,
+	rateBurst: 256 << 10,
+
+	dnsUpstream:  "",
+	dnsCacheSize: 4096,
+	dnsSysTtl:    60 * time.Second,
+	dnsNegTtl:    30 * time.Second,
+
+	dialTimeout: 10 * time.Second,
+	dialDelay:   250 * time.Millisecond,
+
+	poolSize:  0,
+	poolTtl:   20 * time.Second,
+	poolHosts: 64,
+
+	pipelineConnect: false,
+
+	transparentAddr: "",
+	tproxy:          false,
+
+	splitDelay:      0,
+	splitMode:       SPLIT_MODE_TCP,
+	helloSplitSize:  HTTPS_HELO_SPLIT_SIZE,
+	headerSplitSize: HTTP_HEADER_SPLIT_SIZE,
+
+	quicMode: QUIC_MODE_AUTO,
+
+	rulesFile: "",
+
+	upstreamSpec: "",
+
+	muxListen: "",
+	muxCert:   "",
+	muxKey:    "",
+	muxSecret: "",
+
+	adaptive:        false,
+	strategyFile:    "",
+	strategyTimeout: 5 * time.Second,
+}
+
+const helpMsg = "holytunnel [OPTIONS] [HOST:PORT]"
+
+// newFlagSet binds every option to `c`. Config files use the same names.
+func newFlagSet(c *config) *flag.FlagSet {
+	fs := flag.NewFlagSet("holytunnel", flag.ContinueOnError)
+	fs.Usage = func() {
+		fmt.Fprintln(os.Stderr, helpMsg)
+		fs.PrintDefaults()
+	}
+
+	fs.StringVar(&c.configFile, "config", c.configFile,
+		"JSON file with options by their flag names, reloaded on SIGHUP")
+	fs.IntVar(&c.listeners, "listeners", c.listeners,
+		"SO_REUSEPORT listeners with their own accept loop (0: one per CPU)")
+	fs.IntVar(&c.bufferSize, "buffer-size", c.bufferSize,
+		"initial request header buffer in bytes (at least 4096)")
+	fs.IntVar(&c.maxHeaderSize, "max-header", c.maxHeaderSize,
+		"largest accepted request header in bytes")
+	fs.DurationVar(&c.idleTimeout, "idle-timeout", c.idleTimeout,
+		"close connections idle in both directions for this long (0: never)")
+	fs.DurationVar(&c.maxLifetime, "max-lifetime", c.maxLifetime,
+		"close tunnels older than this (0: never)")
+	fs.DurationVar(&c.drainTimeout, "drain-timeout", c.drainTimeout,
+		"on a graceful restart (SIGUSR2), wait this long for open connections (0: no limit)")
+	fs.StringVar(&c.metricsAddr, "metrics", c.metricsAddr,
+		"serve Prometheus metrics on HOST:PORT/metrics (default: off)")
+	fs.StringVar(&c.debugAddr, "debug", c.debugAddr,
+		"serve pprof, runtime traces and connection timings on HOST:PORT/debug/ (default: off)")
+	fs.StringVar(&c.relayEngine, "relay", c.relayEngine,
+		"tunnel relay: \"goroutine\" pairs or \"epoll\" event loops (Linux, for many idle tunnels)")
+	fs.IntVar(&c.relayLoops, "relay-loops", c.relayLoops,
+		"event loops of the epoll relay (0: one per CPU)")
+	fs.StringVar(&c.logLevel, "log-level", c.logLevel,
+		"lowest level logged: debug, info or error")
+	fs.StringVar(&c.logFormat, "log-format", c.logFormat,
+		"log line format: text or json")
+	fs.IntVar(&c.logRate, "log-rate", c.logRate,
+		"error lines per second allowed for each kind of message (0: unlimited)")
+	fs.IntVar(&c.maxConns, "max-conns", c.maxConns,
+		"maximum concurrently handled connections (0: unlimited)")
+	fs.IntVar(&c.maxQueue, "max-queue", c.maxQueue,
+		"connections waiting for a free slot before new ones are refused")
+	fs.DurationVar(&c.queueWait, "queue-wait", c.queueWait,
+		"longest time a connection may wait in the queue")
+	fs.IntVar(&c.maxPerIp, "max-per-ip", c.maxPerIp,
+		"maximum concurrent connections per source IP (0: unlimited)")
+
+	fs.Var(&c.ratePerIp, "rate-per-ip",
+		"bandwidth of each source IP in bytes/s each way, e.g. \"512k\" or \"2m\" (0: unlimited)")
+	fs.Var(&c.rateBurst, "rate-burst",
+		"bytes a shaped source or rule may send at once after being idle")
+
+	fs.StringVar(&c.dnsUpstream, "dns", c.dnsUpstream,
+		"upstream DNS server HOST[:PORT], tls://HOST[:PORT] or https://HOST/PATH\n(default: system resolver)")
+	fs.IntVar(&c.dnsCacheSize, "dns-cache", c.dnsCacheSize,
+		"resolver cache entries (0: disable caching)")
+	fs.DurationVar(&c.dnsSysTtl, "dns-ttl", c.dnsSysTtl,
+		"cache time of system resolver answers, which carry no TTL")
+	fs.DurationVar(&c.dnsNegTtl, "dns-neg-ttl", c.dnsNegTtl,
+		"longest cache time of failed lookups")
+
+	fs.DurationVar(&c.dialTimeout, "dial-timeout", c.dialTimeout,
+		"timeout of a single connection attempt to the target")
+	fs.DurationVar(&c.dialDelay, "dial-delay", c.dialDelay,
+		"delay before racing the next target address")
+
+	fs.IntVar(&c.poolSize, "pool", c.poolSize,
+		"pre-connected sockets kept per hot destination (0: disable)")
+	fs.DurationVar(&c.poolTtl, "pool-ttl", c.poolTtl,
+		"idle lifetime of pooled sockets and of unused destinations")
+	fs.IntVar(&c.poolHosts, "pool-hosts", c.poolHosts,
+		"maximum destinations kept warm")
+
+	fs.BoolVar(&c.pipelineConnect, "pipeline", c.pipelineConnect,
+		"acknowledge CONNECT and read the ClientHello while the target is dialled")
+
+	fs.StringVar(&c.transparentAddr, "transparent", c.transparentAddr,
+		"HOST:PORT taking connections redirected by the firewall (Linux)")
+	fs.BoolVar(&c.tproxy, "tproxy", c.tproxy,
+		"the transparent listener gets TPROXY instead of REDIRECT traffic (needs CAP_NET_ADMIN)")
+
+	fs.DurationVar(&c.splitDelay, "split-delay", c.splitDelay,
+		"pause between request fragments, keeps the kernel from merging them")
+
+	fs.StringVar(&c.splitMode, "split-mode", c.splitMode,
+		"ClientHello fragmentation: \"tcp\" segments or \"tls\" records cut in the SNI")
+	fs.IntVar(&c.helloSplitSize, "hello-split", c.helloSplitSize,
+		"first TCP fragment of a ClientHello in bytes")
+	fs.IntVar(&c.headerSplitSize, "header-split", c.headerSplitSize,
+		"first TCP fragment of a plain HTTP request in bytes")
+
+	fs.StringVar(&c.quicMode, "quic", c.quicMode,
+		"QUIC over SOCKS5 UDP: \"relay\", \"block\" or \"auto\" (block [fragment] hosts and learned bypasses)")
+
+	fs.StringVar(&c.rulesFile, "rules", c.rulesFile,
+		"file of domains to relay directly, to always fragment, to block or to send through an upstream")
+
+	fs.StringVar(&c.upstreamSpec, "upstream", c.upstreamSpec,
+		"proxy chain for hosts without a rule, e.g. \"socks5://10.0.0.1:1080,http://proxy:3128\" or \"mux://peer:8003\"")
+	fs.StringVar(&c.muxListen, "mux-listen", c.muxListen,
+		"serve multiplexed tunnels from \"mux://\" upstreams on HOST:PORT")
+	fs.StringVar(&c.muxCert, "mux-cert", c.muxCert,
+		"TLS certificate for -mux-listen, for \"mux+tls://\" upstreams")
+	fs.StringVar(&c.muxKey, "mux-key", c.muxKey,
+		"TLS key for -mux-cert")
+	fs.StringVar(&c.muxSecret, "mux-secret", c.muxSecret,
+		"shared secret \"mux://SECRET@HOST:PORT\" upstreams must know, required unless -mux-listen is loopback")
+
+	fs.BoolVar(&c.adaptive, "adaptive", c.adaptive,
+		"learn the cheapest working bypass strategy per destination")
+	fs.StringVar(&c.strategyFile, "strategy-file", c.strategyFile,
+		"file the learned strategies are kept in across restarts")
+	fs.DurationVar(&c.strategyTimeout, "strategy-timeout", c.strategyTimeout,
+		"how long to wait for the first response byte before a request counts as dropped")
+
+	return fs
+}
+
+// restartOptions are bound to sockets and components built at startup, a
+// reload keeps their old values.
+var restartOptions = [...]string{
+	"config", "listeners", "metrics", "debug", "relay", "relay-loops",
+	"max-conns", "max-queue", "queue-wait", "max-per-ip",
+	"dns", "dns-cache", "dns-ttl", "dns-neg-ttl", "dial-timeout", "dial-delay",
+	"pool", "pool-ttl", "pool-hosts", "transparent", "tproxy",
+	"mux-listen", "mux-cert", "mux-key", "mux-secret",
+	"adaptive", "strategy-file",
+}
+
+// liveCfg is only ever replaced as a whole, so a reader holding a snapshot
+// sees one consistent version without taking a lock.
+var liveCfg atomic.Pointer[config]
+var cliArgs []string
+
+func currentCfg() *config {
+	return liveCfg.Load()
+}
+
+func parseArgs(args []string) error {
+	c, err := loadConfig(args)
+	if err != nil {
+		return err
+	}
+
+	cliArgs = args
+	applyConfig(c)
+	return nil
+}
+
+// reloadConfig reads the config file again, the command line still wins.
+// Connections in progress keep the snapshot they started with.
+func reloadConfig() error {
+	c, err := loadConfig(cliArgs)
+	if err != nil {
+		return err
+	}
+
+	oldCfg := *currentCfg()
+	oldFs, newFs := newFlagSet(&oldCfg), newFlagSet(c)
+	for _, name := range restartOptions {
+		was := oldFs.Lookup(name).Value.String()
+		if newFs.Lookup(name).Value.String() != was {
+			perror("reload: %s only changes on a restart", name)
+			newFs.Set(name, was)
+		}
+	}
+
+	if c.listenAddr != oldCfg.listenAddr {
+		perror("reload: the listen address only changes on a restart")
+		c.listenAddr = oldCfg.listenAddr
+	}
+
+	applyConfig(c)
+	return nil
+}
+
+// reloadOnSignal applies the config file again on every SIGHUP.
+func reloadOnSignal() {
+	sig := make(chan os.Signal, 1)
+	signal.Notify(sig, syscall.SIGHUP)
+	for range sig {
+		if err := reloadConfig(); err != nil {
+			perror("reload: %s", err)
+			continue
+		}
+
+		info("Configuration reloaded")
+	}
+}
+
+func applyConfig(c *config) {
+	level, _ := parseLogLevel(c.logLevel)
+	logger.configure(level, c.logFormat == "json", c.logRate)
+	liveCfg.Store(c)
+}
+
+func loadConfig(args []string) (*config, error) {
+	c := defaultCfg
+	fs := newFlagSet(&c)
+	if err := fs.Parse(args); err != nil {
+		return nil, err
+	}
+
+	// the command line goes on top of the file
+	if path := c.configFile; len(path) > 0 {
+		c = defaultCfg
+		fs = newFlagSet(&c)
+		if err := loadConfigFile(fs, &c, path); err != nil {
+			return nil, fmt.Errorf("%w: %v", errConfigFile, err)
+		}
+
+		if err := fs.Parse(args); err != nil {
+			return nil, err
+		}
+	}
+
+	switch fs.NArg() {
+	case 0:
+	case 1:
+		c.listenAddr = fs.Arg(0)
+	default:
+		return nil, errArgInval
+	}
+
+	if c.listeners == 0 {
+		c.listeners = runtime.NumCPU()
+	}
+
+	if c.relayLoops == 0 {
+		c.relayLoops = runtime.NumCPU()
+	}
+
+	if _, ok := parseLogLevel(c.logLevel); !ok ||
+		(c.logFormat != "text" && c.logFormat != "json") || c.logRate < 0 {
+		return nil, errArgInval
+	}
+
+	if c.listeners < 0 || c.bufferSize < BUFFER_SIZE_MIN || c.maxHeaderSize < c.bufferSize || c.relayLoops < 0 ||
+		(c.relayEngine != RELAY_ENGINE_GOROUTINE && c.relayEngine != RELAY_ENGINE_EPOLL) ||
+		c.idleTimeout < 0 || c.maxLifetime < 0 || c.drainTimeout < 0 || c.maxConns < 0 || c.maxQueue < 0 || c.maxPerIp < 0 ||
+		c.dnsCacheSize < 0 || c.dialTimeout <= 0 || c.dialDelay <= 0 ||
+		c.poolSize < 0 || c.poolTtl <= 0 || c.poolHosts < 0 ||
+		c.splitDelay < 0 || c.helloSplitSize < 1 || c.headerSplitSize < 1 ||
+		(c.splitMode != SPLIT_MODE_TCP && c.splitMode != SPLIT_MODE_TLS) ||
+		(c.quicMode != QUIC_MODE_RELAY && c.quicMode != QUIC_MODE_BLOCK && c.quicMode != QUIC_MODE_AUTO) ||
+		c.strategyTimeout <= 0 || c.rateBurst < RATE_CHUNK_MIN {
+		return nil, errArgInval
+	}
+
+	if (len(c.muxCert) > 0) != (len(c.muxKey) > 0) {
+		return nil, errArgInval
+	}
+
+	// a mux peer reaches any host for whoever gets in
+	if len(c.muxListen) > 0 && len(c.muxSecret) == 0 && !isLoopbackAddr(c.muxListen) {
+		return nil, fmt.Errorf("%w: -mux-listen %s needs -mux-secret", errConfigFile, c.muxListen)
+	}
+
+	if len(c.upstreamSpec) > 0 {
+		upstream, err := parseUpstream(c.upstreamSpec)
+		if err != nil {
+			return nil, fmt.Errorf("%w: -upstream: %v", errConfigFile, err)
+		}
+
+		c.upstream = upstream
+	}
+
+	if len(c.rulesFile) > 0 {
+		rules, err := loadRules(c.rulesFile, int64(c.rateBurst))
+		if err != nil {
+			return nil, fmt.Errorf("%w: %v", errConfigFile, err)
+		}
+
+		c.rules = rules
+	}
+
+	return &c, nil
+}
+
+// loadConfigFile applies a JSON object of option names and values, e.g.
+// {"split-mode": "tls", "idle-timeout": "5m", "listen": "0.0.0.0:8001"}.
+func loadConfigFile(fs *flag.FlagSet, c *config, path string) error {
+	file, err := os.Open(path)
+	if err != nil {
+		return err
+	}
+	defer file.Close()
+
+	dec := json.NewDecoder(file)
+	dec.UseNumber()
+
+	var values map[string]any
+	if err = dec.Decode(&values); err != nil {
+		return fmt.Errorf("%s: %w", path, err)
+	}
+
+	for name, value := range values {
+		if name == "listen" {
+			addr, ok := value.(string)
+			if !ok {
+				return fmt.Errorf("%s: listen: not a string", path)
+			}
+
+			c.listenAddr = addr
+			continue
+		}
+
+		if name == "config" || fs.Lookup(name) == nil {
+			return fmt.Errorf("%s: unknown option %q", path, name)
+		}
+
+		if err = fs.Set(name, fmt.Sprint(value)); err != nil {
+			return fmt.Errorf("%s: %s: %w", path, name, err)
+		}
+	}
+
+	return nil
+}
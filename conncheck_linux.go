@@ -0,0 +1,32 @@
+//go:build linux
+
+package main
+
+import (
+	"net"
+	"syscall"
+)
+
+// isConnAlive peeks at an idle socket without blocking. A pending EOF, an
+// error, or data nobody asked for all make it unusable.
+func isConnAlive(conn net.Conn) bool {
+	tcp, ok := conn.(*net.TCPConn)
+	if !ok {
+		return true
+	}
+
+	raw, err := tcp.SyscallConn()
+	if err != nil {
+		return false
+	}
+
+	alive := false
+	var buffer [1]byte
+	err = raw.Read(func(fd uintptr) bool {
+		_, _, serr := syscall.Recvfrom(int(fd), buffer[:], syscall.MSG_PEEK|syscall.MSG_DONTWAIT)
+		alive = (serr == syscall.EAGAIN)
+		return true
+	})
+
+	return err == nil && alive
+}
@@ -0,0 +1,9 @@
+//go:build !linux
+
+package main
+
+import "net"
+
+func isConnAlive(conn net.Conn) bool {
+	return true
+}
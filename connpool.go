@@ -0,0 +1,175 @@
+package main
+
+import (
+	"net"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+const POOL_STATS_INTERVAL = time.Minute
+
+/*
+ * Upstream Pool
+ *
+ * Keeps up to `size` connected sockets per hostPort that was used more than
+ * once lately, so a CONNECT to a hot destination does not wait for a TCP
+ * handshake. Pooled
+ * sockets older than `ttl` are dropped, so are hosts left unused for that
+ * long, and every socket is checked for a FIN/RST before it is handed out.
+ */
+type warmConn struct {
+	conn      net.Conn
+	createdAt time.Time
+}
+
+type warmHost struct {
+	conns    []warmConn
+	filling  int
+	lastUsed time.Time
+}
+
+type upstreamPool struct {
+	size     int
+	ttl      time.Duration
+	maxHosts int
+	dial     func(string) (net.Conn, error)
+
+	mutex sync.Mutex
+	hosts map[string]*warmHost
+
+	hits   atomic.Uint64
+	misses atomic.Uint64
+}
+
+var warmPool *upstreamPool
+
+func newUpstreamPool(c *config, dial func(string) (net.Conn, error)) *upstreamPool {
+	ret := &upstreamPool{
+		size:     c.poolSize,
+		ttl:      c.poolTtl,
+		maxHosts: c.poolHosts,
+		dial:     dial,
+		hosts:    make(map[string]*warmHost),
+	}
+
+	go ret.janitor()
+	return ret
+}
+
+func (self *upstreamPool) get(hostPort string) (net.Conn, error) {
+	now := time.Now()
+
+	self.mutex.Lock()
+	host, ok := self.hosts[hostPort]
+	if !ok && len(self.hosts) < self.maxHosts {
+		// a destination is only warmed once it is seen again
+		self.hosts[hostPort] = &warmHost{lastUsed: now}
+	}
+
+	var conn net.Conn
+	if ok {
+		host.lastUsed = now
+		for len(host.conns) > 0 && conn == nil {
+			last := len(host.conns) - 1
+			wc := host.conns[last]
+			host.conns = host.conns[:last]
+
+			if now.Sub(wc.createdAt) < self.ttl && isConnAlive(wc.conn) {
+				conn = wc.conn
+			} else {
+				wc.conn.Close()
+			}
+		}
+
+		self.refill(hostPort, host)
+	}
+	self.mutex.Unlock()
+
+	if conn != nil {
+		self.hits.Add(1)
+		return conn, nil
+	}
+
+	self.misses.Add(1)
+	return self.dial(hostPort)
+}
+
+// refill must be called with `mutex` held.
+func (self *upstreamPool) refill(hostPort string, host *warmHost) {
+	need := self.size - len(host.conns) - host.filling
+	host.filling += need
+	for ; need > 0; need-- {
+		go func() {
+			conn, err := self.dial(hostPort)
+
+			self.mutex.Lock()
+			defer self.mutex.Unlock()
+
+			host.filling--
+			if err != nil {
+				return
+			}
+
+			if self.hosts[hostPort] != host {
+				// evicted meanwhile
+				conn.Close()
+				return
+			}
+
+			host.conns = append(host.conns, warmConn{conn, time.Now()})
+		}()
+	}
+}
+
+func (self *upstreamPool) janitor() {
+	ticker := time.NewTicker(self.ttl / 2)
+	defer ticker.Stop()
+
+	for now := range ticker.C {
+		self.mutex.Lock()
+		for hostPort, host := range self.hosts {
+			if now.Sub(host.lastUsed) > self.ttl {
+				for _, wc := range host.conns {
+					wc.conn.Close()
+				}
+
+				delete(self.hosts, hostPort)
+				continue
+			}
+
+			// sockets are appended in creation order
+			fresh := 0
+			for fresh < len(host.conns) && now.Sub(host.conns[fresh].createdAt) >= self.ttl {
+				host.conns[fresh].conn.Close()
+				fresh++
+			}
+
+			if fresh > 0 {
+				host.conns = append(host.conns[:0], host.conns[fresh:]...)
+				self.refill(hostPort, host)
+			}
+		}
+		self.mutex.Unlock()
+	}
+}
+
+func (self *upstreamPool) hitRate() (hits uint64, misses uint64) {
+	return self.hits.Load(), self.misses.Load()
+}
+
+func logPoolStats(pool *upstreamPool) {
+	var lastHits, lastMisses uint64
+	for range time.Tick(POOL_STATS_INTERVAL) {
+		hits, misses := pool.hitRate()
+		if hits == lastHits && misses == lastMisses {
+			continue
+		}
+
+		dHits, dMisses := hits-lastHits, misses-lastMisses
+		info("Upstream pool: %d hits, %d misses (%.1f%% hit rate)", dHits, dMisses,
+			100*float64(dHits)/float64(dHits+dMisses))
+
+		lastHits, lastMisses = hits, misses
+	}
+}
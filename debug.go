@@ -0,0 +1,158 @@
+package main
+
+import (
+	"bufio"
+	"fmt"
+	"net"
+	"net/http"
+	"net/http/pprof"
+	"sync/atomic"
+	"time"
+)
+
+const (
+	TRACE_START      = 0 // picked up by a worker
+	TRACE_PARSE      = 1 // request understood, target known
+	TRACE_DIAL       = 2
+	TRACE_REPLY      = 3 // 200 or SOCKS5 reply sent
+	TRACE_HELLO      = 4 // first request sent on, fragmented
+	TRACE_FIRST_BYTE = 5 // of the response
+	TRACE_DONE       = 6
+	TRACE_COUNT      = 7
+
+	TRACE_RING_SIZE = 4096 // power of two
+)
+
+var traceNames = [TRACE_COUNT]string{"start", "parse", "dial", "reply", "hello", "first-byte", "done"}
+
+/*
+ * Debug Listener
+ *
+ * -debug serves net/http/pprof, including the runtime tracer at
+ * /debug/pprof/trace, and /debug/conns: the stage timestamps of the last
+ * TRACE_RING_SIZE connections, newest first, in flight ones included.
+ * "?min=200ms" keeps those that took at least that long to the first
+ * response byte, or to now when it has not come yet.
+ *
+ * A trace is allocated when the connection is picked up and put in the ring
+ * right away; stages are marked with one atomic store each and nothing
+ * waits for the reader. Without -debug the ring is nil and so is every
+ * trace, marking is a nil check.
+ */
+type connTrace struct {
+	accepted time.Time
+	source   string
+	target   atomic.Pointer[string]
+	marks    [TRACE_COUNT]atomic.Int64 // ns after `accepted`, 0: not reached
+}
+
+type traceRing struct {
+	slots [TRACE_RING_SIZE]atomic.Pointer[connTrace]
+	next  atomic.Uint64
+}
+
+// connTraces is set before the listeners start, nil: tracing is off.
+var connTraces *traceRing
+
+func (self *traceRing) start(conn net.Conn, accepted time.Time) *connTrace {
+	if self == nil {
+		return nil
+	}
+
+	ret := &connTrace{accepted: accepted, source: conn.RemoteAddr().String()}
+	ret.mark(TRACE_START)
+	self.slots[(self.next.Add(1)-1)&(TRACE_RING_SIZE-1)].Store(ret)
+	return ret
+}
+
+// mark records the first time `stage` is reached.
+func (self *connTrace) mark(stage int) {
+	if self == nil {
+		return
+	}
+
+	ns := int64(time.Since(self.accepted))
+	if ns <= 0 {
+		ns = 1
+	}
+
+	self.marks[stage].CompareAndSwap(0, ns)
+}
+
+func (self *connTrace) setTarget(hostPort string) {
+	if self != nil && self.target.Load() == nil {
+		self.target.Store(&hostPort)
+	}
+}
+
+func runDebug(address string) error {
+	mux := http.NewServeMux()
+	mux.HandleFunc("/debug/pprof/", pprof.Index)
+	mux.HandleFunc("/debug/pprof/cmdline", pprof.Cmdline)
+	mux.HandleFunc("/debug/pprof/profile", pprof.Profile)
+	mux.HandleFunc("/debug/pprof/symbol", pprof.Symbol)
+	mux.HandleFunc("/debug/pprof/trace", pprof.Trace)
+	mux.HandleFunc("/debug/conns", func(w http.ResponseWriter, r *http.Request) {
+		var min time.Duration
+		if s := r.URL.Query().Get("min"); len(s) > 0 {
+			var err error
+			if min, err = time.ParseDuration(s); err != nil {
+				http.Error(w, err.Error(), http.StatusBadRequest)
+				return
+			}
+		}
+
+		w.Header().Set("Content-Type", "text/plain; charset=utf-8")
+		bw := bufio.NewWriter(w)
+		connTraces.write(bw, min)
+		bw.Flush()
+	})
+
+	listener, err := net.Listen("tcp", address)
+	if err != nil {
+		return err
+	}
+
+	info("Debug on: http://%s/debug/pprof/", listener.Addr())
+	srv := &http.Server{Handler: mux, ReadHeaderTimeout: METRICS_READ_TIME}
+	return srv.Serve(listener)
+}
+
+// write lists the traces newest first, one line each:
+// "ACCEPTED SOURCE TARGET stage=+MS ...".
+func (self *traceRing) write(w *bufio.Writer, min time.Duration) {
+	now := time.Now()
+	last := self.next.Load()
+	for i := uint64(0); i < TRACE_RING_SIZE && i < last; i++ {
+		t := self.slots[(last-1-i)&(TRACE_RING_SIZE-1)].Load()
+		if t == nil {
+			continue
+		}
+
+		took := time.Duration(t.marks[TRACE_FIRST_BYTE].Load())
+		if took == 0 {
+			took = now.Sub(t.accepted)
+			if done := t.marks[TRACE_DONE].Load(); done > 0 {
+				took = time.Duration(done)
+			}
+		}
+
+		if took < min {
+			continue
+		}
+
+		target := "-"
+		if p := t.target.Load(); p != nil {
+			target = *p
+		}
+
+		fmt.Fprintf(w, "%s %s %s", t.accepted.Format("15:04:05.000"), t.source, target)
+		for stage := range t.marks {
+			if ns := t.marks[stage].Load(); ns > 0 {
+				fmt.Fprintf(w, " %s=+%.1fms", traceNames[stage], float64(ns)/1e6)
+			}
+		}
+
+		w.WriteByte('\n')
+	}
+}
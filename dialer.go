@@ -0,0 +1,228 @@
+package main
+
+import (
+	"context"
+	"net"
+	"sync"
+	"time"
+)
+
+const (
+	DIAL_FAIL_TTL     = time.Minute
+	DIAL_FAIL_ENTRIES = 4096
+)
+
+/*
+ * Dialer
+ *
+ * RFC 8305 style: addresses are interleaved by family (IPv6 first) and
+ * attempts are started `attemptDelay` apart, or right away when the previous
+ * one fails. The first connection to succeed wins, the rest are cancelled.
+ * Addresses that failed recently are tried last.
+ */
+type dialResult struct {
+	conn net.Conn
+	addr string
+	err  error
+}
+
+type dialer struct {
+	attemptDelay   time.Duration
+	attemptTimeout time.Duration
+
+	failMutex sync.Mutex
+	failed    map[string]time.Time
+}
+
+var targetDialer *dialer
+
+func newDialer(c *config) *dialer {
+	return &dialer{
+		attemptDelay:   c.dialDelay,
+		attemptTimeout: c.dialTimeout,
+		failed:         make(map[string]time.Time),
+	}
+}
+
+func dialTarget(c *config, hostPort string) (net.Conn, error) {
+	start := time.Now()
+
+	host, _, _ := net.SplitHostPort(hostPort)
+
+	var conn net.Conn
+	var err error
+	if chain := upstreamFor(c, host); chain != nil {
+		conn, err = chain.dial(hostPort)
+	} else if warmPool != nil {
+		conn, err = warmPool.get(hostPort)
+	} else {
+		conn, err = targetDialer.dial(hostPort)
+	}
+
+	if err != nil {
+		return nil, atStage(STAGE_DIAL, err)
+	}
+
+	metrics.dialTime.observe(time.Since(start))
+	return conn, nil
+}
+
+// dialTargetAsync delivers exactly one result on the returned channel.
+func dialTargetAsync(c *config, hostPort string) <-chan dialResult {
+	ret := make(chan dialResult, 1)
+	go func() {
+		conn, err := dialTarget(c, hostPort)
+		ret <- dialResult{conn, hostPort, err}
+	}()
+
+	return ret
+}
+
+func (self *dialer) dial(hostPort string) (net.Conn, error) {
+	host, port, err := net.SplitHostPort(hostPort)
+	if err != nil {
+		return nil, err
+	}
+
+	ips, err := dnsResolver.lookup(host)
+	if err != nil {
+		return nil, err
+	}
+
+	addrs := self.sortAddrs(ips, port)
+	if len(addrs) == 1 {
+		return self.dialOne(context.Background(), addrs[0])
+	}
+
+	return self.race(addrs)
+}
+
+func (self *dialer) dialOne(ctx context.Context, addr string) (net.Conn, error) {
+	d := net.Dialer{Timeout: self.attemptTimeout}
+	conn, err := d.DialContext(ctx, "tcp", addr)
+	if err != nil && ctx.Err() == nil {
+		self.markFailed(addr)
+	}
+
+	return conn, err
+}
+
+func (self *dialer) race(addrs []string) (net.Conn, error) {
+	ctx, cancel := context.WithCancel(context.Background())
+	defer cancel()
+
+	results := make(chan dialResult, len(addrs))
+	launch := func(addr string) {
+		go func() {
+			conn, err := self.dialOne(ctx, addr)
+			results <- dialResult{conn, addr, err}
+		}()
+	}
+
+	launch(addrs[0])
+	next, pending := 1, 1
+
+	timer := time.NewTimer(self.attemptDelay)
+	defer timer.Stop()
+
+	var lastErr error
+	for {
+		var timerC <-chan time.Time
+		if next < len(addrs) {
+			timerC = timer.C
+		}
+
+		select {
+		case <-timerC:
+			launch(addrs[next])
+			next++
+			pending++
+			timer.Reset(self.attemptDelay)
+		case r := <-results:
+			pending--
+			if r.err == nil {
+				go closeLosers(results, pending)
+				return r.conn, nil
+			}
+
+			lastErr = r.err
+			if next < len(addrs) {
+				// do not wait for the delay, try the next one now
+				launch(addrs[next])
+				next++
+				pending++
+				if !timer.Stop() {
+					<-timer.C
+				}
+				timer.Reset(self.attemptDelay)
+			} else if pending == 0 {
+				return nil, lastErr
+			}
+		}
+	}
+}
+
+// closeLosers collects attempts that were still running when another one won.
+func closeLosers(results <-chan dialResult, pending int) {
+	for ; pending > 0; pending-- {
+		if r := <-results; r.conn != nil {
+			r.conn.Close()
+		}
+	}
+}
+
+// sortAddrs interleaves IPv6 and IPv4 and moves recently failed addresses to
+// the back.
+func (self *dialer) sortAddrs(ips []net.IP, port string) []string {
+	var v6, v4 []net.IP
+	for _, ip := range ips {
+		if ip.To4() != nil {
+			v4 = append(v4, ip)
+		} else {
+			v6 = append(v6, ip)
+		}
+	}
+
+	now := time.Now()
+	good := make([]string, 0, len(ips))
+	var bad []string
+
+	self.failMutex.Lock()
+	defer self.failMutex.Unlock()
+
+	for i := 0; i < len(v6) || i < len(v4); i++ {
+		for _, fam := range [...][]net.IP{v6, v4} {
+			if i >= len(fam) {
+				continue
+			}
+
+			addr := net.JoinHostPort(fam[i].String(), port)
+			if t, ok := self.failed[addr]; ok && now.Before(t) {
+				bad = append(bad, addr)
+			} else {
+				good = append(good, addr)
+			}
+		}
+	}
+
+	return append(good, bad...)
+}
+
+func (self *dialer) markFailed(addr string) {
+	now := time.Now()
+
+	self.failMutex.Lock()
+	defer self.failMutex.Unlock()
+
+	if len(self.failed) >= DIAL_FAIL_ENTRIES {
+		for k, t := range self.failed {
+			if now.After(t) {
+				delete(self.failed, k)
+			}
+		}
+	}
+
+	if len(self.failed) < DIAL_FAIL_ENTRIES {
+		self.failed[addr] = now.Add(DIAL_FAIL_TTL)
+	}
+}
@@ -0,0 +1,335 @@
+package main
+
+import (
+	"crypto/rand"
+	"encoding/binary"
+	"errors"
+	"io"
+	"net"
+	"net/url"
+	"strings"
+	"time"
+)
+
+const (
+	DNS_TYPE_A    = 1
+	DNS_TYPE_SOA  = 6
+	DNS_TYPE_AAAA = 28
+	DNS_TYPE_OPT  = 41
+	DNS_CLASS_IN  = 1
+
+	DNS_RCODE_NXDOMAIN = 3
+
+	DNS_UDP_SIZE    = 1232
+	DNS_TIMEOUT     = 2 * time.Second
+	DNS_UDP_RETRIES = 2
+
+	DNS_NODATA_TTL = 30 // seconds, for a negative answer without an SOA
+)
+
+var errDnsMsgInval = errors.New("invalid dns message")
+var errDnsNameInval = errors.New("invalid dns name")
+var errDnsServFail = errors.New("dns server failure")
+
+/*
+ * DNS Message
+ *
+ * Just enough of RFC 1035 to ask for A/AAAA records and read their TTLs.
+ */
+type dnsAnswer struct {
+	ips      []net.IP
+	ttl      uint32
+	nxdomain bool
+}
+
+func newDnsQuery(name string, qtype uint16) ([]byte, uint16, error) {
+	var rnd [2]byte
+	if _, err := rand.Read(rnd[:]); err != nil {
+		return nil, 0, err
+	}
+
+	id := binary.BigEndian.Uint16(rnd[:])
+	msg := make([]byte, 12, 12+len(name)+2+4+11)
+	binary.BigEndian.PutUint16(msg[0:], id)
+	binary.BigEndian.PutUint16(msg[2:], 0x0100) // RD
+	binary.BigEndian.PutUint16(msg[4:], 1)      // QDCOUNT
+	binary.BigEndian.PutUint16(msg[10:], 1)     // ARCOUNT: OPT
+
+	for len(name) > 0 {
+		label := name
+		dot := -1
+		for i := 0; i < len(name); i++ {
+			if name[i] == '.' {
+				dot = i
+				break
+			}
+		}
+
+		if dot >= 0 {
+			label, name = name[:dot], name[dot+1:]
+		} else {
+			name = ""
+		}
+
+		if len(label) == 0 || len(label) > 63 {
+			return nil, 0, errDnsNameInval
+		}
+
+		msg = append(msg, byte(len(label)))
+		msg = append(msg, label...)
+	}
+
+	msg = append(msg, 0)
+	msg = binary.BigEndian.AppendUint16(msg, qtype)
+	msg = binary.BigEndian.AppendUint16(msg, DNS_CLASS_IN)
+
+	// EDNS0 OPT pseudo record, advertise a bigger UDP payload
+	msg = append(msg, 0)
+	msg = binary.BigEndian.AppendUint16(msg, DNS_TYPE_OPT)
+	msg = binary.BigEndian.AppendUint16(msg, DNS_UDP_SIZE)
+	msg = append(msg, 0, 0, 0, 0, 0, 0)
+	return msg, id, nil
+}
+
+func parseDnsAnswer(msg []byte, id uint16, qtype uint16) (dnsAnswer, error) {
+	var ret dnsAnswer
+	if len(msg) < 12 || binary.BigEndian.Uint16(msg[0:]) != id {
+		return ret, errDnsMsgInval
+	}
+
+	flags := binary.BigEndian.Uint16(msg[2:])
+	if flags&0x8000 == 0 {
+		return ret, errDnsMsgInval
+	}
+
+	rcode := flags & 0xf
+	if rcode == DNS_RCODE_NXDOMAIN {
+		ret.nxdomain = true
+	} else if rcode != 0 {
+		return ret, errDnsServFail
+	}
+
+	qdCount := int(binary.BigEndian.Uint16(msg[4:]))
+	anCount := int(binary.BigEndian.Uint16(msg[6:]))
+	nsCount := int(binary.BigEndian.Uint16(msg[8:]))
+
+	off := 12
+	var err error
+	for i := 0; i < qdCount; i++ {
+		if off, err = skipDnsName(msg, off); err != nil {
+			return ret, err
+		}
+
+		off += 4
+	}
+
+	ret.ttl = ^uint32(0)
+	for i := 0; i < anCount+nsCount; i++ {
+		if off, err = skipDnsName(msg, off); err != nil {
+			return ret, err
+		}
+
+		if off+10 > len(msg) {
+			return ret, errDnsMsgInval
+		}
+
+		rtype := binary.BigEndian.Uint16(msg[off:])
+		ttl := binary.BigEndian.Uint32(msg[off+4:])
+		rdLen := int(binary.BigEndian.Uint16(msg[off+8:]))
+		off += 10
+		if off+rdLen > len(msg) {
+			return ret, errDnsMsgInval
+		}
+
+		rdata := msg[off : off+rdLen]
+		off += rdLen
+
+		if i >= anCount {
+			// authority: the SOA bounds how long a negative answer lives
+			if rtype == DNS_TYPE_SOA && len(ret.ips) == 0 && len(rdata) >= 4 {
+				minimum := binary.BigEndian.Uint32(rdata[len(rdata)-4:])
+				if minimum < ttl {
+					ttl = minimum
+				}
+
+				if ttl < ret.ttl {
+					ret.ttl = ttl
+				}
+			}
+
+			continue
+		}
+
+		if rtype != qtype {
+			// CNAME chain, the target records follow
+			continue
+		}
+
+		if (rtype == DNS_TYPE_A && rdLen != 4) || (rtype == DNS_TYPE_AAAA && rdLen != 16) {
+			return ret, errDnsMsgInval
+		}
+
+		ret.ips = append(ret.ips, net.IP(append([]byte(nil), rdata...)))
+		if ttl < ret.ttl {
+			ret.ttl = ttl
+		}
+	}
+
+	if ret.ttl == ^uint32(0) {
+		// no record and no SOA to bound the negative answer (RFC 2308
+		// says not to cache it at all, but asking again for every
+		// connection is worse)
+		ret.ttl = DNS_NODATA_TTL
+	}
+
+	return ret, nil
+}
+
+func skipDnsName(msg []byte, off int) (int, error) {
+	for {
+		if off >= len(msg) {
+			return 0, errDnsMsgInval
+		}
+
+		l := int(msg[off])
+		switch {
+		case l == 0:
+			return off + 1, nil
+		case l&0xc0 == 0xc0:
+			// compression pointer ends the name
+			return off + 2, nil
+		case l > 63:
+			return 0, errDnsMsgInval
+		}
+
+		off += 1 + l
+	}
+}
+
+/*
+ * DNS Transport
+ */
+type dnsExchanger interface {
+	exchange(query []byte) ([]byte, error)
+}
+
+// newDnsExchanger picks the transport from the upstream notation:
+// "https://HOST/PATH" (DoH), "tls://HOST[:PORT]" (DoT) or "HOST[:PORT]".
+func newDnsExchanger(upstream string) (dnsExchanger, error) {
+	if strings.HasPrefix(upstream, "https://") {
+		if u, err := url.Parse(upstream); err != nil || len(u.Host) == 0 {
+			return nil, errArgInval
+		}
+
+		return newDohExchanger(upstream), nil
+	}
+
+	if address, ok := cutPrefix(upstream, "tls://"); ok {
+		return newDotExchanger(withDefaultPort(address, "853")), nil
+	}
+
+	return &udpExchanger{address: withDefaultPort(upstream, "53")}, nil
+}
+
+func withDefaultPort(address string, port string) string {
+	if _, _, err := net.SplitHostPort(address); err != nil {
+		return net.JoinHostPort(address, port)
+	}
+
+	return address
+}
+
+func cutPrefix(s string, prefix string) (string, bool) {
+	if !strings.HasPrefix(s, prefix) {
+		return s, false
+	}
+
+	return s[len(prefix):], true
+}
+
+// udpExchanger talks plain DNS to `address`, falling back to TCP when the
+// answer is truncated.
+type udpExchanger struct {
+	address string
+}
+
+func (self *udpExchanger) exchange(query []byte) ([]byte, error) {
+	var err error
+	var resp []byte
+	for i := 0; i < DNS_UDP_RETRIES; i++ {
+		resp, err = self.exchangeUdp(query)
+		if err == nil {
+			break
+		}
+	}
+
+	if err != nil {
+		return nil, err
+	}
+
+	if len(resp) > 2 && resp[2]&0x02 != 0 {
+		// TC bit
+		return self.exchangeTcp(query)
+	}
+
+	return resp, nil
+}
+
+func (self *udpExchanger) exchangeUdp(query []byte) ([]byte, error) {
+	conn, err := net.DialTimeout("udp", self.address, DNS_TIMEOUT)
+	if err != nil {
+		return nil, err
+	}
+	defer conn.Close()
+
+	conn.SetDeadline(time.Now().Add(DNS_TIMEOUT))
+	if _, err = conn.Write(query); err != nil {
+		return nil, err
+	}
+
+	buffer := make([]byte, DNS_UDP_SIZE)
+	for {
+		recvd, err := conn.Read(buffer)
+		if err != nil {
+			return nil, err
+		}
+
+		// drop stray datagrams that do not answer this query
+		if recvd >= 2 && buffer[0] == query[0] && buffer[1] == query[1] {
+			return buffer[:recvd], nil
+		}
+	}
+}
+
+func (self *udpExchanger) exchangeTcp(query []byte) ([]byte, error) {
+	conn, err := net.DialTimeout("tcp", self.address, DNS_TIMEOUT)
+	if err != nil {
+		return nil, err
+	}
+	defer conn.Close()
+
+	conn.SetDeadline(time.Now().Add(DNS_TIMEOUT))
+	return exchangeStream(conn, query)
+}
+
+// exchangeStream sends one length-prefixed message and reads one back.
+func exchangeStream(conn io.ReadWriter, query []byte) ([]byte, error) {
+	msg := make([]byte, 2+len(query))
+	binary.BigEndian.PutUint16(msg, uint16(len(query)))
+	copy(msg[2:], query)
+	if _, err := conn.Write(msg); err != nil {
+		return nil, err
+	}
+
+	var hdr [2]byte
+	if _, err := io.ReadFull(conn, hdr[:]); err != nil {
+		return nil, err
+	}
+
+	resp := make([]byte, binary.BigEndian.Uint16(hdr[:]))
+	if _, err := io.ReadFull(conn, resp); err != nil {
+		return nil, err
+	}
+
+	return resp, nil
+}
@@ -0,0 +1,99 @@
+package main
+
+import (
+	"encoding/binary"
+	"net"
+	"testing"
+)
+
+// newDnsResponse answers `query` with records of `rtype`, one per rdata,
+// and an SOA in the authority section when `soa` is set.
+func newDnsResponse(query []byte, rtype uint16, ttl uint32, soa bool, rdatas ...[]byte) []byte {
+	msg := append([]byte(nil), query...)
+	end, _ := skipDnsName(msg, 12)
+	msg = msg[:end+4] // drop the OPT record
+	binary.BigEndian.PutUint16(msg[2:], 0x8180)
+	binary.BigEndian.PutUint16(msg[6:], uint16(len(rdatas)))
+	binary.BigEndian.PutUint16(msg[10:], 0)
+
+	record := func(rtype uint16, ttl uint32, rdata []byte) {
+		msg = append(msg, 0xc0, 12) // the question name
+		msg = binary.BigEndian.AppendUint16(msg, rtype)
+		msg = binary.BigEndian.AppendUint16(msg, DNS_CLASS_IN)
+		msg = binary.BigEndian.AppendUint32(msg, ttl)
+		msg = binary.BigEndian.AppendUint16(msg, uint16(len(rdata)))
+		msg = append(msg, rdata...)
+	}
+
+	for _, rdata := range rdatas {
+		record(rtype, ttl, rdata)
+	}
+
+	if soa {
+		binary.BigEndian.PutUint16(msg[8:], 1)
+		rdata := []byte{0, 0, 0, 0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 3, 0, 0, 0, 4}
+		rdata = binary.BigEndian.AppendUint32(rdata, 120)
+		record(DNS_TYPE_SOA, 3600, rdata)
+	}
+
+	return msg
+}
+
+func TestParseDnsAnswer(t *testing.T) {
+	query, id, err := newDnsQuery("example.com", DNS_TYPE_A)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	msg := newDnsResponse(query, DNS_TYPE_A, 300, false, []byte{10, 0, 0, 1}, []byte{10, 0, 0, 2})
+	ans, err := parseDnsAnswer(msg, id, DNS_TYPE_A)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	if len(ans.ips) != 2 || !ans.ips[1].Equal(net.IPv4(10, 0, 0, 2)) || ans.ttl != 300 {
+		t.Fatalf("got %v ttl %d", ans.ips, ans.ttl)
+	}
+
+	// NODATA, the SOA minimum bounds the negative answer
+	msg = newDnsResponse(query, DNS_TYPE_A, 0, true)
+	if ans, err = parseDnsAnswer(msg, id, DNS_TYPE_A); err != nil || len(ans.ips) != 0 || ans.ttl != 120 {
+		t.Fatalf("got %v ttl %d: %v", ans.ips, ans.ttl, err)
+	}
+
+	// NODATA without an SOA still gets cached for a while
+	msg = newDnsResponse(query, DNS_TYPE_A, 0, false)
+	if ans, err = parseDnsAnswer(msg, id, DNS_TYPE_A); err != nil || ans.ttl != DNS_NODATA_TTL {
+		t.Fatalf("got ttl %d: %v", ans.ttl, err)
+	}
+
+	if _, err = parseDnsAnswer(msg, id+1, DNS_TYPE_A); err != errDnsMsgInval {
+		t.Fatalf("foreign id: %v", err)
+	}
+}
+
+func FuzzParseDnsAnswer(f *testing.F) {
+	query, _, _ := newDnsQuery("example.com", DNS_TYPE_A)
+	f.Add(newDnsResponse(query, DNS_TYPE_A, 300, false, []byte{10, 0, 0, 1}), uint16(DNS_TYPE_A))
+	f.Add(newDnsResponse(query, DNS_TYPE_A, 0, true), uint16(DNS_TYPE_A))
+	f.Add(newDnsResponse(query, DNS_TYPE_AAAA, 60, true, make([]byte, 16)), uint16(DNS_TYPE_AAAA))
+	f.Add(newDnsResponse(query, 5, 60, false, []byte{3, 'w', 'w', 'w', 0}), uint16(DNS_TYPE_A))
+
+	f.Fuzz(func(t *testing.T, msg []byte, qtype uint16) {
+		if len(msg) < 2 {
+			return
+		}
+
+		ans, err := parseDnsAnswer(msg, binary.BigEndian.Uint16(msg), qtype)
+		if err != nil {
+			return
+		}
+
+		for _, ip := range ans.ips {
+			if (qtype == DNS_TYPE_A && len(ip) != net.IPv4len) ||
+				(qtype == DNS_TYPE_AAAA && len(ip) != net.IPv6len) {
+				t.Fatalf("%d byte address for type %d", len(ip), qtype)
+			}
+		}
+	})
+}
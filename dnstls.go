@@ -0,0 +1,262 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"crypto/tls"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"net"
+	"net/http"
+	"os"
+	"sync"
+	"time"
+)
+
+const (
+	DNS_MAX_MSG_SIZE = 65535
+
+	DOT_RETRIES = 2
+
+	DOH_MEDIA_TYPE   = "application/dns-message"
+	DOH_IDLE_CONNS   = 4
+	DOH_IDLE_TIMEOUT = 5 * time.Minute
+)
+
+/*
+ * DNS over TLS
+ *
+ * RFC 7858 over one persistent connection. Queries are pipelined: each gets
+ * a fresh message ID on the wire and a reader goroutine hands the answers,
+ * which may come back in any order (RFC 7766), to the waiting callers. A
+ * connection the server closed, or one that let a query time out, is
+ * dropped and the next query dials a new one.
+ */
+type dotExchanger struct {
+	address string
+	tlsConf *tls.Config
+
+	mutex sync.Mutex
+	conn  *dotConn
+}
+
+type dotConn struct {
+	conn       net.Conn
+	writeMutex sync.Mutex
+
+	mutex   sync.Mutex
+	pending map[uint16]chan []byte
+	nextId  uint16
+	err     error // set once the connection is unusable
+}
+
+func newDotExchanger(address string) *dotExchanger {
+	host, _, _ := net.SplitHostPort(address)
+	return &dotExchanger{
+		address: address,
+		tlsConf: &tls.Config{ServerName: host, MinVersion: tls.VersionTLS12},
+	}
+}
+
+func (self *dotExchanger) exchange(query []byte) ([]byte, error) {
+	var err error
+	for i := 0; i < DOT_RETRIES; i++ {
+		var conn *dotConn
+		if conn, err = self.get(); err != nil {
+			return nil, err
+		}
+
+		var resp []byte
+		if resp, err = conn.exchange(query); err == nil {
+			return resp, nil
+		}
+
+		// a reused connection may have been closed under us, a
+		// timeout is not worth waiting for twice
+		if isTimeout(err) {
+			break
+		}
+	}
+
+	return nil, err
+}
+
+func (self *dotExchanger) get() (*dotConn, error) {
+	self.mutex.Lock()
+	defer self.mutex.Unlock()
+
+	if self.conn != nil && self.conn.usable() {
+		return self.conn, nil
+	}
+
+	dialer := &net.Dialer{Timeout: DNS_TIMEOUT}
+	conn, err := tls.DialWithDialer(dialer, "tcp", self.address, self.tlsConf)
+	if err != nil {
+		return nil, err
+	}
+
+	self.conn = &dotConn{conn: conn, pending: make(map[uint16]chan []byte)}
+	go self.conn.reader()
+	return self.conn, nil
+}
+
+func (self *dotConn) exchange(query []byte) ([]byte, error) {
+	if len(query) < 2 {
+		return nil, errDnsMsgInval
+	}
+
+	done := make(chan []byte, 1)
+
+	self.mutex.Lock()
+	if self.err != nil {
+		self.mutex.Unlock()
+		return nil, self.err
+	}
+
+	id := self.nextId
+	for self.pending[id] != nil {
+		id++
+	}
+
+	self.nextId = id + 1
+	self.pending[id] = done
+	self.mutex.Unlock()
+
+	msg := make([]byte, 2+len(query))
+	binary.BigEndian.PutUint16(msg, uint16(len(query)))
+	copy(msg[2:], query)
+	binary.BigEndian.PutUint16(msg[2:], id)
+
+	self.writeMutex.Lock()
+	self.conn.SetWriteDeadline(time.Now().Add(DNS_TIMEOUT))
+	_, err := self.conn.Write(msg)
+	self.writeMutex.Unlock()
+	if err != nil {
+		self.fail(err)
+		return nil, err
+	}
+
+	timer := time.NewTimer(DNS_TIMEOUT)
+	defer timer.Stop()
+
+	select {
+	case resp, ok := <-done:
+		if !ok {
+			return nil, self.failure()
+		}
+
+		// the caller matches the answer against its own ID
+		copy(resp, query[:2])
+		return resp, nil
+	case <-timer.C:
+		self.fail(os.ErrDeadlineExceeded)
+		return nil, os.ErrDeadlineExceeded
+	}
+}
+
+func (self *dotConn) reader() {
+	r := bufio.NewReader(self.conn)
+	var hdr [2]byte
+	for {
+		if _, err := io.ReadFull(r, hdr[:]); err != nil {
+			self.fail(err)
+			return
+		}
+
+		resp := make([]byte, binary.BigEndian.Uint16(hdr[:]))
+		if _, err := io.ReadFull(r, resp); err != nil {
+			self.fail(err)
+			return
+		}
+
+		if len(resp) < 2 {
+			continue
+		}
+
+		id := binary.BigEndian.Uint16(resp)
+		self.mutex.Lock()
+		done := self.pending[id]
+		delete(self.pending, id)
+		self.mutex.Unlock()
+
+		if done != nil {
+			done <- resp
+		}
+	}
+}
+
+// fail wakes every pending query and closes the connection, the first
+// error sticks.
+func (self *dotConn) fail(err error) {
+	self.mutex.Lock()
+	if self.err == nil {
+		self.err = err
+		for id, done := range self.pending {
+			close(done)
+			delete(self.pending, id)
+		}
+	}
+	self.mutex.Unlock()
+
+	self.conn.Close()
+}
+
+func (self *dotConn) failure() error {
+	self.mutex.Lock()
+	defer self.mutex.Unlock()
+	return self.err
+}
+
+func (self *dotConn) usable() bool {
+	return self.failure() == nil
+}
+
+/*
+ * DNS over HTTPS
+ *
+ * RFC 8484 POST requests through net/http, which keeps the connections
+ * alive and multiplexes concurrent queries as HTTP/2 streams.
+ */
+type dohExchanger struct {
+	url    string
+	client *http.Client
+}
+
+func newDohExchanger(url string) *dohExchanger {
+	return &dohExchanger{
+		url: url,
+		client: &http.Client{
+			Timeout: DNS_TIMEOUT,
+			Transport: &http.Transport{
+				ForceAttemptHTTP2:   true,
+				MaxIdleConnsPerHost: DOH_IDLE_CONNS,
+				IdleConnTimeout:     DOH_IDLE_TIMEOUT,
+				TLSHandshakeTimeout: DNS_TIMEOUT,
+			},
+		},
+	}
+}
+
+func (self *dohExchanger) exchange(query []byte) ([]byte, error) {
+	req, err := http.NewRequest(http.MethodPost, self.url, bytes.NewReader(query))
+	if err != nil {
+		return nil, err
+	}
+
+	req.Header.Set("Content-Type", DOH_MEDIA_TYPE)
+	req.Header.Set("Accept", DOH_MEDIA_TYPE)
+
+	resp, err := self.client.Do(req)
+	if err != nil {
+		return nil, err
+	}
+	defer resp.Body.Close()
+
+	if resp.StatusCode != http.StatusOK {
+		io.Copy(io.Discard, io.LimitReader(resp.Body, DNS_MAX_MSG_SIZE))
+		return nil, fmt.Errorf("doh: %s", resp.Status)
+	}
+
+	return io.ReadAll(io.LimitReader(resp.Body, DNS_MAX_MSG_SIZE))
+}
@@ -0,0 +1,402 @@
+//go:build linux
+
+package main
+
+import (
+	"net"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+)
+
+const (
+	EPOLL_MAX_EVENTS   = 256
+	EPOLL_SWEEP_PERIOD = time.Second
+)
+
+/*
+ * Relay (epoll)
+ *
+ * The goroutine pair of spliceConnection costs two stacks per tunnel, idle
+ * or not. Here the tunnel is handed to one of a few event loops instead: the
+ * sockets are duplicated out of the runtime, the handling goroutine returns,
+ * and a tunnel is a couple of small structs until data shows up. A buffer is
+ * only taken from the pool while bytes are on their way, and only kept when
+ * the destination cannot take all of them yet; then reading stops until the
+ * destination turns writable. Idle and lifetime limits are checked by a
+ * sweep every EPOLL_SWEEP_PERIOD.
+ *
+ * Tunnels handed over keep counting against -max-conns and -max-per-ip
+ * until the loop closes them.
+ */
+type epollSide struct {
+	fd     int
+	tunnel *epollTunnel
+	peer   *epollSide
+	meter  *relayMeter // counts what is read on this side
+	events uint32      // current interest
+
+	// read on this side, not fully written to the peer yet
+	pending *[]byte
+	off     int
+	end     int
+	eof     bool // read EOF, the peer got its write side shut down
+}
+
+type epollTunnel struct {
+	sides   [2]epollSide
+	act     *relayActivity
+	release func() // admission slots of the connection, may be nil
+	closed  bool
+}
+
+// a loop owns its tunnels, other goroutines only queue new ones
+type epollLoop struct {
+	epfd  int
+	wake  [2]int // pipe, readable while `incoming` is not empty
+	sides map[int32]*epollSide
+
+	mutex    sync.Mutex
+	incoming []*epollTunnel
+}
+
+var relayLoops []*epollLoop
+var relayLoopSeq atomic.Uint32
+
+func startRelayLoops(count int) error {
+	for i := 0; i < count; i++ {
+		epfd, err := syscall.EpollCreate1(syscall.EPOLL_CLOEXEC)
+		if err != nil {
+			return err
+		}
+
+		loop := &epollLoop{epfd: epfd, sides: make(map[int32]*epollSide)}
+		err = syscall.Pipe2(loop.wake[:], syscall.O_NONBLOCK|syscall.O_CLOEXEC)
+		if err != nil {
+			return err
+		}
+
+		ev := syscall.EpollEvent{Events: syscall.EPOLLIN, Fd: int32(loop.wake[0])}
+		err = syscall.EpollCtl(epfd, syscall.EPOLL_CTL_ADD, loop.wake[0], &ev)
+		if err != nil {
+			return err
+		}
+
+		relayLoops = append(relayLoops, loop)
+		go loop.run()
+	}
+
+	return nil
+}
+
+// handOffRelay moves a tunnel to an event loop, the caller may close its
+// connections right after. It returns false when the tunnel has to be relayed
+// by the caller.
+func handOffRelay(source, target net.Conn, up, down *relayMeter, release func()) bool {
+	if len(relayLoops) == 0 || up.limited() || down.limited() {
+		return false
+	}
+
+	src, ok := source.(*net.TCPConn)
+	if !ok {
+		return false
+	}
+
+	dst, ok := target.(*net.TCPConn)
+	if !ok {
+		return false
+	}
+
+	srcFd, err := dupFd(src)
+	if err != nil {
+		return false
+	}
+
+	dstFd, err := dupFd(dst)
+	if err != nil {
+		syscall.Close(srcFd)
+		return false
+	}
+
+	tunnel := &epollTunnel{act: up.act, release: release}
+	tunnel.sides[0] = epollSide{fd: srcFd, tunnel: tunnel, meter: up}
+	tunnel.sides[1] = epollSide{fd: dstFd, tunnel: tunnel, meter: down}
+	tunnel.sides[0].peer = &tunnel.sides[1]
+	tunnel.sides[1].peer = &tunnel.sides[0]
+
+	metrics.active.Add(1)
+	relayLoops[relayLoopSeq.Add(1)%uint32(len(relayLoops))].add(tunnel)
+	return true
+}
+
+// dupFd takes a non-blocking copy of the socket, closing the connection
+// afterwards leaves the socket open.
+func dupFd(conn *net.TCPConn) (int, error) {
+	raw, err := conn.SyscallConn()
+	if err != nil {
+		return -1, err
+	}
+
+	ret := -1
+	var serr syscall.Errno
+	err = raw.Control(func(fd uintptr) {
+		r, _, e := syscall.Syscall(syscall.SYS_FCNTL, fd, syscall.F_DUPFD_CLOEXEC, 0)
+		ret, serr = int(r), e
+	})
+
+	if err != nil {
+		return -1, err
+	}
+
+	if serr != 0 {
+		return -1, serr
+	}
+
+	if err = syscall.SetNonblock(ret, true); err != nil {
+		syscall.Close(ret)
+		return -1, err
+	}
+
+	return ret, nil
+}
+
+func (self *epollLoop) add(tunnel *epollTunnel) {
+	self.mutex.Lock()
+	self.incoming = append(self.incoming, tunnel)
+	wake := len(self.incoming) == 1
+	self.mutex.Unlock()
+
+	if wake {
+		syscall.Write(self.wake[1], []byte{0})
+	}
+}
+
+func (self *epollLoop) register() {
+	var buffer [64]byte
+	for {
+		if n, _ := syscall.Read(self.wake[0], buffer[:]); n <= 0 {
+			break
+		}
+	}
+
+	self.mutex.Lock()
+	incoming := self.incoming
+	self.incoming = nil
+	self.mutex.Unlock()
+
+	for _, tunnel := range incoming {
+		self.registerTunnel(tunnel)
+	}
+}
+
+func (self *epollLoop) registerTunnel(tunnel *epollTunnel) {
+	for i := range tunnel.sides {
+		side := &tunnel.sides[i]
+		self.sides[int32(side.fd)] = side
+	}
+
+	for i := range tunnel.sides {
+		side := &tunnel.sides[i]
+		side.events = syscall.EPOLLIN
+		ev := syscall.EpollEvent{Events: side.events, Fd: int32(side.fd)}
+		if err := syscall.EpollCtl(self.epfd, syscall.EPOLL_CTL_ADD, side.fd, &ev); err != nil {
+			perror("epoll: %s", err)
+			self.close(tunnel, true)
+			return
+		}
+	}
+}
+
+func (self *epollLoop) run() {
+	events := make([]syscall.EpollEvent, EPOLL_MAX_EVENTS)
+	nextSweep := time.Now().Add(EPOLL_SWEEP_PERIOD)
+	for {
+		n, err := syscall.EpollWait(self.epfd, events, int(EPOLL_SWEEP_PERIOD/time.Millisecond))
+		if err != nil && err != syscall.EINTR {
+			perror("epoll: %s", err)
+			return
+		}
+
+		for i := 0; i < n; i++ {
+			if events[i].Fd == int32(self.wake[0]) {
+				self.register()
+				continue
+			}
+
+			if side := self.sides[events[i].Fd]; side != nil {
+				self.dispatch(side, events[i].Events)
+			}
+		}
+
+		if now := time.Now(); now.After(nextSweep) {
+			self.sweep()
+			nextSweep = now.Add(EPOLL_SWEEP_PERIOD)
+		}
+	}
+}
+
+func (self *epollLoop) dispatch(side *epollSide, events uint32) {
+	tunnel := side.tunnel
+	if events&syscall.EPOLLERR != 0 {
+		self.close(tunnel, true)
+		return
+	}
+
+	// `side` is where the peer's pending bytes go
+	if events&(syscall.EPOLLOUT|syscall.EPOLLHUP) != 0 && side.peer.pending != nil {
+		self.flush(side.peer)
+	}
+
+	if !tunnel.closed && events&(syscall.EPOLLIN|syscall.EPOLLHUP) != 0 {
+		if side.eof {
+			// hung up for good, nothing can reach it any more
+			self.close(tunnel, false)
+			return
+		}
+
+		self.pump(side)
+	}
+}
+
+// pump reads what `side` has and passes it to the peer.
+func (self *epollLoop) pump(side *epollSide) {
+	if side.pending != nil || side.eof {
+		return
+	}
+
+	buffer := getBuffer(RELAY_BUF_SIZE)
+	n, err := syscall.Read(side.fd, *buffer)
+	if err == syscall.EAGAIN || err == syscall.EINTR {
+		putBuffer(buffer)
+		return
+	}
+
+	if err != nil {
+		putBuffer(buffer)
+		side.meter.end(err)
+		self.close(side.tunnel, true)
+		return
+	}
+
+	if n == 0 {
+		// EOF: half-close, the other direction may still be busy
+		putBuffer(buffer)
+		side.meter.end(nil)
+		side.eof = true
+		if side.peer.eof {
+			self.close(side.tunnel, false)
+			return
+		}
+
+		syscall.Shutdown(side.peer.fd, syscall.SHUT_WR)
+		self.interest(side)
+		return
+	}
+
+	side.meter.add(int64(n))
+	side.pending, side.off, side.end = buffer, 0, n
+	self.flush(side)
+}
+
+// flush writes the pending bytes of `side` to its peer.
+func (self *epollLoop) flush(side *epollSide) {
+	for side.off < side.end {
+		n, err := syscall.Write(side.peer.fd, (*side.pending)[side.off:side.end])
+		if err == syscall.EINTR {
+			continue
+		}
+
+		if err == syscall.EAGAIN {
+			// stop reading until the peer drained some
+			self.interest(side)
+			self.interest(side.peer)
+			return
+		}
+
+		if err != nil {
+			self.close(side.tunnel, true)
+			return
+		}
+
+		side.off += n
+	}
+
+	putBuffer(side.pending)
+	side.pending = nil
+	self.interest(side)
+	self.interest(side.peer)
+}
+
+// interest reads a side while its last chunk is gone and writes it while the
+// peer has bytes for it.
+func (self *epollLoop) interest(side *epollSide) {
+	var want uint32
+	if side.pending == nil && !side.eof {
+		want |= syscall.EPOLLIN
+	}
+
+	if side.peer.pending != nil {
+		want |= syscall.EPOLLOUT
+	}
+
+	if want == side.events || side.tunnel.closed {
+		return
+	}
+
+	side.events = want
+	ev := syscall.EpollEvent{Events: want, Fd: int32(side.fd)}
+	if err := syscall.EpollCtl(self.epfd, syscall.EPOLL_CTL_MOD, side.fd, &ev); err != nil {
+		self.close(side.tunnel, true)
+	}
+}
+
+// sweep ends the tunnels that were idle or open for too long.
+func (self *epollLoop) sweep() {
+	var expired []*epollTunnel
+	for fd, side := range self.sides {
+		// every tunnel is in the map twice
+		if int32(side.tunnel.sides[0].fd) != fd {
+			continue
+		}
+
+		if _, ok := side.tunnel.act.next(); !ok {
+			expired = append(expired, side.tunnel)
+		}
+	}
+
+	for _, tunnel := range expired {
+		self.close(tunnel, false)
+	}
+}
+
+func (self *epollLoop) close(tunnel *epollTunnel, failed bool) {
+	if tunnel.closed {
+		return
+	}
+
+	tunnel.closed = true
+	if failed {
+		metrics.error(STAGE_RELAY)
+	}
+
+	for i := range tunnel.sides {
+		delete(self.sides, int32(tunnel.sides[i].fd))
+	}
+
+	for i := range tunnel.sides {
+		side := &tunnel.sides[i]
+		if side.pending != nil {
+			putBuffer(side.pending)
+			side.pending = nil
+		}
+
+		// closing drops the epoll registration as well
+		syscall.Close(side.fd)
+	}
+
+	metrics.active.Add(-1)
+	if tunnel.release != nil {
+		tunnel.release()
+	}
+}
@@ -0,0 +1,16 @@
+//go:build !linux
+
+package main
+
+import (
+	"errors"
+	"net"
+)
+
+func startRelayLoops(count int) error {
+	return errors.New("the epoll relay engine is only supported on Linux")
+}
+
+func handOffRelay(source, target net.Conn, up, down *relayMeter, release func()) bool {
+	return false
+}
@@ -0,0 +1,55 @@
+package main
+
+import (
+	"net"
+	"time"
+)
+
+/*
+ * Fragmentation
+ *
+ * The request (HTTP header or TLS ClientHello) is written in fragments of
+ * growing size: `first`, `first`, 2*`first`, 4*`first`... Only the start of
+ * the message has to be cut for DPI, doubling keeps the write count
+ * logarithmic for big headers.
+ *
+ * Every fragment is a separate write on a TCP_NODELAY socket, so it leaves in
+ * its own segment. They must not be merged into one writev/net.Buffers call,
+ * that would give the kernel a single contiguous payload again. On a
+ * congested path the kernel may still coalesce queued fragments; `delay`
+ * spaces the writes out to prevent that.
+ */
+func writeFragments(conn net.Conn, buffer []byte, first int, delay time.Duration) error {
+	if tcp, ok := conn.(*net.TCPConn); ok {
+		if err := tcp.SetNoDelay(true); err != nil {
+			return err
+		}
+	}
+
+	if first <= 0 {
+		first = len(buffer)
+	}
+
+	size := first
+	for snd := 0; snd < len(buffer); {
+		end := snd + size
+		if end > len(buffer) {
+			end = len(buffer)
+		}
+
+		if _, err := conn.Write(buffer[snd:end]); err != nil {
+			return err
+		}
+
+		if snd > 0 {
+			size *= 2
+		}
+
+		snd = end
+		if delay > 0 && snd < len(buffer) {
+			time.Sleep(delay)
+		}
+	}
+
+	return nil
+}
@@ -0,0 +1,32 @@
+package main
+
+import (
+	"syscall"
+	"testing"
+)
+
+func TestWriteFragmentsNoDelay(t *testing.T) {
+	out, _ := tcpPair(t)
+	raw, err := out.SyscallConn()
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	// net turns Nagle off by default, writeFragments must not rely on it
+	if err = out.SetNoDelay(false); err != nil {
+		t.Fatal(err)
+	}
+
+	if err = writeFragments(out, []byte("hello"), 1, 0); err != nil {
+		t.Fatal(err)
+	}
+
+	var v int
+	raw.Control(func(fd uintptr) {
+		v, err = syscall.GetsockoptInt(int(fd), syscall.IPPROTO_TCP, syscall.TCP_NODELAY)
+	})
+
+	if err != nil || v == 0 {
+		t.Fatalf("TCP_NODELAY %d: %v", v, err)
+	}
+}
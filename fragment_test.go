@@ -0,0 +1,167 @@
+package main
+
+import (
+	"bytes"
+	"net"
+	"testing"
+	"time"
+)
+
+// recordConn keeps every write it gets as one fragment.
+type recordConn struct {
+	net.Conn
+	writes [][]byte
+}
+
+func (self *recordConn) Write(b []byte) (int, error) {
+	self.writes = append(self.writes, append([]byte(nil), b...))
+	return len(b), nil
+}
+
+// discardConn takes writes and drops them.
+type discardConn struct {
+	net.Conn
+}
+
+func (self discardConn) Write(b []byte) (int, error) { return len(b), nil }
+
+// tcpPair connects two ends over loopback.
+func tcpPair(t *testing.T) (*net.TCPConn, *net.TCPConn) {
+	l, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer l.Close()
+
+	client, err := net.Dial("tcp", l.Addr().String())
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	server, err := l.Accept()
+	if err != nil {
+		client.Close()
+		t.Fatal(err)
+	}
+
+	t.Cleanup(func() {
+		client.Close()
+		server.Close()
+	})
+
+	return client.(*net.TCPConn), server.(*net.TCPConn)
+}
+
+func TestWriteFragments(t *testing.T) {
+	const delay = 20 * time.Millisecond
+
+	cases := []struct {
+		size, first int
+		want        []int
+	}{
+		{1000, 100, []int{100, 100, 200, 400, 200}},
+		{517, 2, []int{2, 2, 4, 8, 16, 32, 64, 128, 256, 5}},
+		{64, 64, []int{64}},
+		{64, 0, []int{64}},
+	}
+
+	for _, tc := range cases {
+		out, in := tcpPair(t)
+		buffer := make([]byte, tc.size)
+		for i := range buffer {
+			buffer[i] = byte(i)
+		}
+
+		errs := make(chan error, 1)
+		go func() {
+			errs <- writeFragments(out, buffer, tc.first, delay)
+			out.CloseWrite()
+		}()
+
+		// the fragments are spaced out, every read returns exactly one
+		var got []int
+		var recvd []byte
+		b := make([]byte, 4096)
+		for {
+			n, err := in.Read(b)
+			if n > 0 {
+				got = append(got, n)
+				recvd = append(recvd, b[:n]...)
+			}
+
+			if err != nil {
+				break
+			}
+		}
+
+		if err := <-errs; err != nil {
+			t.Fatal(err)
+		}
+
+		if !bytes.Equal(recvd, buffer) {
+			t.Fatalf("%d/%d: payload reordered or lost", tc.size, tc.first)
+		}
+
+		if len(got) != len(tc.want) {
+			t.Fatalf("%d/%d: segments %v, want %v", tc.size, tc.first, got, tc.want)
+		}
+
+		for i := range got {
+			if got[i] != tc.want[i] {
+				t.Fatalf("%d/%d: segments %v, want %v", tc.size, tc.first, got, tc.want)
+			}
+		}
+	}
+}
+
+func FuzzWriteFragments(f *testing.F) {
+	f.Add(make([]byte, 1000), 100)
+	f.Add(newClientHello("example.com"), HTTPS_HELO_SPLIT_SIZE)
+	f.Add([]byte("GET / HTTP/1.1\r\nHost: a\r\n\r\n"), HTTP_HEADER_SPLIT_SIZE)
+	f.Add([]byte("x"), 0)
+
+	f.Fuzz(func(t *testing.T, buffer []byte, first int) {
+		if first > 1<<16 {
+			first %= 1 << 16
+		}
+
+		var conn recordConn
+		if err := writeFragments(&conn, buffer, first, 0); err != nil {
+			t.Fatal(err)
+		}
+
+		// the fragments reassemble to the input, sized first, first,
+		// 2*first... with only the last one cut short
+		if got := bytes.Join(conn.writes, nil); !bytes.Equal(got, buffer) {
+			t.Fatalf("%d/%d: %q reassembled to %q", len(buffer), first, buffer, got)
+		}
+
+		size := first
+		if size <= 0 {
+			size = len(buffer)
+		}
+
+		for i, w := range conn.writes {
+			if len(w) == 0 || len(w) > size || (len(w) < size && i != len(conn.writes)-1) {
+				t.Fatalf("%d/%d: fragment %d is %d bytes, want %d",
+					len(buffer), first, i, len(w), size)
+			}
+
+			if i > 0 {
+				size *= 2
+			}
+		}
+	})
+}
+
+func BenchmarkWriteFragments(b *testing.B) {
+	hello := newClientHello("example.com")
+	var conn net.Conn = discardConn{}
+	b.ReportAllocs()
+	b.SetBytes(int64(len(hello)))
+	for i := 0; i < b.N; i++ {
+		if err := writeFragments(conn, hello, HTTPS_HELO_SPLIT_SIZE, 0); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
@@ -0,0 +1,325 @@
+package main
+
+import (
+	"errors"
+	"io"
+	"net"
+	"os"
+	"syscall"
+	"time"
+)
+
+/*
+ * HTTP Forwarder
+ *
+ * Plain HTTP is forwarded message by message instead of being spliced after
+ * the first request, so every request on a keep-alive connection gets its
+ * request line rewritten to origin-form and its header split. The upstream
+ * connection is kept while the requests go to the same hostPort, and
+ * replaced when they do not. Responses are framed as well, which is what
+ * tells when the next request may go out. A 101 Switching Protocols
+ * response turns the connection into a plain tunnel.
+ *
+ * Both sides are read and written under one relayActivity for the whole
+ * connection, as a tunnel is: a silent upstream, a client that stops half
+ * way through a body or an idle keep-alive connection end after
+ * `idleTimeout`, and none outlives `maxLifetime`.
+ */
+type httpExchange struct {
+	req      httpRequest
+	framing  httpFraming
+	hostPort string
+	reused   bool
+}
+
+// forwardHttp takes over the client buffer: `in` holds the first request
+// header, already parsed into `req`.
+func (self *client) forwardHttp(req *httpRequest, headerLen int, recvd int) error {
+	in := newHttpStream(self.source, self.buffer, 0, recvd, self.cfg.maxHeaderSize)
+	in.hdrLen = headerLen
+	in.meter = &relayMeter{act: newRelayActivity(self.cfg), direction: DIRECTION_UP, shard: self.shard}
+	self.buffer = nil
+	defer in.release()
+
+	var upHostPort string
+	for {
+		var ex httpExchange
+		ex.req = *req
+
+		var err error
+		if ex.framing, err = scanFraming(in.header()); err != nil {
+			return err
+		}
+
+		ex.hostPort = ex.req.hostPort
+		if self.target != nil && upHostPort == ex.hostPort {
+			ex.reused = true
+		} else {
+			self.closeTarget()
+			self.target = nil
+			if self.target, err = dialTarget(self.cfg, ex.hostPort); err != nil {
+				return err
+			}
+
+			self.trace.mark(TRACE_DIAL)
+			upHostPort = ex.hostPort
+		}
+
+		keep, err := self.exchangeHttp(in, &ex)
+		if err != nil || !keep {
+			return err
+		}
+
+		// the next request on this connection, within `idleTimeout` of
+		// the last response
+		in.consume(in.hdrLen)
+		if err = in.readHeader(); err != nil {
+			if len(in.buffered()) == 0 && (err == io.EOF || isTimeout(err)) {
+				// closed or idle between two messages
+				return nil
+			}
+
+			return self.rejectRequest(in, err)
+		}
+
+		if err = req.parse(in.header()); err != nil {
+			return self.rejectRequest(in, err)
+		}
+
+		if req.hasConnectMethod {
+			return errHttpRequestInval
+		}
+
+		if hostRule(self.cfg, req.hostPort) == RULE_BLOCK {
+			metrics.blocked.Add(1)
+			in.meter.write(self.source, resHttpForbidden)
+			info("%s -> %s: %s", self.source.RemoteAddr(), req.hostPort, errRuleBlocked)
+			return nil
+		}
+
+		info("%s -> %s %s (keep-alive)", self.source.RemoteAddr(), req.method, req.hostPort)
+	}
+}
+
+// rejectRequest answers a request header that cannot be forwarded and
+// returns `err` for the connection's log line.
+func (self *client) rejectRequest(in *httpStream, err error) error {
+	if err == errHttpHeaderTooBig {
+		in.meter.write(self.source, resHttpHeaderTooBig)
+	} else {
+		in.meter.write(self.source, resHttpBadRequest)
+	}
+
+	return atStage(STAGE_PARSE, err)
+}
+
+// exchangeHttp forwards one request with its body and the response to it.
+// It reports whether both sides keep the connection open.
+func (self *client) exchangeHttp(in *httpStream, ex *httpExchange) (bool, error) {
+	header := in.header()
+	rewritten, err := ex.req.newHttpRequest(header)
+	if err != nil {
+		return false, err
+	}
+
+	host, _, _ := net.SplitHostPort(ex.hostPort)
+	self.shape(in.meter, host)
+	st := strategies.pick(self.cfg, host, false)
+	if err = self.sendHttpRequest(in, rewritten, st); err != nil {
+		return false, err
+	}
+
+	sentAt := time.Now()
+	self.trace.mark(TRACE_HELLO)
+
+	// a black-holed request counts as a timeout long before the relay
+	// gives up on it
+	var probe *responseProbe
+	startProbe := func() {
+		if strategies.adaptive {
+			probe = newResponseProbe(self.cfg.strategyTimeout, func(res outcome) {
+				strategies.report(self.cfg, host, false, st, res)
+			})
+		}
+	}
+	startProbe()
+
+	// the body goes up while the response comes down, which keeps
+	// "Expect: 100-continue" working
+	in.consume(in.hdrLen)
+	in.hdrLen = 0
+
+	bodyDone := make(chan error, 1)
+	go func() {
+		err := errHandlerPanic
+		defer func() {
+			bodyDone <- err
+		}()
+		defer recoverConn(self.source, self.target)
+		err = copyBody(in, self.target, ex.framing, true)
+	}()
+
+	out := newHttpStream(self.target, getBuffer(self.cfg.bufferSize), 0, 0, self.cfg.maxHeaderSize)
+	out.meter = self.shape(&relayMeter{act: in.meter.act, direction: DIRECTION_DOWN,
+		shard: self.shard}, host)
+	defer func() {
+		out.release()
+	}()
+
+	hasBody := ex.framing.chunked || ex.framing.contentLength > 0
+
+	var resp httpFraming
+	var code int
+	for first := true; ; {
+		err = out.readHeader()
+		if first && err != nil && ex.reused && !hasBody && isConnGone(err) {
+			// the upstream dropped the idle connection just now, the
+			// request is sent again on a fresh one
+			<-bodyDone
+			bodyDone <- nil
+
+			self.target.Close()
+			if self.target, err = dialTarget(self.cfg, ex.hostPort); err != nil {
+				return false, err
+			}
+
+			ex.reused = false
+			if probe != nil {
+				probe.timer.Stop()
+			}
+
+			if err = self.sendHttpRequest(in, rewritten, st); err != nil {
+				return false, err
+			}
+
+			startProbe()
+
+			out.release()
+			out = newHttpStream(self.target, getBuffer(self.cfg.bufferSize), 0, 0, self.cfg.maxHeaderSize)
+			out.meter = self.shape(&relayMeter{act: in.meter.act, direction: DIRECTION_DOWN,
+				shard: self.shard}, host)
+			sentAt = time.Now()
+			continue
+		}
+
+		if first {
+			if probe != nil {
+				probe.done(out.end-out.start, err)
+			}
+
+			if err == nil {
+				metrics.ttfb.observe(time.Since(sentAt))
+				self.trace.mark(TRACE_FIRST_BYTE)
+			}
+			first = false
+		}
+
+		if err == nil {
+			code, err = parseStatus(out.header())
+		}
+
+		if err == nil {
+			resp, err = scanFraming(out.header())
+		}
+
+		if err == nil {
+			err = out.meter.write(self.source, out.header())
+		}
+
+		if err != nil {
+			<-bodyDone
+			return false, err
+		}
+
+		out.consume(out.hdrLen)
+		if code >= 200 || code == 101 {
+			break
+		}
+	}
+
+	if code == 101 {
+		// protocol switch: whatever both sides buffered goes first, the
+		// rest is a tunnel
+		if err = <-bodyDone; err != nil {
+			return false, err
+		}
+
+		return false, self.tunnel(in, out, host)
+	}
+
+	noBody := ex.req.method == "HEAD" || code == 204 || code == 304
+	if noBody {
+		resp = httpFraming{contentLength: 0, close: resp.close, keepAlive: resp.keepAlive}
+	}
+
+	err = copyBody(out, self.source, resp, false)
+	if bodyErr := <-bodyDone; err == nil {
+		err = bodyErr
+	}
+
+	if err != nil {
+		return false, err
+	}
+
+	keep := wantsKeepAlive(ex.req.version, ex.framing) &&
+		wantsKeepAlive(ex.req.version, resp) &&
+		(resp.chunked || resp.contentLength >= 0)
+
+	return keep, nil
+}
+
+// sendHttpRequest sends the request header in time, or not at all.
+func (self *client) sendHttpRequest(in *httpStream, header []byte, st strategy) error {
+	if !in.meter.arm(self.target, nil) {
+		return os.ErrDeadlineExceeded
+	}
+
+	return self.sendRequest(header, st)
+}
+
+func (self *client) tunnel(in *httpStream, out *httpStream, host string) error {
+	if window := in.buffered(); len(window) > 0 {
+		if err := in.meter.write(self.target, window); err != nil {
+			return err
+		}
+	}
+
+	if window := out.buffered(); len(window) > 0 {
+		if err := out.meter.write(self.source, window); err != nil {
+			return err
+		}
+	}
+
+	in.release()
+	out.release()
+	self.spliceConnection(host)
+	return nil
+}
+
+// copyBody forwards one message body from `src` to `dst`. A request without
+// length has no body; a response without one lasts until EOF.
+func copyBody(src *httpStream, dst net.Conn, framing httpFraming, isRequest bool) error {
+	switch {
+	case framing.chunked:
+		return src.copyChunked(dst)
+	case framing.contentLength > 0:
+		return src.copyN(dst, framing.contentLength)
+	case framing.contentLength == 0 || isRequest:
+		return nil
+	}
+
+	return src.copyAll(dst)
+}
+
+func wantsKeepAlive(version string, framing httpFraming) bool {
+	if framing.close {
+		return false
+	}
+
+	return version != "HTTP/1.0" || framing.keepAlive
+}
+
+func isConnGone(err error) bool {
+	return errors.Is(err, io.EOF) || errors.Is(err, syscall.ECONNRESET) ||
+		errors.Is(err, syscall.EPIPE)
+}
@@ -0,0 +1,129 @@
+package main
+
+import (
+	"io"
+	"net"
+	"testing"
+	"time"
+)
+
+// newTestClient serves `source` with a config parsed from `args`, setting up
+// what runServer would for a proxy that was never started.
+func newTestClient(t *testing.T, source net.Conn, args ...string) *client {
+	c, err := loadConfig(args)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	if dnsResolver == nil {
+		if dnsResolver, err = newResolver(c); err != nil {
+			t.Fatal(err)
+		}
+	}
+
+	if targetDialer == nil {
+		targetDialer = newDialer(c)
+	}
+
+	if strategies == nil {
+		strategies = newStrategyTable(c)
+	}
+
+	self := NewClient(source, false)
+	self.cfg = c
+	return self
+}
+
+// forwardSilent sends one request through a client made from `args` to an
+// origin that takes it and never answers, and waits for the connection to
+// be closed on both sides.
+func forwardSilent(t *testing.T, idle time.Duration, args ...string) *client {
+	origin, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer origin.Close()
+
+	upClosed := make(chan error, 1)
+	go func() {
+		conn, err := origin.Accept()
+		if err != nil {
+			upClosed <- err
+			return
+		}
+		defer conn.Close()
+
+		conn.SetReadDeadline(time.Now().Add(10 * idle))
+		_, err = io.Copy(io.Discard, conn)
+		upClosed <- err
+	}()
+
+	user, source := tcpPair(t)
+	args = append([]string{"-log-level", "error", "-idle-timeout", idle.String()}, args...)
+	self := newTestClient(t, source, args...)
+	done := make(chan struct{})
+	go func() {
+		self.handle()
+		close(done)
+	}()
+
+	addr := origin.Addr().String()
+	if _, err = user.Write([]byte("GET http://" + addr + "/ HTTP/1.1\r\nHost: " + addr + "\r\n\r\n")); err != nil {
+		t.Fatal(err)
+	}
+
+	select {
+	case <-done:
+	case <-time.After(10 * idle):
+		t.Fatal("connection outlived the idle timeout")
+	}
+
+	// both sides see the connection closed, not the origin's own deadline
+	if err = <-upClosed; err != nil {
+		t.Fatalf("origin: %v", err)
+	}
+
+	user.SetReadDeadline(time.Now().Add(idle))
+	if _, err = user.Read(make([]byte, 1)); err != io.EOF {
+		t.Fatalf("client: %v", err)
+	}
+
+	return self
+}
+
+func TestForwardHttpSilentOrigin(t *testing.T) {
+	forwardSilent(t, 200*time.Millisecond)
+}
+
+func TestForwardHttpProbeTimeout(t *testing.T) {
+	const idle = time.Second
+
+	saved := strategies
+	t.Cleanup(func() { strategies = saved })
+
+	c := defaultCfg
+	c.adaptive = true
+	strategies = newStrategyTable(&c)
+	start := strategies.pick(&c, "127.0.0.1", false)
+
+	// the strategy gives up on the request well before the relay does
+	moved := make(chan time.Duration, 1)
+	began := time.Now()
+	go func() {
+		for time.Since(began) < 2*idle {
+			if strategies.pick(&c, "127.0.0.1", false) != start {
+				moved <- time.Since(began)
+				return
+			}
+
+			time.Sleep(10 * time.Millisecond)
+		}
+
+		moved <- 2 * idle
+	}()
+
+	forwardSilent(t, idle, "-adaptive", "-strategy-timeout", "50ms")
+	if after := <-moved; after >= idle/2 {
+		t.Fatalf("moved past %v after %v", start, after)
+	}
+}
@@ -0,0 +1,338 @@
+package main
+
+import (
+	"bytes"
+	"errors"
+	"io"
+	"net"
+	"strconv"
+)
+
+var errHttpChunkInval = errors.New("invalid chunked encoding")
+
+/*
+ * HTTP Stream
+ *
+ * A pooled read buffer over one side of a plain HTTP connection. Bytes in
+ * [start, end) are received but not consumed yet, and after readHeader the
+ * first `hdrLen` of them are a complete message header.
+ */
+type httpStream struct {
+	conn    net.Conn
+	buffer  *[]byte
+	start   int
+	end     int
+	hdrLen  int
+	maxSize int
+	meter   *relayMeter // body bytes and the deadlines, may be nil
+}
+
+func newHttpStream(conn net.Conn, buffer *[]byte, start, end, maxSize int) *httpStream {
+	return &httpStream{
+		conn:    conn,
+		buffer:  buffer,
+		start:   start,
+		end:     end,
+		maxSize: maxSize,
+	}
+}
+
+func (self *httpStream) release() {
+	if self.buffer != nil {
+		putBuffer(self.buffer)
+		self.buffer = nil
+	}
+}
+
+func (self *httpStream) buffered() []byte {
+	return (*self.buffer)[self.start:self.end]
+}
+
+func (self *httpStream) header() []byte {
+	return (*self.buffer)[self.start : self.start+self.hdrLen]
+}
+
+func (self *httpStream) consume(n int) {
+	self.start += n
+	if self.start == self.end {
+		self.start, self.end = 0, 0
+	}
+}
+
+// fill reads more bytes, moving the window to the front or growing the
+// buffer (up to `maxSize`) when there is no room left.
+func (self *httpStream) fill() error {
+	buffer := *self.buffer
+	if self.end == len(buffer) {
+		if self.start > 0 {
+			self.end = copy(buffer, buffer[self.start:self.end])
+			self.start = 0
+		} else if len(buffer) < self.maxSize {
+			size := 2 * len(buffer)
+			if size > self.maxSize {
+				size = self.maxSize
+			}
+
+			grown := getBuffer(size)
+			copy(*grown, buffer[:self.end])
+			putBuffer(self.buffer)
+			self.buffer = grown
+			buffer = *grown
+		} else {
+			return errHttpHeaderTooBig
+		}
+	}
+
+	recvd, err := self.meter.read(self.conn, buffer[self.end:])
+	self.end += recvd
+	if recvd > 0 {
+		return nil
+	}
+
+	if err == nil {
+		err = io.ErrNoProgress
+	}
+
+	return err
+}
+
+func (self *httpStream) readHeader() error {
+	scanned := 0
+	for {
+		if end := findHeaderEnd(self.buffered(), scanned); end > 0 {
+			self.hdrLen = end
+			return nil
+		}
+
+		scanned = self.end - self.start
+		if err := self.fill(); err != nil {
+			if err == io.EOF && self.end > self.start {
+				err = io.ErrUnexpectedEOF
+			}
+
+			return err
+		}
+	}
+}
+
+func (self *httpStream) readLine() ([]byte, error) {
+	scanned := 0
+	for {
+		window := self.buffered()
+		if idx := bytes.IndexByte(window[scanned:], '\n'); idx >= 0 {
+			line := window[:scanned+idx+1]
+			self.consume(len(line))
+			return line, nil
+		}
+
+		scanned = len(window)
+		if err := self.fill(); err != nil {
+			return nil, err
+		}
+	}
+}
+
+// copyN forwards `n` body bytes, the buffered ones first and the rest
+// straight from the socket (which splices them unless the direction is
+// shaped).
+func (self *httpStream) copyN(dst net.Conn, n int64) error {
+	window := self.buffered()
+	if int64(len(window)) > n {
+		window = window[:n]
+	}
+
+	if len(window) > 0 {
+		if err := self.forward(dst, window); err != nil {
+			return err
+		}
+
+		n -= int64(len(window))
+	}
+
+	if n == 0 {
+		return nil
+	}
+
+	_, err := relayN(dst, self.conn, n, self.meter)
+	return err
+}
+
+// forward writes `window`, the front of the buffered bytes, as body bytes.
+func (self *httpStream) forward(dst net.Conn, window []byte) error {
+	self.meter.throttle(int64(len(window)))
+	if err := self.meter.write(dst, window); err != nil {
+		return err
+	}
+
+	self.consume(len(window))
+	self.meter.add(int64(len(window)))
+	return nil
+}
+
+// copyChunked forwards a chunked body verbatim, trailers included.
+func (self *httpStream) copyChunked(dst net.Conn) error {
+	for {
+		line, err := self.readLine()
+		if err != nil {
+			return err
+		}
+
+		if err = self.meter.write(dst, line); err != nil {
+			return err
+		}
+
+		sizeStr := trimCR(bytes.TrimRight(line, "\n"))
+		if idx := bytes.IndexByte(sizeStr, ';'); idx >= 0 {
+			sizeStr = sizeStr[:idx]
+		}
+
+		size, err := strconv.ParseInt(string(bytes.TrimSpace(sizeStr)), 16, 64)
+		if err != nil || size < 0 {
+			return errHttpChunkInval
+		}
+
+		if size == 0 {
+			break
+		}
+
+		// chunk data and its CRLF
+		if err = self.copyN(dst, size); err != nil {
+			return err
+		}
+
+		if line, err = self.readLine(); err != nil {
+			return err
+		}
+
+		if err = self.meter.write(dst, line); err != nil {
+			return err
+		}
+	}
+
+	// trailers up to the blank line
+	for {
+		line, err := self.readLine()
+		if err != nil {
+			return err
+		}
+
+		if err = self.meter.write(dst, line); err != nil {
+			return err
+		}
+
+		if len(trimCR(bytes.TrimRight(line, "\n"))) == 0 {
+			return nil
+		}
+	}
+}
+
+// copyAll forwards everything up to EOF.
+func (self *httpStream) copyAll(dst net.Conn) error {
+	if window := self.buffered(); len(window) > 0 {
+		if err := self.forward(dst, window); err != nil {
+			return err
+		}
+	}
+
+	_, err := relay(dst, self.conn, self.meter)
+	return err
+}
+
+/*
+ * HTTP Framing
+ */
+type httpFraming struct {
+	contentLength int64 // -1: not given
+	chunked       bool
+	close         bool
+	keepAlive     bool
+	upgrade       bool
+}
+
+// scanFraming reads the headers that decide how a message body is delimited
+// and whether the connection outlives it. `header` is a complete header.
+func scanFraming(header []byte) (httpFraming, error) {
+	ret := httpFraming{contentLength: -1}
+
+	// skip the start line
+	idx := bytes.IndexByte(header, '\n')
+	if idx < 0 {
+		return ret, errHttpRequestInval
+	}
+
+	header = header[idx+1:]
+	for len(header) > 0 {
+		idx = bytes.IndexByte(header, '\n')
+		if idx < 0 {
+			break
+		}
+
+		line := trimCR(header[:idx])
+		header = header[idx+1:]
+
+		colon := bytes.IndexByte(line, ':')
+		if colon <= 0 {
+			continue
+		}
+
+		name, value := line[:colon], bytes.TrimSpace(line[colon+1:])
+		switch {
+		case asciiEqualFold(name, "content-length"):
+			n, err := strconv.ParseInt(string(value), 10, 64)
+			if err != nil || n < 0 || (ret.contentLength >= 0 && ret.contentLength != n) {
+				return ret, errHttpRequestInval
+			}
+
+			ret.contentLength = n
+		case asciiEqualFold(name, "transfer-encoding"):
+			ret.chunked = hasToken(value, "chunked")
+		case asciiEqualFold(name, "connection"):
+			ret.close = ret.close || hasToken(value, "close")
+			ret.keepAlive = ret.keepAlive || hasToken(value, "keep-alive")
+			ret.upgrade = ret.upgrade || hasToken(value, "upgrade")
+		}
+	}
+
+	return ret, nil
+}
+
+// hasToken looks for `token` in a comma separated header value.
+func hasToken(value []byte, token string) bool {
+	for len(value) > 0 {
+		item := value
+		if idx := bytes.IndexByte(value, ','); idx >= 0 {
+			item, value = value[:idx], value[idx+1:]
+		} else {
+			value = nil
+		}
+
+		if asciiEqualFold(bytes.TrimSpace(item), token) {
+			return true
+		}
+	}
+
+	return false
+}
+
+// parseStatus returns the code of an HTTP/1.x status line.
+func parseStatus(header []byte) (int, error) {
+	if len(header) < 12 || !bytes.HasPrefix(header, []byte("HTTP/")) {
+		return 0, errHttpRequestInval
+	}
+
+	sp := bytes.IndexByte(header, ' ')
+	if sp < 0 || sp+4 > len(header) {
+		return 0, errHttpRequestInval
+	}
+
+	code := 0
+	for _, c := range header[sp+1 : sp+4] {
+		if c < '0' || c > '9' {
+			return 0, errHttpRequestInval
+		}
+
+		code = code*10 + int(c-'0')
+	}
+
+	return code, nil
+}
@@ -0,0 +1,202 @@
+package main
+
+import (
+	"bufio"
+	"encoding/json"
+	"fmt"
+	"os"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+const (
+	LOG_DEBUG = iota
+	LOG_INFO
+	LOG_ERROR
+
+	LOG_QUEUE_SIZE   = 4096
+	LOG_FLUSH_PERIOD = 100 * time.Millisecond
+	LOG_TIME_FORMAT  = "2006/01/02 15:04:05"
+)
+
+var logLevelNames = [...]string{"DEBUG", "INFO", "ERROR"}
+
+/*
+ * Log wrapper
+ *
+ * Callers only format and queue a record; a single writer goroutine owns
+ * stderr and buffers it. When the queue is full the record is dropped and
+ * counted instead of stalling a connection. Every error format string is
+ * rate limited on its own, so one failing destination cannot flood the log;
+ * info and debug lines, one or two per connection, always get through.
+ */
+type logRecord struct {
+	at    time.Time
+	level int
+	msg   string
+}
+
+type logLimiter struct {
+	window     atomic.Int64 // unix second
+	count      atomic.Int64
+	suppressed atomic.Uint64
+}
+
+type asyncLogger struct {
+	level  atomic.Int32
+	json   atomic.Bool
+	rate   atomic.Int64 // per format and second, 0: unlimited
+	queue  chan logRecord
+	flush  chan chan struct{}
+	limits sync.Map // format string -> *logLimiter
+
+	dropped atomic.Uint64
+}
+
+var logger = newAsyncLogger()
+
+func newAsyncLogger() *asyncLogger {
+	ret := &asyncLogger{
+		queue: make(chan logRecord, LOG_QUEUE_SIZE),
+		flush: make(chan chan struct{}),
+	}
+
+	ret.level.Store(LOG_INFO)
+	go ret.writer()
+	return ret
+}
+
+func debug(format string, v ...any) {
+	logger.log(LOG_DEBUG, format, v...)
+}
+
+func info(format string, v ...any) {
+	logger.log(LOG_INFO, format, v...)
+}
+
+func perror(format string, v ...any) {
+	logger.log(LOG_ERROR, format, v...)
+}
+
+func (self *asyncLogger) configure(level int, asJson bool, rate int) {
+	self.level.Store(int32(level))
+	self.json.Store(asJson)
+	self.rate.Store(int64(rate))
+}
+
+func (self *asyncLogger) log(level int, format string, v ...any) {
+	if int32(level) < self.level.Load() || (level >= LOG_ERROR && !self.allow(format)) {
+		return
+	}
+
+	rec := logRecord{at: time.Now(), level: level, msg: fmt.Sprintf(format, v...)}
+	select {
+	case self.queue <- rec:
+	default:
+		self.dropped.Add(1)
+	}
+}
+
+func (self *asyncLogger) allow(format string) bool {
+	rate := self.rate.Load()
+	if rate <= 0 {
+		return true
+	}
+
+	l, ok := self.limits.Load(format)
+	if !ok {
+		l, _ = self.limits.LoadOrStore(format, &logLimiter{})
+	}
+
+	lim := l.(*logLimiter)
+	now := time.Now().Unix()
+	if win := lim.window.Load(); win != now && lim.window.CompareAndSwap(win, now) {
+		lim.count.Store(0)
+		if n := lim.suppressed.Swap(0); n > 0 {
+			self.queueNote(fmt.Sprintf("suppressed %d messages like %q", n, format))
+		}
+	}
+
+	if lim.count.Add(1) > rate {
+		lim.suppressed.Add(1)
+		return false
+	}
+
+	return true
+}
+
+func (self *asyncLogger) queueNote(msg string) {
+	select {
+	case self.queue <- logRecord{at: time.Now(), level: LOG_INFO, msg: msg}:
+	default:
+		self.dropped.Add(1)
+	}
+}
+
+// logFlush waits until everything queued so far is written, call it before
+// exiting.
+func logFlush() {
+	done := make(chan struct{})
+	logger.flush <- done
+	<-done
+}
+
+func (self *asyncLogger) writer() {
+	w := bufio.NewWriter(os.Stderr)
+	ticker := time.NewTicker(LOG_FLUSH_PERIOD)
+	defer ticker.Stop()
+
+	for {
+		select {
+		case rec := <-self.queue:
+			self.write(w, rec)
+		case <-ticker.C:
+			if n := self.dropped.Swap(0); n > 0 {
+				self.write(w, logRecord{time.Now(), LOG_ERROR,
+					fmt.Sprintf("log queue full, dropped %d messages", n)})
+			}
+
+			w.Flush()
+		case done := <-self.flush:
+			for len(self.queue) > 0 {
+				self.write(w, <-self.queue)
+			}
+
+			w.Flush()
+			close(done)
+		}
+	}
+}
+
+func (self *asyncLogger) write(w *bufio.Writer, rec logRecord) {
+	if !self.json.Load() {
+		w.WriteString(rec.at.Format(LOG_TIME_FORMAT))
+		w.WriteString(" [")
+		w.WriteString(logLevelNames[rec.level])
+		w.WriteString("]: ")
+		w.WriteString(rec.msg)
+		w.WriteByte('\n')
+		return
+	}
+
+	data, _ := json.Marshal(struct {
+		Time  string `json:"time"`
+		Level string `json:"level"`
+		Msg   string `json:"msg"`
+	}{rec.at.Format(time.RFC3339Nano), logLevelNames[rec.level], rec.msg})
+
+	w.Write(data)
+	w.WriteByte('\n')
+}
+
+func parseLogLevel(name string) (int, bool) {
+	for i, n := range logLevelNames {
+		if strings.EqualFold(n, name) {
+			return i, true
+		}
+	}
+
+	return 0, false
+}
@@ -0,0 +1,26 @@
+package main
+
+import "testing"
+
+func TestLogRateOnlyLimitsErrors(t *testing.T) {
+	l := &asyncLogger{queue: make(chan logRecord, 64)}
+	l.configure(LOG_DEBUG, false, 1)
+
+	for i := 0; i < 5; i++ {
+		l.log(LOG_INFO, "%s -> %s", "a", "b")
+		l.log(LOG_DEBUG, "%s -> %s", "a", "b")
+	}
+
+	if n := len(l.queue); n != 10 {
+		t.Fatalf("%d of 10 info and debug lines queued", n)
+	}
+
+	// one, or two and a "suppressed" note when the test straddles a second
+	for i := 0; i < 5; i++ {
+		l.log(LOG_ERROR, "%s: failed", "a")
+	}
+
+	if n := len(l.queue) - 10; n < 1 || n > 3 {
+		t.Fatalf("%d of 5 error lines queued at 1/s", n)
+	}
+}
@@ -1,138 +1,491 @@
 package main
 
 import (
-	"bufio"
 	"bytes"
+	"context"
 	"errors"
+	"flag"
 	"fmt"
 	"io"
-	"log"
 	"net"
-	"net/http"
-	"net/url"
 	"os"
-	"strings"
+	"runtime"
+	"time"
 )
 
 const (
 	BUFFER_SIZE            = 8192
+	BUFFER_SIZE_MIN        = 4096 // SOCKS5 messages and the TLS record header fit
 	HTTPS_HELO_SPLIT_SIZE  = 128
 	HTTP_HEADER_SPLIT_SIZE = 4
+	ACCEPT_MIN_DELAY       = 5 * time.Millisecond
+	ACCEPT_MAX_DELAY       = time.Second
+	PANIC_STACK_SIZE       = 8192
 )
 
-/*
- * Log wrapper
- */
-func info(format string, v ...any) {
-	log.Printf("[INFO]: "+format+"\n", v...)
-}
-
-func perror(format string, v ...any) {
-	log.Printf("[ERROR]: "+format+"\n", v...)
-}
-
 /*
  * HTTP Request Handler
  */
 var errHttpRequestInval = errors.New("invalid http request")
+var errHttpHeaderTooBig = errors.New("http request header too big")
+var errHandlerPanic = errors.New("handler panicked")
 var resHttpOk = []byte("HTTP/1.1 200 OK\r\n\r\n")
+var resHttpForbidden = []byte("HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\nConnection: close\r\n\r\n")
+var resHttpBadRequest = []byte("HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n")
+var resHttpHeaderTooBig = []byte("HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n")
 
 type httpRequest struct {
 	method           string
-	path             string
+	path             []byte // points into the parsed buffer
 	version          string
 	hostPort         string
+	reqLineEnd       int
 	hasConnectMethod bool
 }
 
+// parse pulls the request line and the target host straight out of `buffer`
+// without building a net/http.Request. Only `hostPort` is allocated, because
+// it outlives the buffer, and not even that when it did not change.
 func (self *httpRequest) parse(buffer []byte) error {
-	rd := bufio.NewReader(bytes.NewReader(buffer))
-	req, err := http.ReadRequest(rd)
-	if err != nil {
-		return err
+	lineEnd := bytes.IndexByte(buffer, '\n')
+	if lineEnd < 0 {
+		return errHttpRequestInval
 	}
 
-	defer req.Body.Close()
+	line := trimCR(buffer[:lineEnd])
+	self.reqLineEnd = len(line)
 
-	self.method = req.Method
-	if self.method == "CONNECT" {
-		self.hasConnectMethod = true
+	sp1 := bytes.IndexByte(line, ' ')
+	if sp1 <= 0 {
+		return errHttpRequestInval
+	}
+
+	sp2 := bytes.LastIndexByte(line, ' ')
+	if sp2 <= sp1+1 {
+		return errHttpRequestInval
+	}
+
+	method, target, version := line[:sp1], line[sp1+1:sp2], line[sp2+1:]
+	if !isToken(method) || !bytes.HasPrefix(version, []byte("HTTP/")) {
+		return errHttpRequestInval
+	}
+
+	self.method = internMethod(method)
+	self.version = internVersion(version)
+	self.hasConnectMethod = (self.method == "CONNECT")
+
+	var host []byte
+	if self.hasConnectMethod {
+		// authority-form
+		host = target
+		self.path = nil
 	} else {
-		self.hasConnectMethod = false
+		host, self.path = splitRequestTarget(target)
+	}
+
+	if len(host) == 0 {
+		var err error
+		if host, err = findHostHeader(buffer[lineEnd+1:]); err != nil {
+			return err
+		}
+	}
+
+	if len(host) == 0 {
+		return errHttpRequestInval
+	}
+
+	if hasPort(host) {
+		self.setHostPort(host, "")
+	} else if self.hasConnectMethod {
+		self.setHostPort(host, ":443")
+	} else {
+		self.setHostPort(host, ":80")
+	}
+
+	return nil
+}
+
+// setHostPort keeps the current `hostPort` when it already reads `host` and
+// `port`: the requests of a keep-alive connection mostly go to one host, and
+// parsing them again allocates nothing.
+func (self *httpRequest) setHostPort(host []byte, port string) {
+	n := len(host)
+	if len(self.hostPort) == n+len(port) && self.hostPort[:n] == string(host) &&
+		self.hostPort[n:] == port {
+		return
+	}
+
+	self.hostPort = string(host) + port
+}
+
+// newHttpRequest rewrites the request line of `buffer` to origin-form, in
+// place. The new line is never longer than the parsed one: `path` is a suffix
+// of the original target and a missing '/' is paid for by the dropped
+// authority.
+func (self *httpRequest) newHttpRequest(buffer []byte) ([]byte, error) {
+	lineEnd := self.reqLineEnd
+	slash := 0
+	if len(self.path) == 0 || self.path[0] != '/' {
+		slash = 1
 	}
 
-	path := req.URL.Path
-	if len(self.path) == 0 {
-		path = "/"
+	pathLen := slash + len(self.path)
+	newLen := len(self.method) + 1 + pathLen + 1 + len(self.version)
+	if lineEnd > len(buffer) || newLen > lineEnd {
+		return nil, errHttpRequestInval
+	}
+
+	// fill right to left, so the pieces still in the old line are never
+	// overwritten before they are moved
+	ret := buffer[lineEnd-newLen:]
+	idx := newLen - len(self.version)
+	copy(ret[idx:], self.version)
+	idx--
+	ret[idx] = ' '
+	idx -= len(self.path)
+	copy(ret[idx:], self.path)
+	if slash == 1 {
+		idx--
+		ret[idx] = '/'
 	}
+	self.path = ret[idx : idx+pathLen]
+	idx--
+	ret[idx] = ' '
+	copy(ret, self.method)
+
+	self.reqLineEnd = newLen
+	return ret, nil
+}
 
-	URL := req.URL
-	if len(URL.RawQuery) > 0 {
-		path += "?" + URL.RawQuery
+// findHeaderEnd returns the length of the header in `buffer` including the
+// blank line, or 0. The first `from` bytes were already scanned.
+func findHeaderEnd(buffer []byte, from int) int {
+	from -= 3
+	if from < 0 {
+		from = 0
 	}
 
-	if len(URL.RawFragment) > 0 {
-		path += "#" + URL.RawFragment
+	for {
+		idx := bytes.IndexByte(buffer[from:], '\n')
+		if idx < 0 {
+			return 0
+		}
+
+		idx += from
+		rest := buffer[idx+1:]
+		if len(rest) > 0 && rest[0] == '\n' {
+			return idx + 2
+		}
+
+		if len(rest) > 1 && rest[0] == '\r' && rest[1] == '\n' {
+			return idx + 3
+		}
+
+		from = idx + 1
+	}
+}
+
+// splitRequestTarget splits an absolute-form target into its authority and
+// origin-form path (the fragment is dropped). An origin-form target has no
+// authority. The returned path may lack its leading '/' ("http://host?q").
+func splitRequestTarget(target []byte) (host []byte, path []byte) {
+	if hash := bytes.IndexByte(target, '#'); hash >= 0 {
+		target = target[:hash]
+	}
+
+	if len(target) > 0 && target[0] == '/' {
+		return nil, target
+	}
+
+	if idx := bytes.Index(target, []byte("://")); idx >= 0 {
+		target = target[idx+3:]
+	}
+
+	end := bytes.IndexAny(target, "/?")
+	if end < 0 {
+		end = len(target)
+	}
+
+	host = target[:end]
+	if at := bytes.LastIndexByte(host, '@'); at >= 0 {
+		host = host[at+1:]
+	}
+
+	return host, target[end:]
+}
+
+func findHostHeader(headers []byte) ([]byte, error) {
+	for len(headers) > 0 {
+		end := bytes.IndexByte(headers, '\n')
+		if end < 0 {
+			return nil, errHttpRequestInval
+		}
+
+		line := trimCR(headers[:end])
+		headers = headers[end+1:]
+		if len(line) == 0 {
+			// end of headers
+			return nil, nil
+		}
+
+		if len(line) > 5 && line[4] == ':' && asciiEqualFold(line[:4], "host") {
+			return bytes.Trim(line[5:], " \t"), nil
+		}
 	}
 
-	self.path = path
-	self.version = req.Proto
+	return nil, errHttpRequestInval
+}
 
-	startIdx := strings.Index(req.Host, "]") // IPv6
+func hasPort(host []byte) bool {
+	startIdx := bytes.LastIndexByte(host, ']') // IPv6
 	if startIdx < 0 {
 		startIdx = 0
 	}
 
-	self.hostPort = req.Host
-	if !strings.Contains(req.Host[startIdx:], ":") {
-		// need port
-		if self.hasConnectMethod {
-			self.hostPort += ":443"
-		} else {
-			self.hostPort += ":80"
+	return bytes.IndexByte(host[startIdx:], ':') >= 0
+}
+
+func trimCR(line []byte) []byte {
+	if len(line) > 0 && line[len(line)-1] == '\r' {
+		return line[:len(line)-1]
+	}
+
+	return line
+}
+
+func isToken(b []byte) bool {
+	for _, c := range b {
+		if c <= ' ' || c >= 0x7f {
+			return false
+		}
+
+		switch c {
+		case '(', ')', '<', '>', '@', ',', ';', ':', '\\', '"', '/', '[', ']', '?', '=', '{', '}':
+			return false
 		}
 	}
 
-	return nil
+	return len(b) > 0
 }
 
-func (self *httpRequest) newHttpRequest(buffer []byte) ([]byte, error) {
-	reqLineEndIdx := bytes.Index(buffer, []byte("\r\n"))
-	if reqLineEndIdx < 0 {
-		return nil, errHttpRequestInval
+func asciiEqualFold(b []byte, lower string) bool {
+	if len(b) != len(lower) {
+		return false
 	}
 
-	u, err := url.Parse(self.path)
-	if err != nil {
-		return nil, err
+	for i := range b {
+		if b[i]|0x20 != lower[i] {
+			return false
+		}
 	}
 
-	newReqLine := fmt.Sprintf("%s %s %s", self.method, u.Path, self.version)
-	ret := buffer[reqLineEndIdx-len(newReqLine):]
+	return true
+}
 
-	copy(ret, newReqLine)
-	return ret, nil
+// switch on string(b) does not allocate, so well known values come for free
+func internMethod(b []byte) string {
+	switch string(b) {
+	case "CONNECT":
+		return "CONNECT"
+	case "GET":
+		return "GET"
+	case "HEAD":
+		return "HEAD"
+	case "POST":
+		return "POST"
+	case "PUT":
+		return "PUT"
+	case "DELETE":
+		return "DELETE"
+	case "OPTIONS":
+		return "OPTIONS"
+	case "PATCH":
+		return "PATCH"
+	case "TRACE":
+		return "TRACE"
+	}
+
+	return string(b)
+}
+
+func internVersion(b []byte) string {
+	switch string(b) {
+	case "HTTP/1.1":
+		return "HTTP/1.1"
+	case "HTTP/1.0":
+		return "HTTP/1.0"
+	}
+
+	return string(b)
 }
 
 /*
  * Server
  */
 func runServer(address string) error {
-	listener, err := net.Listen("tcp", address)
+	c := currentCfg()
+	sockets, inherited, err := inheritListeners()
 	if err != nil {
 		return err
 	}
-	defer listener.Close()
 
-	info("Listening on: %v", address)
+	if !inherited {
+		if sockets.proxy, err = listen(address, c.listeners); err != nil {
+			return err
+		}
+	}
+
+	defer sockets.close()
+
+	info("Listening on: %v (%d listener(s))", sockets.proxy[0].Addr(), len(sockets.proxy))
+
+	if dnsResolver, err = newResolver(c); err != nil {
+		return err
+	}
+
+	targetDialer = newDialer(c)
+	strategies = newStrategyTable(c)
+	if c.relayEngine == RELAY_ENGINE_EPOLL {
+		if err = startRelayLoops(c.relayLoops); err != nil {
+			return err
+		}
+	}
+
+	if c.poolSize > 0 {
+		warmPool = newUpstreamPool(c, targetDialer.dial)
+		go logPoolStats(warmPool)
+	}
+	if len(c.metricsAddr) > 0 {
+		go func() {
+			if err := runMetrics(c.metricsAddr); err != nil {
+				perror("metrics: %s", err)
+			}
+		}()
+	}
+
+	if len(c.debugAddr) > 0 {
+		connTraces = &traceRing{}
+		go func() {
+			if err := runDebug(c.debugAddr); err != nil {
+				perror("debug: %s", err)
+			}
+		}()
+	}
+
+	adm := newAdmission(c)
+	errs := make(chan error, len(sockets.proxy)+2)
+	for _, l := range sockets.proxy {
+		go func(l net.Listener) {
+			errs <- acceptLoop(l, adm, false)
+		}(l)
+	}
+
+	if sockets.transparent == nil && len(c.transparentAddr) > 0 {
+		if sockets.transparent, err = listenTransparent(c.transparentAddr, c.tproxy); err != nil {
+			return err
+		}
+	}
+
+	if sockets.transparent != nil {
+		info("Transparent listener on: %v", sockets.transparent.Addr())
+		go func() {
+			errs <- acceptLoop(sockets.transparent, adm, true)
+		}()
+	}
+
+	if sockets.mux == nil && len(c.muxListen) > 0 {
+		if sockets.mux, err = net.Listen("tcp", c.muxListen); err != nil {
+			return err
+		}
+	}
+
+	if sockets.mux != nil {
+		info("Mux listener on: %v", sockets.mux.Addr())
+		go func() {
+			errs <- muxAcceptLoop(sockets.mux, c, adm)
+		}()
+	}
+
+	go reloadOnSignal()
+	reportReady()
+
+	restarted := make(chan struct{})
+	go func() {
+		waitRestart(sockets)
+		close(restarted)
+	}()
+
+	select {
+	case err = <-errs:
+		// the first listener to fail brings the others down with it
+		return err
+	case <-restarted:
+	}
+
+	// the successor accepts from here on, finish what is left
+	sockets.close()
+	drain(adm, currentCfg().drainTimeout)
+	return nil
+}
+
+// listen opens `count` listeners on `address`. With more than one, every
+// socket gets SO_REUSEPORT and the kernel spreads new connections across
+// them, so each accept loop has its own queue.
+func listen(address string, count int) ([]net.Listener, error) {
+	if count <= 1 {
+		l, err := net.Listen("tcp", address)
+		if err != nil {
+			return nil, err
+		}
+
+		return []net.Listener{l}, nil
+	}
+
+	lc := net.ListenConfig{Control: setReusePort}
+	listeners := make([]net.Listener, 0, count)
+	for i := 0; i < count; i++ {
+		l, err := lc.Listen(context.Background(), "tcp", address)
+		if err != nil {
+			for _, l := range listeners {
+				l.Close()
+			}
+
+			return nil, err
+		}
+
+		// port 0: the rest must share the port picked by the first one
+		address = l.Addr().String()
+		listeners = append(listeners, l)
+	}
+
+	return listeners, nil
+}
+
+func acceptLoop(listener net.Listener, adm *admission, transparent bool) error {
+	var delay time.Duration
 	for {
 		sourceConn, err := listener.Accept()
 		if err != nil {
-			perror("Cannot accept a new client: %s", err.Error())
+			if errors.Is(err, net.ErrClosed) {
+				return err
+			}
+
+			// out of FDs (EMFILE/ENFILE) or another transient error:
+			// back off instead of spinning
+			if delay == 0 {
+				delay = ACCEPT_MIN_DELAY
+			} else if delay *= 2; delay > ACCEPT_MAX_DELAY {
+				delay = ACCEPT_MAX_DELAY
+			}
+
+			perror("Cannot accept a new client: %s, retrying in %v", err.Error(), delay)
+			time.Sleep(delay)
 			continue
 		}
 
-		go NewClient(sourceConn).handle()
+		delay = 0
+		metrics.accepts.Add(1)
+		adm.admit(sourceConn, transparent)
 	}
 }
 
@@ -140,146 +493,373 @@ func runServer(address string) error {
  * Client
  */
 type client struct {
-	source net.Conn
-	target net.Conn
+	cfg         *config // taken when the connection came in, a reload does not touch it
+	source      net.Conn
+	target      net.Conn
+	buffer      *[]byte
+	shard       uint32
+	sentAt      time.Time      // request sent, first response byte not timed yet
+	transparent bool           // redirected by the firewall, no proxy handshake
+	rate        *rateLimit     // of the source address, nil: unlimited
+	trace       *connTrace     // nil unless -debug is on
+	probe       *responseProbe // judges the strategy, nil unless -adaptive
+	release     func()         // admission slots, for an event loop taking over
 }
 
-func NewClient(conn net.Conn) *client {
+func NewClient(conn net.Conn, transparent bool) *client {
 	return &client{
-		source: conn,
+		cfg:         currentCfg(),
+		source:      conn,
+		shard:       metrics.nextShard(),
+		transparent: transparent,
 	}
 }
 
 func (self *client) handle() {
+	metrics.active.Add(1)
+	defer metrics.active.Add(-1)
+
 	defer self.source.Close()
+	defer self.releaseBuffer()
+	defer self.trace.mark(TRACE_DONE)
+
+	c := self.cfg
+	self.buffer = getBuffer(c.bufferSize)
+	if c.ratePerIp > 0 {
+		ip := remoteIp(self.source)
+		self.rate = shaper.acquire(ip, int64(c.ratePerIp), int64(c.rateBurst))
+		defer shaper.release(ip)
+	}
 
-	var realBuffer [BUFFER_SIZE]byte
 	var rAddr = self.source.RemoteAddr()
-	var buffer = realBuffer[:]
 
-	// TODO: handle big request header
-	recvd, err := self.source.Read(buffer)
+	// a client that never finishes its request must not hold the FD
+	self.setIdleDeadline()
+
+	if self.transparent {
+		defer self.closeTarget()
+		if err := self.handleTransparent(); err != nil {
+			metrics.error(errorStage(err, STAGE_HELLO))
+			perror("%s -> transparent: %s", rAddr, err)
+		}
+
+		return
+	}
+
+	// the first byte tells SOCKS5 from an HTTP request line
+	recvd, err := self.source.Read(*self.buffer)
+	if err == nil && (*self.buffer)[0] == SOCKS_VERSION {
+		defer self.closeTarget()
+		if err = self.handleSocks(recvd); err != nil {
+			metrics.error(errorStage(err, STAGE_HELLO))
+			perror("%s -> SOCKS5: %s", rAddr, err)
+		}
+
+		return
+	}
+
+	headerLen, recvd, err := self.readHeader(recvd, err)
 	if err != nil {
-		perror("conn.Read: %s: %s", rAddr, err)
+		metrics.error(STAGE_PARSE)
+		perror("client.readHeader: %s: %s", rAddr, err)
 		return
 	}
 
+	var buffer = *self.buffer
 	var req httpRequest
-	if err = req.parse(buffer); err != nil {
+	if err = req.parse(buffer[:headerLen]); err != nil {
+		metrics.error(STAGE_PARSE)
 		perror("httpRequest.parse: %s: %s", rAddr, err)
 		return
 	}
 
-	// connect to the target host
-	self.target, err = net.Dial("tcp", req.hostPort)
-	if err != nil {
-		perror("net.Dial: %s: %s", rAddr, err)
+	info("%s -> %s %s", rAddr, req.method, req.hostPort)
+	self.trace.setTarget(req.hostPort)
+	self.trace.mark(TRACE_PARSE)
+	defer self.closeTarget()
+
+	if hostRule(self.cfg, req.hostPort) == RULE_BLOCK {
+		metrics.blocked.Add(1)
+		self.source.Write(resHttpForbidden)
+		info("%s -> %s: %s", rAddr, req.hostPort, errRuleBlocked)
 		return
 	}
-	defer self.target.Close()
 
-	info("%s -> %s %s", rAddr, req.method, req.hostPort)
-	if req.hasConnectMethod {
+	if req.hasConnectMethod && self.cfg.pipelineConnect {
+		// HTTPS, the dial runs while the tunnel is acknowledged and the
+		// hello is read
+		err = self.handleHttps(resHttpOk, buffer[headerLen:recvd], req.hostPort,
+			dialTargetAsync(self.cfg, req.hostPort))
+	} else if req.hasConnectMethod {
 		// HTTPS
-		err = self.handleHttps(buffer)
-	} else {
-		// HTTP
-		// update http request (buffer), handle absolute path
-		buffer, err = req.newHttpRequest(buffer[:recvd])
+		// connect to the target host
+		self.target, err = dialTarget(self.cfg, req.hostPort)
 		if err != nil {
-			perror("request.newHttpRequest: %s: %s", rAddr, err)
+			metrics.error(STAGE_DIAL)
+			perror("dialTarget: %s: %s", rAddr, err)
 			return
 		}
 
-		err = self.handleHttp(buffer)
+		self.trace.mark(TRACE_DIAL)
+
+		err = self.handleHttps(resHttpOk, buffer[headerLen:recvd], req.hostPort, nil)
+	} else {
+		// HTTP, every request of the connection gets rewritten and split
+		err = self.forwardHttp(&req, headerLen, recvd)
 	}
 
 	if err != nil {
+		if req.hasConnectMethod {
+			metrics.error(errorStage(err, STAGE_HELLO))
+		} else {
+			metrics.error(errorStage(err, STAGE_HTTP))
+		}
+
 		perror("%s -> %s: %s", rAddr, req.hostPort, err)
 	}
 }
 
-func (self *client) handleHttp(buffer []byte) error {
-	err := self.writeSplitRequest(buffer, HTTP_HEADER_SPLIT_SIZE)
-	if err != nil {
-		return err
+func (self *client) closeTarget() {
+	if self.target != nil {
+		self.target.Close()
 	}
+}
 
-	self.spliceConnection()
-	return nil
+// recoverConn, deferred, turns a panic into the end of one connection
+// instead of the whole process: `conns` are closed and the stack is logged.
+func recoverConn(conns ...net.Conn) {
+	r := recover()
+	if r == nil {
+		return
+	}
+
+	for _, conn := range conns {
+		if conn != nil {
+			conn.Close()
+		}
+	}
+
+	stack := make([]byte, PANIC_STACK_SIZE)
+	stack = stack[:runtime.Stack(stack, false)]
+	metrics.panics.Add(1)
+	perror("%s: %v\n%s", errHandlerPanic, r, stack)
+}
+
+// readHeader reads until the request header is complete, growing the pooled
+// buffer up to `maxHeaderSize`. `recvd` bytes and `err` come from the
+// read that detected the protocol. Each read only scans the new bytes (and
+// the three before them) for the blank line. It returns the header length
+// and the amount of bytes received, which may include a body or pipelined
+// data.
+func (self *client) readHeader(recvd int, err error) (int, int, error) {
+	maxSize := self.cfg.maxHeaderSize
+	scanned := 0
+	for {
+		buffer := *self.buffer
+		if end := findHeaderEnd(buffer[:recvd], scanned); end > 0 {
+			return end, recvd, nil
+		}
+
+		if err != nil {
+			return 0, 0, err
+		}
+
+		scanned = recvd
+		if recvd == len(buffer) {
+			if len(buffer) >= maxSize {
+				return 0, 0, errHttpHeaderTooBig
+			}
+
+			size := 2 * len(buffer)
+			if size > maxSize {
+				size = maxSize
+			}
+
+			self.growBuffer(size, recvd)
+			buffer = *self.buffer
+		}
+
+		var r int
+		r, err = self.source.Read(buffer[recvd:])
+		recvd += r
+	}
 }
 
-func (self *client) handleHttps(buffer []byte) error {
+// readHello makes sure the first TLS record is complete in the buffer, since
+// a big ClientHello (post-quantum key shares) does not fit one segment.
+// Anything that is not a TLS handshake is returned as it is.
+func (self *client) readHello(recvd int) (int, error) {
+	for {
+		buffer := *self.buffer
+		need := TLS_RECORD_HEADER_SIZE
+		if recvd > 0 && buffer[0] != TLS_RECORD_HANDSHAKE {
+			return recvd, nil
+		}
+
+		if recvd >= TLS_RECORD_HEADER_SIZE {
+			need += int(buffer[3])<<8 | int(buffer[4])
+			if recvd >= need {
+				return recvd, nil
+			}
+		}
+
+		if need > len(buffer) {
+			self.growBuffer(need, recvd)
+			buffer = *self.buffer
+		}
+
+		r, err := self.source.Read(buffer[recvd:])
+		recvd += r
+		if err != nil {
+			if recvd > 0 && err == io.EOF {
+				return recvd, nil
+			}
+
+			return recvd, err
+		}
+	}
+}
+
+func (self *client) growBuffer(size int, used int) {
+	buffer := getBuffer(size)
+	copy(*buffer, (*self.buffer)[:used])
+	putBuffer(self.buffer)
+	self.buffer = buffer
+}
+
+// releaseBuffer hands the header buffer back to the pool. It is called before
+// relaying, so idle tunnels do not pin it.
+func (self *client) releaseBuffer() {
+	if self.buffer != nil {
+		putBuffer(self.buffer)
+		self.buffer = nil
+	}
+}
+
+// handleHttps acknowledges the tunnel with `reply` (CONNECT or SOCKS5) and
+// takes the target from `dialed` when the dial was started before that.
+// `early` holds bytes the client sent right behind its request.
+func (self *client) handleHttps(reply []byte, early []byte, hostPort string,
+	dialed <-chan dialResult) error {
+	defer func() {
+		// bailed out before the dial result was taken
+		if dialed != nil {
+			go closeLosers(dialed, 1)
+		}
+	}()
+
 	// send established tunneling status
-	if _, err := self.source.Write(resHttpOk); err != nil {
-		return err
+	if len(reply) > 0 {
+		if _, err := self.source.Write(reply); err != nil {
+			return err
+		}
+
+		self.trace.mark(TRACE_REPLY)
 	}
 
 	// Read HTTPS HELO packet and update `offset` value
-	offset, err := self.source.Read(buffer)
+	offset, err := self.readHello(copy(*self.buffer, early))
 	if err != nil {
 		return err
 	}
 
-	err = self.writeSplitRequest(buffer[:offset], HTTPS_HELO_SPLIT_SIZE)
+	buffer := *self.buffer
+
+	if dialed != nil {
+		r := <-dialed
+		dialed = nil
+		if r.err != nil {
+			return r.err
+		}
+
+		self.target = r.conn
+		self.trace.mark(TRACE_DIAL)
+	}
+
+	host := string(parseSni(buffer[:offset]))
+	if len(host) == 0 {
+		host, _, _ = net.SplitHostPort(hostPort)
+	}
+
+	// the SNI may name another host than the request did
+	if self.cfg.rules.match(host) == RULE_BLOCK {
+		metrics.blocked.Add(1)
+		info("%s -> %s: %s", self.source.RemoteAddr(), host, errRuleBlocked)
+		return nil
+	}
+
+	// SOCKS5 clients tunnel plain HTTP as well
+	isTls := offset > 0 && buffer[0] == TLS_RECORD_HANDSHAKE
+	st := strategies.pick(self.cfg, host, isTls)
+	err = self.sendRequest(buffer[:offset], st)
+	self.sentAt = time.Now()
+	self.trace.mark(TRACE_HELLO)
+	if err == nil && strategies.adaptive {
+		self.probe = newResponseProbe(self.cfg.strategyTimeout, func(res outcome) {
+			strategies.report(self.cfg, host, isTls, st, res)
+		})
+	}
+
+	self.releaseBuffer()
 	if err != nil {
 		return err
 	}
 
-	self.spliceConnection()
+	self.spliceConnection(host)
 	return nil
 }
 
-func (self *client) writeSplitRequest(buffer []byte, splitSize int) error {
-	bLen := len(buffer)
-	for snd := 0; snd < bLen; {
-		s, err := self.target.Write(buffer[snd:splitSize])
-		if err != nil {
-			return err
-		}
-
-		if s == 0 {
-			break
-		}
-
-		snd += s
-		splitSize += snd
-		if splitSize > bLen {
-			splitSize -= (splitSize - bLen)
-		}
+func (self *client) sendRequest(buffer []byte, st strategy) error {
+	switch st.kind {
+	case STRATEGY_NONE:
+		_, err := self.target.Write(buffer)
+		return err
+	case STRATEGY_TLS:
+		return self.writeSplitRecords(buffer)
 	}
 
-	return nil
+	return self.writeSplitRequest(buffer, st.size)
 }
 
-func (self *client) spliceConnection() {
-	go func() {
-		io.Copy(self.target, self.source)
-	}()
+// writeSplitRecords sends the ClientHello as two TLS records, cut inside the
+// SNI, in a single write. Anything it cannot parse is split at TCP level.
+func (self *client) writeSplitRecords(hello []byte) error {
+	dst := getBuffer(len(hello) + TLS_RECORD_HEADER_SIZE)
+	defer putBuffer(dst)
+
+	out, ok := splitTlsRecord(*dst, hello)
+	if !ok {
+		return self.writeSplitRequest(hello, self.cfg.helloSplitSize)
+	}
 
-	io.Copy(self.source, self.target)
+	_, err := self.target.Write(out)
+	return err
 }
 
-const helpMsg = "holytunnel [HOST:PORT]"
+func (self *client) writeSplitRequest(buffer []byte, splitSize int) error {
+	return writeFragments(self.target, buffer, splitSize, self.cfg.splitDelay)
+}
 
 func main() {
-	var hostPort = "127.0.0.1:8001"
+	if err := parseArgs(os.Args[1:]); err != nil {
+		if errors.Is(err, flag.ErrHelp) {
+			os.Exit(0)
+		}
 
-	args := os.Args
-	if len(args) < 2 {
-		goto run
-	}
+		if errors.Is(err, errConfigFile) {
+			fmt.Println(err)
+		}
 
-	if len(args) > 2 {
 		fmt.Println("Invalid argument!\n" + helpMsg)
 		os.Exit(1)
 	}
 
-	hostPort = args[1]
-
-run:
-	if err := runServer(hostPort); err != nil {
+	if err := runServer(currentCfg().listenAddr); err != nil {
 		perror(err.Error())
+		logFlush()
 		os.Exit(1)
 	}
+
+	// handed over to a new process
+	logFlush()
 }
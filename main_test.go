@@ -0,0 +1,235 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"fmt"
+	"net/http"
+	"net/url"
+	"strings"
+	"testing"
+)
+
+var parseCases = []struct {
+	name, req, hostPort, line string
+}{
+	{
+		"connect",
+		"CONNECT example.com:443 HTTP/1.1\r\nHost: example.com:443\r\n\r\n",
+		"example.com:443",
+		"CONNECT example.com:443 HTTP/1.1",
+	},
+	{
+		"absolute",
+		"GET http://example.com/index.html?q=1#top HTTP/1.1\r\nHost: example.com\r\nAccept: */*\r\n\r\n",
+		"example.com:80",
+		"GET /index.html?q=1 HTTP/1.1",
+	},
+	{
+		"origin",
+		"GET /a HTTP/1.1\r\nUser-Agent: x\r\nhost: [::1]:8080\r\n\r\n",
+		"[::1]:8080",
+		"GET /a HTTP/1.1",
+	},
+	{
+		"no slash",
+		"GET http://user@example.com?q HTTP/1.0\r\nHost: example.com\r\n\r\n",
+		"example.com:80",
+		"GET /?q HTTP/1.0",
+	},
+}
+
+func TestParse(t *testing.T) {
+	for _, tc := range parseCases {
+		var req httpRequest
+		buffer := []byte(tc.req)
+		if err := req.parse(buffer); err != nil {
+			t.Fatalf("%s: %v", tc.name, err)
+		}
+
+		if req.hostPort != tc.hostPort {
+			t.Errorf("%s: hostPort %q, want %q", tc.name, req.hostPort, tc.hostPort)
+		}
+
+		if req.hasConnectMethod {
+			continue
+		}
+
+		out, err := req.newHttpRequest(buffer)
+		if err != nil {
+			t.Fatalf("%s: %v", tc.name, err)
+		}
+
+		if line := string(out[:req.reqLineEnd]); line != tc.line {
+			t.Errorf("%s: request line %q, want %q", tc.name, line, tc.line)
+		}
+	}
+}
+
+// The requests of a keep-alive connection are parsed into the same
+// httpRequest, which allocates nothing once `hostPort` is known.
+func TestParseAllocs(t *testing.T) {
+	for _, tc := range parseCases {
+		var req httpRequest
+		buffer := make([]byte, len(tc.req))
+		allocs := testing.AllocsPerRun(100, func() {
+			copy(buffer, tc.req)
+			if err := req.parse(buffer); err != nil {
+				t.Fatal(err)
+			}
+
+			if !req.hasConnectMethod {
+				req.newHttpRequest(buffer)
+			}
+		})
+
+		if allocs != 0 {
+			t.Errorf("%s: %v allocs per request", tc.name, allocs)
+		}
+	}
+}
+
+// parseNetHttp is the path parse replaced: a whole http.Request, then
+// url.Parse and Sprintf for the origin-form request line.
+func parseNetHttp(buffer []byte) (string, string, error) {
+	req, err := http.ReadRequest(bufio.NewReader(bytes.NewReader(buffer)))
+	if err != nil {
+		return "", "", err
+	}
+
+	defer req.Body.Close()
+
+	hostPort := req.Host
+	startIdx := strings.Index(hostPort, "]") // IPv6
+	if startIdx < 0 {
+		startIdx = 0
+	}
+
+	if !strings.Contains(hostPort[startIdx:], ":") {
+		if req.Method == "CONNECT" {
+			hostPort += ":443"
+		} else {
+			hostPort += ":80"
+		}
+	}
+
+	if req.Method == "CONNECT" {
+		return hostPort, "", nil
+	}
+
+	path := req.URL.Path
+	if len(path) == 0 {
+		path = "/"
+	}
+
+	if len(req.URL.RawQuery) > 0 {
+		path += "?" + req.URL.RawQuery
+	}
+
+	u, err := url.Parse(path)
+	if err != nil {
+		return "", "", err
+	}
+
+	return hostPort, fmt.Sprintf("%s %s %s", req.Method, u.Path, req.Proto), nil
+}
+
+// BenchmarkParse puts parse and newHttpRequest next to the net/http path on
+// the same requests:
+//
+//	go test -run XXX -bench Parse -benchmem
+func BenchmarkParse(b *testing.B) {
+	for _, tc := range parseCases {
+		b.Run(tc.name+"/bytes", func(b *testing.B) {
+			var req httpRequest
+			buffer := make([]byte, len(tc.req))
+			b.ReportAllocs()
+			b.SetBytes(int64(len(tc.req)))
+			for i := 0; i < b.N; i++ {
+				copy(buffer, tc.req)
+				if err := req.parse(buffer); err != nil {
+					b.Fatal(err)
+				}
+
+				if !req.hasConnectMethod {
+					req.newHttpRequest(buffer)
+				}
+			}
+		})
+
+		b.Run(tc.name+"/net-http", func(b *testing.B) {
+			buffer := []byte(tc.req)
+			b.ReportAllocs()
+			b.SetBytes(int64(len(tc.req)))
+			for i := 0; i < b.N; i++ {
+				if _, _, err := parseNetHttp(buffer); err != nil {
+					b.Fatal(err)
+				}
+			}
+		})
+	}
+}
+
+func BenchmarkParseNew(b *testing.B) {
+	tc := parseCases[0]
+	buffer := make([]byte, len(tc.req))
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		var req httpRequest
+		copy(buffer, tc.req)
+		if err := req.parse(buffer); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func FuzzParse(f *testing.F) {
+	for _, tc := range parseCases {
+		f.Add([]byte(tc.req))
+	}
+
+	f.Add([]byte("GET http://[::1]:8080/x HTTP/1.1\r\nHost: a\r\n\r\n"))
+	f.Add([]byte("GET http://a HTTP/1.1\nHost: a\n\n"))
+	f.Add([]byte("CONNECT a HTTP/1.1\r\n\r\n"))
+
+	f.Fuzz(func(t *testing.T, data []byte) {
+		var req httpRequest
+		buffer := append([]byte(nil), data...)
+		if req.parse(buffer) != nil || req.hasConnectMethod {
+			return
+		}
+
+		if req.hostPort == "" {
+			t.Fatalf("parsed %q without a host", data)
+		}
+
+		path := string(req.path)
+		if len(path) == 0 || path[0] != '/' {
+			path = "/" + path
+		}
+
+		line := req.method + " " + path + " " + req.version
+		oldLineEnd := req.reqLineEnd
+		out, err := req.newHttpRequest(buffer)
+		if err != nil {
+			return
+		}
+
+		// only the request line shrinks, the headers stay as they were
+		if len(out) > len(data) || req.reqLineEnd > oldLineEnd ||
+			string(out[req.reqLineEnd:]) != string(data[oldLineEnd:]) {
+			t.Fatalf("rewrote %q to %q", data, out)
+		}
+
+		// and it is an origin-form line that parses back the same
+		if string(out[:req.reqLineEnd]) != line {
+			t.Fatalf("rewrote %q to the line %q, want %q", data, out[:req.reqLineEnd], line)
+		}
+
+		var again httpRequest
+		if err := again.parse(out); err == nil &&
+			(again.method != req.method || string(again.path) != path || again.version != req.version) {
+			t.Fatalf("%q parses back as %s %s %s", out, again.method, again.path, again.version)
+		}
+	})
+}
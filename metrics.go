@@ -0,0 +1,210 @@
+package main
+
+import (
+	"bufio"
+	"errors"
+	"fmt"
+	"net"
+	"net/http"
+	"sync/atomic"
+	"time"
+)
+
+const (
+	METRIC_SHARDS     = 16 // power of two
+	CACHE_LINE_SIZE   = 64
+	STAGE_PARSE       = 0
+	STAGE_DIAL        = 1
+	STAGE_HELLO       = 2
+	STAGE_HTTP        = 3
+	STAGE_RELAY       = 4
+	STAGE_COUNT       = 5
+	DIRECTION_UP      = 0
+	DIRECTION_DOWN    = 1
+	METRICS_READ_TIME = 10 * time.Second
+)
+
+var stageNames = [STAGE_COUNT]string{"parse", "dial", "hello", "http", "relay"}
+
+// seconds
+var latencyBuckets = [...]float64{
+	0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+}
+
+/*
+ * Metrics
+ *
+ * Everything is a plain atomic; counters bumped per relayed chunk are
+ * sharded by connection so that busy tunnels do not fight over one cache
+ * line. Nothing on the hot path takes a lock.
+ */
+type paddedUint64 struct {
+	value atomic.Uint64
+	_     [CACHE_LINE_SIZE - 8]byte
+}
+
+type shardedCounter struct {
+	shards [METRIC_SHARDS]paddedUint64
+}
+
+func (self *shardedCounter) add(shard uint32, n uint64) {
+	self.shards[shard&(METRIC_SHARDS-1)].value.Add(n)
+}
+
+func (self *shardedCounter) load() uint64 {
+	var ret uint64
+	for i := range self.shards {
+		ret += self.shards[i].value.Load()
+	}
+
+	return ret
+}
+
+type histogram struct {
+	buckets [len(latencyBuckets) + 1]atomic.Uint64
+	sumNs   atomic.Uint64
+	count   atomic.Uint64
+}
+
+func (self *histogram) observe(d time.Duration) {
+	sec := d.Seconds()
+	idx := len(latencyBuckets)
+	for i, le := range latencyBuckets {
+		if sec <= le {
+			idx = i
+			break
+		}
+	}
+
+	self.buckets[idx].Add(1)
+	self.sumNs.Add(uint64(d))
+	self.count.Add(1)
+}
+
+type metricSet struct {
+	accepts  atomic.Uint64
+	active   atomic.Int64
+	blocked  atomic.Uint64
+	panics   atomic.Uint64
+	errors   [STAGE_COUNT]atomic.Uint64
+	bytes    [2]shardedCounter
+	dialTime histogram
+	ttfb     histogram
+	shardSeq atomic.Uint32
+}
+
+var metrics metricSet
+
+func (self *metricSet) error(stage int) {
+	self.errors[stage].Add(1)
+}
+
+func (self *metricSet) nextShard() uint32 {
+	return self.shardSeq.Add(1)
+}
+
+// stageError tags an error with the stage it happened in, the innermost tag
+// wins.
+type stageError struct {
+	stage int
+	err   error
+}
+
+func (self *stageError) Error() string {
+	return self.err.Error()
+}
+
+func (self *stageError) Unwrap() error {
+	return self.err
+}
+
+func atStage(stage int, err error) error {
+	var se *stageError
+	if err == nil || errors.As(err, &se) {
+		return err
+	}
+
+	return &stageError{stage, err}
+}
+
+func errorStage(err error, fallback int) int {
+	var se *stageError
+	if errors.As(err, &se) {
+		return se.stage
+	}
+
+	return fallback
+}
+
+func runMetrics(address string) error {
+	mux := http.NewServeMux()
+	mux.HandleFunc("/metrics", func(w http.ResponseWriter, r *http.Request) {
+		w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+		bw := bufio.NewWriter(w)
+		metrics.write(bw)
+		bw.Flush()
+	})
+
+	listener, err := net.Listen("tcp", address)
+	if err != nil {
+		return err
+	}
+
+	info("Metrics on: http://%s/metrics", listener.Addr())
+	srv := &http.Server{Handler: mux, ReadHeaderTimeout: METRICS_READ_TIME}
+	return srv.Serve(listener)
+}
+
+// write renders the Prometheus text exposition format.
+func (self *metricSet) write(w *bufio.Writer) {
+	writeMetric(w, "holytunnel_accepts_total", "counter", "Accepted client connections.",
+		float64(self.accepts.Load()))
+	writeMetric(w, "holytunnel_active_connections", "gauge", "Connections being handled.",
+		float64(self.active.Load()))
+	writeMetric(w, "holytunnel_blocked_total", "counter", "Connections refused by a block rule.",
+		float64(self.blocked.Load()))
+	writeMetric(w, "holytunnel_panics_total", "counter", "Connections ended by a recovered panic.",
+		float64(self.panics.Load()))
+
+	fmt.Fprintf(w, "# HELP holytunnel_errors_total Failed connections by stage.\n")
+	fmt.Fprintf(w, "# TYPE holytunnel_errors_total counter\n")
+	for i, name := range stageNames {
+		fmt.Fprintf(w, "holytunnel_errors_total{stage=%q} %d\n", name, self.errors[i].Load())
+	}
+
+	fmt.Fprintf(w, "# HELP holytunnel_relayed_bytes_total Payload bytes relayed.\n")
+	fmt.Fprintf(w, "# TYPE holytunnel_relayed_bytes_total counter\n")
+	fmt.Fprintf(w, "holytunnel_relayed_bytes_total{direction=\"up\"} %d\n", self.bytes[DIRECTION_UP].load())
+	fmt.Fprintf(w, "holytunnel_relayed_bytes_total{direction=\"down\"} %d\n", self.bytes[DIRECTION_DOWN].load())
+
+	writeHistogram(w, "holytunnel_dial_seconds", "Time to connect to the target.", &self.dialTime)
+	writeHistogram(w, "holytunnel_first_byte_seconds",
+		"Time from sending the request to the first response byte.", &self.ttfb)
+
+	if warmPool != nil {
+		hits, misses := warmPool.hitRate()
+		writeMetric(w, "holytunnel_pool_hits_total", "counter",
+			"Targets served from the upstream pool.", float64(hits))
+		writeMetric(w, "holytunnel_pool_misses_total", "counter",
+			"Targets dialled because the pool was empty.", float64(misses))
+	}
+}
+
+func writeMetric(w *bufio.Writer, name, kind, help string, value float64) {
+	fmt.Fprintf(w, "# HELP %s %s\n# TYPE %s %s\n%s %g\n", name, help, name, kind, name, value)
+}
+
+func writeHistogram(w *bufio.Writer, name, help string, h *histogram) {
+	fmt.Fprintf(w, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name)
+
+	var cumulative uint64
+	for i, le := range latencyBuckets {
+		cumulative += h.buckets[i].Load()
+		fmt.Fprintf(w, "%s_bucket{le=\"%g\"} %d\n", name, le, cumulative)
+	}
+
+	cumulative += h.buckets[len(latencyBuckets)].Load()
+	fmt.Fprintf(w, "%s_bucket{le=\"+Inf\"} %d\n", name, cumulative)
+	fmt.Fprintf(w, "%s_sum %g\n", name, time.Duration(h.sumNs.Load()).Seconds())
+	fmt.Fprintf(w, "%s_count %d\n", name, h.count.Load())
+}
@@ -0,0 +1,676 @@
+package main
+
+import (
+	"crypto/hmac"
+	"crypto/rand"
+	"crypto/sha256"
+	"crypto/tls"
+	"encoding/binary"
+	"errors"
+	"io"
+	"net"
+	"os"
+	"sync"
+	"time"
+)
+
+const (
+	MUX_PREFACE       = "holymux2"
+	MUX_NONCE_SIZE    = 16
+	MUX_HEADER_SIZE   = 9
+	MUX_MAX_FRAME     = 16384
+	MUX_WINDOW        = 256 * 1024
+	MUX_ACCEPT_QUEUE  = 256
+	MUX_WRITE_TIMEOUT = 30 * time.Second
+
+	// type(1) stream(4) length(4), the length of a window update is the
+	// credit it gives
+	MUX_FRAME_OPEN   = 1
+	MUX_FRAME_DATA   = 2
+	MUX_FRAME_WINDOW = 3
+	MUX_FRAME_CLOSE  = 4 // no more data from the sender
+	MUX_FRAME_RESET  = 5 // the stream is gone
+)
+
+var (
+	errMuxProtocol = errors.New("mux: protocol error")
+	errMuxReset    = errors.New("mux: stream reset by peer")
+	errMuxClosed   = errors.New("mux: session closed")
+	errMuxAuth     = errors.New("mux: not a holytunnel peer, or another -mux-secret")
+)
+
+/*
+ * Multiplexed Transport
+ *
+ * One connection to a holytunnel peer carries any number of streams, so a
+ * tunnel over a long link costs one frame instead of a TCP (and TLS)
+ * handshake. The client opens streams, the peer hands every stream to its
+ * usual handler, which sees a CONNECT request. Each stream may have
+ * MUX_WINDOW bytes in flight, the reader hands out credit as the data is
+ * consumed, so one slow tunnel cannot stall the others. Frames are written
+ * whole under one lock and are at most MUX_MAX_FRAME long.
+ *
+ * Every stream reaches whatever host it names, so a session only starts
+ * once the client proved it knows -mux-secret: the peer sends a nonce and
+ * the client answers with MUX_PREFACE and an HMAC-SHA256 of both, the
+ * secret itself never goes over the wire.
+ */
+type muxSession struct {
+	conn net.Conn
+
+	writeMutex sync.Mutex
+	wbuf       []byte
+
+	mutex   sync.Mutex
+	streams map[uint32]*muxStream
+	nextId  uint32
+	accept  chan *muxStream // peer side only
+
+	closed    chan struct{}
+	closeOnce sync.Once
+	err       error
+}
+
+type muxStream struct {
+	session *muxSession
+	id      uint32
+
+	mutex    sync.Mutex
+	recv     []byte // received, not read yet
+	consumed int    // read since the last window update
+	window   int    // what may be sent
+	eof      bool   // the peer sent MUX_FRAME_CLOSE
+	sentEof  bool
+	err      error
+
+	readable      chan struct{}
+	writable      chan struct{}
+	readDeadline  time.Time
+	writeDeadline time.Time
+}
+
+func newMuxSession(conn net.Conn, client bool) *muxSession {
+	ret := &muxSession{
+		conn:    conn,
+		wbuf:    make([]byte, MUX_HEADER_SIZE+MUX_MAX_FRAME),
+		streams: make(map[uint32]*muxStream),
+		nextId:  1,
+		closed:  make(chan struct{}),
+	}
+
+	if !client {
+		ret.accept = make(chan *muxStream, MUX_ACCEPT_QUEUE)
+	}
+
+	go ret.readLoop()
+	return ret
+}
+
+func (self *muxSession) open() (*muxStream, error) {
+	self.mutex.Lock()
+	if self.err != nil {
+		self.mutex.Unlock()
+		return nil, self.err
+	}
+
+	stream := newMuxStream(self, self.nextId)
+	self.streams[stream.id] = stream
+	self.nextId += 2
+	self.mutex.Unlock()
+
+	if err := self.writeFrame(MUX_FRAME_OPEN, stream.id, 0, nil); err != nil {
+		return nil, err
+	}
+
+	return stream, nil
+}
+
+func (self *muxSession) isClosed() bool {
+	select {
+	case <-self.closed:
+		return true
+	default:
+		return false
+	}
+}
+
+func (self *muxSession) close(err error) {
+	self.closeOnce.Do(func() {
+		self.mutex.Lock()
+		self.err = err
+		streams := self.streams
+		self.streams = make(map[uint32]*muxStream)
+		self.mutex.Unlock()
+
+		close(self.closed)
+		self.conn.Close()
+		for _, stream := range streams {
+			stream.fail(err)
+		}
+	})
+}
+
+func (self *muxSession) writeFrame(kind byte, id uint32, length int, payload []byte) error {
+	self.writeMutex.Lock()
+	defer self.writeMutex.Unlock()
+
+	if self.isClosed() {
+		return errMuxClosed
+	}
+
+	b := self.wbuf[:MUX_HEADER_SIZE+len(payload)]
+	b[0] = kind
+	binary.BigEndian.PutUint32(b[1:5], id)
+	binary.BigEndian.PutUint32(b[5:9], uint32(length))
+	copy(b[MUX_HEADER_SIZE:], payload)
+
+	self.conn.SetWriteDeadline(time.Now().Add(MUX_WRITE_TIMEOUT))
+	if _, err := self.conn.Write(b); err != nil {
+		self.close(err)
+		return err
+	}
+
+	return nil
+}
+
+func (self *muxSession) stream(id uint32) *muxStream {
+	self.mutex.Lock()
+	defer self.mutex.Unlock()
+
+	return self.streams[id]
+}
+
+func (self *muxSession) forget(id uint32) {
+	self.mutex.Lock()
+	delete(self.streams, id)
+	self.mutex.Unlock()
+}
+
+func (self *muxSession) readLoop() {
+	var hdr [MUX_HEADER_SIZE]byte
+	payload := make([]byte, MUX_MAX_FRAME)
+	err := func() error {
+		for {
+			if _, err := io.ReadFull(self.conn, hdr[:]); err != nil {
+				return err
+			}
+
+			kind := hdr[0]
+			id := binary.BigEndian.Uint32(hdr[1:5])
+			length := binary.BigEndian.Uint32(hdr[5:9])
+
+			switch kind {
+			case MUX_FRAME_DATA:
+				if length > MUX_MAX_FRAME {
+					return errMuxProtocol
+				}
+
+				data := payload[:length]
+				if _, err := io.ReadFull(self.conn, data); err != nil {
+					return err
+				}
+
+				// data for a stream closed here is dropped
+				if stream := self.stream(id); stream != nil && !stream.push(data) {
+					self.forget(id)
+					stream.fail(errMuxProtocol)
+					go self.writeFrame(MUX_FRAME_RESET, id, 0, nil)
+				}
+			case MUX_FRAME_OPEN:
+				if self.accept == nil || self.stream(id) != nil {
+					return errMuxProtocol
+				}
+
+				stream := newMuxStream(self, id)
+				self.mutex.Lock()
+				self.streams[id] = stream
+				self.mutex.Unlock()
+
+				select {
+				case self.accept <- stream:
+				default:
+					self.forget(id)
+					go self.writeFrame(MUX_FRAME_RESET, id, 0, nil)
+				}
+			case MUX_FRAME_WINDOW:
+				if stream := self.stream(id); stream != nil {
+					stream.credit(int(length))
+				}
+			case MUX_FRAME_CLOSE:
+				if stream := self.stream(id); stream != nil {
+					stream.remoteClose()
+				}
+			case MUX_FRAME_RESET:
+				if stream := self.stream(id); stream != nil {
+					self.forget(id)
+					stream.fail(errMuxReset)
+				}
+			default:
+				return errMuxProtocol
+			}
+		}
+	}()
+
+	if err == io.EOF {
+		err = errMuxClosed
+	}
+
+	self.close(err)
+	if self.accept != nil {
+		close(self.accept)
+	}
+}
+
+func newMuxStream(session *muxSession, id uint32) *muxStream {
+	return &muxStream{
+		session:  session,
+		id:       id,
+		window:   MUX_WINDOW,
+		readable: make(chan struct{}, 1),
+		writable: make(chan struct{}, 1),
+	}
+}
+
+func notify(ch chan struct{}) {
+	select {
+	case ch <- struct{}{}:
+	default:
+	}
+}
+
+// push queues received data, false when the peer sent more than its window.
+func (self *muxStream) push(data []byte) bool {
+	self.mutex.Lock()
+	defer self.mutex.Unlock()
+
+	if len(self.recv)+len(data) > MUX_WINDOW {
+		return false
+	}
+
+	self.recv = append(self.recv, data...)
+	notify(self.readable)
+	return true
+}
+
+func (self *muxStream) credit(n int) {
+	self.mutex.Lock()
+	self.window += n
+	self.mutex.Unlock()
+	notify(self.writable)
+}
+
+func (self *muxStream) remoteClose() {
+	self.mutex.Lock()
+	self.eof = true
+	done := self.sentEof
+	self.mutex.Unlock()
+
+	if done {
+		self.session.forget(self.id)
+	}
+
+	notify(self.readable)
+}
+
+func (self *muxStream) fail(err error) {
+	self.mutex.Lock()
+	if self.err == nil {
+		self.err = err
+	}
+	self.mutex.Unlock()
+
+	notify(self.readable)
+	notify(self.writable)
+}
+
+// wait blocks until `ch` fires or `deadline` passes.
+func (self *muxStream) wait(ch chan struct{}, deadline time.Time) error {
+	if deadline.IsZero() {
+		<-ch
+		return nil
+	}
+
+	d := time.Until(deadline)
+	if d <= 0 {
+		return os.ErrDeadlineExceeded
+	}
+
+	timer := time.NewTimer(d)
+	defer timer.Stop()
+
+	select {
+	case <-ch:
+		return nil
+	case <-timer.C:
+		return os.ErrDeadlineExceeded
+	}
+}
+
+func (self *muxStream) Read(b []byte) (int, error) {
+	for {
+		self.mutex.Lock()
+		if len(self.recv) > 0 {
+			n := copy(b, self.recv)
+			self.recv = self.recv[n:]
+			self.consumed += n
+
+			update := 0
+			if self.consumed >= MUX_WINDOW/2 {
+				update, self.consumed = self.consumed, 0
+			}
+			self.mutex.Unlock()
+
+			if update > 0 {
+				self.session.writeFrame(MUX_FRAME_WINDOW, self.id, update, nil)
+			}
+
+			return n, nil
+		}
+
+		err := self.err
+		if err == nil && self.eof {
+			err = io.EOF
+		}
+
+		deadline := self.readDeadline
+		self.mutex.Unlock()
+
+		if err != nil {
+			return 0, err
+		}
+
+		if err = self.wait(self.readable, deadline); err != nil {
+			return 0, err
+		}
+	}
+}
+
+func (self *muxStream) Write(b []byte) (int, error) {
+	total := 0
+	for len(b) > 0 {
+		self.mutex.Lock()
+		err := self.err
+		if err == nil && self.sentEof {
+			err = net.ErrClosed
+		}
+
+		n := self.window
+		deadline := self.writeDeadline
+		if err == nil && n > 0 {
+			if n > len(b) {
+				n = len(b)
+			}
+
+			if n > MUX_MAX_FRAME {
+				n = MUX_MAX_FRAME
+			}
+
+			self.window -= n
+		}
+		self.mutex.Unlock()
+
+		if err != nil {
+			return total, err
+		}
+
+		if n == 0 {
+			if err = self.wait(self.writable, deadline); err != nil {
+				return total, err
+			}
+
+			continue
+		}
+
+		if err = self.session.writeFrame(MUX_FRAME_DATA, self.id, n, b[:n]); err != nil {
+			return total, err
+		}
+
+		total += n
+		b = b[n:]
+	}
+
+	return total, nil
+}
+
+// CloseWrite sends EOF, reading goes on.
+func (self *muxStream) CloseWrite() error {
+	self.mutex.Lock()
+	if self.sentEof || self.err != nil {
+		self.mutex.Unlock()
+		return nil
+	}
+
+	self.sentEof = true
+	done := self.eof
+	self.mutex.Unlock()
+
+	if done {
+		self.session.forget(self.id)
+	}
+
+	return self.session.writeFrame(MUX_FRAME_CLOSE, self.id, 0, nil)
+}
+
+// Close ends the stream, like TCP it resets when the peer is still sending.
+func (self *muxStream) Close() error {
+	self.mutex.Lock()
+	if self.err != nil {
+		self.mutex.Unlock()
+		return nil
+	}
+
+	self.err = net.ErrClosed
+	kind := byte(MUX_FRAME_RESET)
+	if self.eof {
+		kind = MUX_FRAME_CLOSE
+	}
+
+	sent := self.sentEof && self.eof
+	self.recv = nil
+	self.mutex.Unlock()
+
+	notify(self.readable)
+	notify(self.writable)
+	self.session.forget(self.id)
+	if sent {
+		return nil
+	}
+
+	return self.session.writeFrame(kind, self.id, 0, nil)
+}
+
+func (self *muxStream) LocalAddr() net.Addr {
+	return self.session.conn.LocalAddr()
+}
+
+func (self *muxStream) RemoteAddr() net.Addr {
+	return self.session.conn.RemoteAddr()
+}
+
+func (self *muxStream) SetDeadline(t time.Time) error {
+	self.SetReadDeadline(t)
+	return self.SetWriteDeadline(t)
+}
+
+func (self *muxStream) SetReadDeadline(t time.Time) error {
+	self.mutex.Lock()
+	self.readDeadline = t
+	self.mutex.Unlock()
+
+	// a waiting Read picks up the new deadline
+	notify(self.readable)
+	return nil
+}
+
+func (self *muxStream) SetWriteDeadline(t time.Time) error {
+	self.mutex.Lock()
+	self.writeDeadline = t
+	self.mutex.Unlock()
+
+	notify(self.writable)
+	return nil
+}
+
+// client side: one session per peer, dialled again once it broke
+type muxPeer struct {
+	mutex   sync.Mutex
+	session *muxSession
+}
+
+var muxPeersMutex sync.Mutex
+var muxPeers = make(map[string]*muxPeer)
+
+func muxDial(hop *upstreamHop) (net.Conn, error) {
+	key := hop.kind + "://" + hop.addr
+
+	muxPeersMutex.Lock()
+	peer, ok := muxPeers[key]
+	if !ok {
+		peer = &muxPeer{}
+		muxPeers[key] = peer
+	}
+	muxPeersMutex.Unlock()
+
+	// the first tunnel dials, the others wait for its session
+	peer.mutex.Lock()
+	defer peer.mutex.Unlock()
+
+	if peer.session == nil || peer.session.isClosed() {
+		conn, err := targetDialer.dial(hop.addr)
+		if err != nil {
+			return nil, err
+		}
+
+		if hop.kind == UPSTREAM_MUX_TLS {
+			tc := tls.Client(conn, &tls.Config{ServerName: hop.host})
+			tc.SetDeadline(time.Now().Add(currentCfg().dialTimeout))
+			if err = tc.Handshake(); err != nil {
+				conn.Close()
+				return nil, err
+			}
+
+			tc.SetDeadline(time.Time{})
+			conn = tc
+		}
+
+		conn.SetDeadline(time.Now().Add(currentCfg().dialTimeout))
+		if err = muxGreet(conn, hop.auth); err != nil {
+			conn.Close()
+			return nil, err
+		}
+
+		conn.SetDeadline(time.Time{})
+
+		info("mux: connected to %s", key)
+		peer.session = newMuxSession(conn, true)
+	}
+
+	return peer.session.open()
+}
+
+// isLoopbackAddr tells a HOST:PORT only this machine can reach, an empty
+// host is every interface.
+func isLoopbackAddr(hostPort string) bool {
+	host, _, err := net.SplitHostPort(hostPort)
+	if err != nil {
+		return false
+	}
+
+	if host == "localhost" {
+		return true
+	}
+
+	ip := net.ParseIP(host)
+	return ip != nil && ip.IsLoopback()
+}
+
+// muxAcceptLoop serves holytunnel peers, each stream is one client.
+func muxAcceptLoop(listener net.Listener, c *config, adm *admission) error {
+	if len(c.muxCert) > 0 {
+		cert, err := tls.LoadX509KeyPair(c.muxCert, c.muxKey)
+		if err != nil {
+			return err
+		}
+
+		listener = tls.NewListener(listener, &tls.Config{Certificates: []tls.Certificate{cert}})
+	}
+
+	for {
+		conn, err := listener.Accept()
+		if err != nil {
+			if errors.Is(err, net.ErrClosed) {
+				return err
+			}
+
+			perror("mux: %s", err)
+			time.Sleep(ACCEPT_MIN_DELAY)
+			continue
+		}
+
+		go serveMux(conn, adm, c.muxSecret)
+	}
+}
+
+func serveMux(conn net.Conn, adm *admission, secret string) {
+	// the TLS handshake happens on the first write as well
+	conn.SetDeadline(time.Now().Add(currentCfg().dialTimeout))
+	if err := muxCheck(conn, secret); err != nil {
+		perror("%s -> %s", conn.RemoteAddr(), err)
+		conn.Close()
+		return
+	}
+
+	conn.SetDeadline(time.Time{})
+	info("%s -> mux session", conn.RemoteAddr())
+
+	session := newMuxSession(conn, false)
+	for stream := range session.accept {
+		metrics.accepts.Add(1)
+		adm.admit(stream, false)
+	}
+
+	debug("%s -> mux session closed: %s", conn.RemoteAddr(), session.err)
+}
+
+// muxProof is what a client knowing `secret` answers to `nonce`.
+func muxProof(secret string, nonce []byte) []byte {
+	mac := hmac.New(sha256.New, []byte(secret))
+	mac.Write([]byte(MUX_PREFACE))
+	mac.Write(nonce)
+	return mac.Sum(nil)
+}
+
+// muxGreet is the client side of the session handshake.
+func muxGreet(conn net.Conn, secret string) error {
+	var nonce [MUX_NONCE_SIZE]byte
+	if _, err := io.ReadFull(conn, nonce[:]); err != nil {
+		return err
+	}
+
+	_, err := conn.Write(append([]byte(MUX_PREFACE), muxProof(secret, nonce[:])...))
+	return err
+}
+
+// muxCheck is the peer side, an error means the client is not let in.
+func muxCheck(conn net.Conn, secret string) error {
+	var nonce [MUX_NONCE_SIZE]byte
+	if _, err := rand.Read(nonce[:]); err != nil {
+		return err
+	}
+
+	if _, err := conn.Write(nonce[:]); err != nil {
+		return err
+	}
+
+	var answer [len(MUX_PREFACE) + sha256.Size]byte
+	if _, err := io.ReadFull(conn, answer[:]); err != nil {
+		return errMuxAuth
+	}
+
+	if string(answer[:len(MUX_PREFACE)]) != MUX_PREFACE ||
+		!hmac.Equal(answer[len(MUX_PREFACE):], muxProof(secret, nonce[:])) {
+		return errMuxAuth
+	}
+
+	return nil
+}
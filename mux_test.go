@@ -0,0 +1,73 @@
+package main
+
+import (
+	"errors"
+	"net"
+	"testing"
+)
+
+func TestMuxHandshake(t *testing.T) {
+	cases := []struct {
+		client, peer string
+		want         error
+	}{
+		{"s3cret", "s3cret", nil},
+		{"", "", nil},
+		{"guess", "s3cret", errMuxAuth},
+		{"", "s3cret", errMuxAuth},
+	}
+
+	for _, tc := range cases {
+		client, peer := net.Pipe()
+		greeted := make(chan error, 1)
+		go func() {
+			greeted <- muxGreet(client, tc.client)
+			client.Close()
+		}()
+
+		err := muxCheck(peer, tc.peer)
+		peer.Close()
+		<-greeted
+		if !errors.Is(err, tc.want) {
+			t.Errorf("%q to %q: got %v, want %v", tc.client, tc.peer, err, tc.want)
+		}
+	}
+}
+
+func TestMuxListenNeedsSecret(t *testing.T) {
+	cases := []struct {
+		args []string
+		ok   bool
+	}{
+		{[]string{"-mux-listen", "127.0.0.1:8003"}, true},
+		{[]string{"-mux-listen", "[::1]:8003"}, true},
+		{[]string{"-mux-listen", "localhost:8003"}, true},
+		{[]string{"-mux-listen", "0.0.0.0:8003"}, false},
+		{[]string{"-mux-listen", ":8003"}, false},
+		{[]string{"-mux-listen", "far.example.org:8003"}, false},
+		{[]string{"-mux-listen", ":8003", "-mux-secret", "s3cret"}, true},
+	}
+
+	for _, tc := range cases {
+		if _, err := loadConfig(tc.args); (err == nil) != tc.ok {
+			t.Errorf("%v: got %v", tc.args, err)
+		}
+	}
+}
+
+func TestMuxUpstreamSecret(t *testing.T) {
+	for spec, want := range map[string]string{
+		"mux://peer:8003":             "",
+		"mux://s3cret@peer:8003":      "s3cret",
+		"mux+tls://:s3cret@peer:8003": "s3cret",
+	} {
+		chain, err := parseUpstream(spec)
+		if err != nil {
+			t.Fatalf("%s: %v", spec, err)
+		}
+
+		if got := chain.hops[0].auth; got != want {
+			t.Errorf("%s: secret %q, want %q", spec, got, want)
+		}
+	}
+}
@@ -0,0 +1,63 @@
+package main
+
+import (
+	"sync"
+)
+
+const (
+	POOL_MIN_SHIFT = 12 // 4 KiB
+	POOL_MAX_SHIFT = 16 // 64 KiB
+	POOL_CLASSES   = POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1
+	RELAY_BUF_SIZE = 32768
+)
+
+/*
+ * Buffer Pool
+ *
+ * Size-classed (power of two) buffers shared by the header read, the
+ * ClientHello read and the user-space relay. Buffers are only held while a
+ * connection is actually doing something with them.
+ */
+var bufferPools [POOL_CLASSES]sync.Pool
+
+func init() {
+	for i := range bufferPools {
+		size := 1 << (POOL_MIN_SHIFT + i)
+		bufferPools[i].New = func() any {
+			b := make([]byte, size)
+			return &b
+		}
+	}
+}
+
+func poolClass(size int) int {
+	class := 0
+	for (1 << (POOL_MIN_SHIFT + class)) < size {
+		class++
+	}
+
+	return class
+}
+
+// getBuffer returns a buffer of at least `size` bytes. Requests bigger than
+// the largest class are not pooled.
+func getBuffer(size int) *[]byte {
+	if size > (1 << POOL_MAX_SHIFT) {
+		b := make([]byte, size)
+		return &b
+	}
+
+	b := bufferPools[poolClass(size)].Get().(*[]byte)
+	*b = (*b)[:size]
+	return b
+}
+
+func putBuffer(b *[]byte) {
+	c := cap(*b)
+	if c < (1<<POOL_MIN_SHIFT) || c > (1<<POOL_MAX_SHIFT) || c&(c-1) != 0 {
+		return
+	}
+
+	*b = (*b)[:c]
+	bufferPools[poolClass(c)].Put(b)
+}
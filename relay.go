@@ -0,0 +1,317 @@
+package main
+
+import (
+	"errors"
+	"io"
+	"net"
+	"os"
+	"sync/atomic"
+	"time"
+)
+
+/*
+ * Relay
+ *
+ * Both directions of a tunnel share one activity clock. A direction that
+ * runs into its deadline only gives up when the whole tunnel has been idle
+ * for `idleTimeout`, or when the tunnel is older than `maxLifetime`. EOF on
+ * one side is passed on as a TCP half-close, and the tunnel ends once both
+ * directions are done; any other error tears both sides down.
+ */
+type relayActivity struct {
+	last     atomic.Int64 // unix nano
+	idle     time.Duration
+	deadline time.Time // zero: no absolute limit
+}
+
+func newRelayActivity(c *config) *relayActivity {
+	ret := &relayActivity{idle: c.idleTimeout}
+	if c.maxLifetime > 0 {
+		ret.deadline = time.Now().Add(c.maxLifetime)
+	}
+
+	ret.touch()
+	return ret
+}
+
+func (self *relayActivity) touch() {
+	if self != nil {
+		self.last.Store(time.Now().UnixNano())
+	}
+}
+
+// next returns the deadline for the next wait, or false when the tunnel is
+// done.
+func (self *relayActivity) next() (time.Time, bool) {
+	now := time.Now()
+	if !self.deadline.IsZero() && !now.Before(self.deadline) {
+		return time.Time{}, false
+	}
+
+	var ret time.Time
+	if self.idle > 0 {
+		ret = time.Unix(0, self.last.Load()).Add(self.idle)
+		if !now.Before(ret) {
+			return time.Time{}, false
+		}
+	}
+
+	if !self.deadline.IsZero() && (ret.IsZero() || self.deadline.Before(ret)) {
+		ret = self.deadline
+	}
+
+	return ret, true
+}
+
+// relayMeter is one direction of a tunnel: the shared activity clock plus
+// the counters it feeds. A nil meter counts nothing and never times out.
+type relayMeter struct {
+	act       *relayActivity
+	direction int
+	shard     uint32
+	sentAt    time.Time      // non-zero: time the first byte against it
+	trace     *connTrace     // gets the first byte, may be nil
+	probe     *responseProbe // gets the first read, may be nil
+
+	// shaping, see shape()
+	buckets [2]*tokenBucket
+	chunk   int
+}
+
+func (self *relayMeter) add(n int64) {
+	if self == nil || n <= 0 {
+		return
+	}
+
+	self.act.touch()
+	metrics.bytes[self.direction].add(self.shard, uint64(n))
+	if self.probe != nil {
+		self.probe.done(int(n), nil)
+		self.probe = nil
+	}
+
+	if !self.sentAt.IsZero() {
+		metrics.ttfb.observe(time.Since(self.sentAt))
+		self.trace.mark(TRACE_FIRST_BYTE)
+		self.sentAt = time.Time{}
+	}
+}
+
+// end passes the end of the direction to a probe that saw no data, nil
+// `err` is EOF.
+func (self *relayMeter) end(err error) {
+	if self == nil || self.probe == nil {
+		return
+	}
+
+	if err == nil {
+		err = io.EOF
+	}
+
+	self.probe.done(0, err)
+	self.probe = nil
+}
+
+// extend moves the deadlines of one direction forward. It is called before
+// relaying starts and whenever a deadline fires, and returns false when the
+// tunnel is done.
+func (self *relayMeter) extend(dst, src net.Conn) bool {
+	if self == nil || self.act == nil {
+		return false
+	}
+
+	deadline, ok := self.act.next()
+	if !ok {
+		return false
+	}
+
+	src.SetReadDeadline(deadline)
+	dst.SetWriteDeadline(deadline)
+	return true
+}
+
+// arm is extend for a single read of `src` or write to `dst`, either may be
+// nil. Without an activity clock there is no deadline to set.
+func (self *relayMeter) arm(dst, src net.Conn) bool {
+	if self == nil || self.act == nil {
+		return true
+	}
+
+	deadline, ok := self.act.next()
+	if !ok {
+		return false
+	}
+
+	if src != nil {
+		src.SetReadDeadline(deadline)
+	}
+
+	if dst != nil {
+		dst.SetWriteDeadline(deadline)
+	}
+
+	return true
+}
+
+// read is src.Read under the deadlines of the tunnel. A timeout only comes
+// back once the whole tunnel is idle or expired. The bytes are activity, it
+// is up to the caller to count them.
+func (self *relayMeter) read(src net.Conn, b []byte) (int, error) {
+	for {
+		if !self.arm(nil, src) {
+			return 0, os.ErrDeadlineExceeded
+		}
+
+		recvd, err := src.Read(b)
+		if recvd > 0 {
+			self.touch()
+			return recvd, err
+		}
+
+		if !isTimeout(err) || self == nil || self.act == nil {
+			return recvd, err
+		}
+	}
+}
+
+// write sends all of `b` to `dst` under the deadlines of the tunnel.
+func (self *relayMeter) write(dst net.Conn, b []byte) error {
+	for len(b) > 0 {
+		if !self.arm(dst, nil) {
+			return os.ErrDeadlineExceeded
+		}
+
+		snd, err := dst.Write(b)
+		b = b[snd:]
+		if snd > 0 {
+			self.touch()
+		}
+
+		if err != nil && (!isTimeout(err) || self == nil || self.act == nil) {
+			return err
+		}
+	}
+
+	return nil
+}
+
+func (self *relayMeter) touch() {
+	if self != nil {
+		self.act.touch()
+	}
+}
+
+// setIdleDeadline bounds a wait for the client's next message.
+func (self *client) setIdleDeadline() {
+	if idle := self.cfg.idleTimeout; idle > 0 {
+		self.source.SetReadDeadline(time.Now().Add(idle))
+	}
+}
+
+func isTimeout(err error) bool {
+	return errors.Is(err, os.ErrDeadlineExceeded)
+}
+
+func (self *client) spliceConnection(host string) {
+	act := newRelayActivity(self.cfg)
+	up := self.shape(&relayMeter{act: act, direction: DIRECTION_UP, shard: self.shard}, host)
+	down := self.shape(&relayMeter{act: act, direction: DIRECTION_DOWN, shard: self.shard,
+		sentAt: self.sentAt, trace: self.trace, probe: self.probe}, host)
+
+	// an event loop owns the sockets and the slots from here, closing ours
+	// is fine
+	if handOffRelay(self.source, self.target, up, down, self.release) {
+		self.release = nil
+		return
+	}
+
+	done := make(chan struct{})
+	go func() {
+		defer close(done)
+		defer recoverConn(self.source, self.target)
+		relayDirection(self.target, self.source, up)
+	}()
+
+	relayDirection(self.source, self.target, down)
+	<-done
+}
+
+// relay forwards `src` to `dst` up to EOF.
+func relay(dst, src net.Conn, m *relayMeter) (int64, error) {
+	return relayN(dst, src, -1, m)
+}
+
+// eofAt is the error of an EOF after `total` of `n` bytes, n < 0 has no
+// length to fall short of.
+func eofAt(total, n int64) error {
+	if n >= 0 && total < n {
+		return io.ErrUnexpectedEOF
+	}
+
+	return nil
+}
+
+func relayDirection(dst, src net.Conn, m *relayMeter) {
+	if m.extend(dst, src) {
+		_, err := relay(dst, src, m)
+		m.end(err)
+		if err == nil {
+			// EOF: half-close, the other direction may still be busy
+			if cw, ok := dst.(interface{ CloseWrite() error }); ok {
+				cw.CloseWrite()
+				return
+			}
+		}
+
+		if err != nil && !isTimeout(err) && !errors.Is(err, net.ErrClosed) {
+			metrics.error(STAGE_RELAY)
+		}
+	}
+
+	// error, idle or expired: unblock the other direction too
+	src.Close()
+	dst.Close()
+}
+
+// relayCopy is the portable user-space relay, used when splice(2) is not
+// available for the given pair of connections or the direction is shaped.
+// It stops after `n` bytes, n < 0 runs up to EOF.
+func relayCopy(dst, src net.Conn, n int64, m *relayMeter) (int64, error) {
+	buffer := getBuffer(RELAY_BUF_SIZE)
+	defer putBuffer(buffer)
+
+	window := *buffer
+	if m.limited() && m.chunk < len(window) {
+		window = window[:m.chunk]
+	}
+
+	var total int64
+	for n < 0 || total < n {
+		if n >= 0 && n-total < int64(len(window)) {
+			window = window[:n-total]
+		}
+
+		recvd, err := src.Read(window)
+		m.throttle(int64(recvd))
+		for snd := 0; snd < recvd; {
+			s, werr := dst.Write(window[snd:recvd])
+			snd += s
+			total += int64(s)
+			if werr != nil && !(isTimeout(werr) && m.extend(dst, src)) {
+				return total, werr
+			}
+		}
+
+		m.add(int64(recvd))
+
+		if err == io.EOF {
+			return total, eofAt(total, n)
+		}
+
+		if err != nil && !(isTimeout(err) && m.extend(dst, src)) {
+			return total, err
+		}
+	}
+
+	return total, nil
+}
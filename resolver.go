@@ -0,0 +1,236 @@
+package main
+
+import (
+	"container/list"
+	"context"
+	"errors"
+	"net"
+	"strings"
+	"sync"
+	"time"
+)
+
+const (
+	DNS_MIN_TTL = time.Second
+	DNS_MAX_TTL = 24 * time.Hour
+)
+
+var errDnsNoAddress = errors.New("no such host")
+
+/*
+ * Resolver
+ *
+ * Lookups go through an LRU cache that keeps positive answers for their TTL
+ * and failed ones for `negTtl`. Concurrent lookups of the same name collapse
+ * into one query. Without an upstream the system resolver is used; it does
+ * not report TTLs, so its answers are kept for `sysTtl`.
+ */
+type dnsEntry struct {
+	name    string
+	ips     []net.IP
+	err     error
+	expires time.Time
+}
+
+type dnsCall struct {
+	done chan struct{}
+	ips  []net.IP
+	err  error
+}
+
+type resolver struct {
+	upstream dnsExchanger
+	sysTtl   time.Duration
+	negTtl   time.Duration
+	capacity int
+
+	mutex    sync.Mutex
+	lru      *list.List
+	entries  map[string]*list.Element
+	inFlight map[string]*dnsCall
+}
+
+var dnsResolver *resolver
+
+func newResolver(c *config) (*resolver, error) {
+	ret := &resolver{
+		sysTtl:   c.dnsSysTtl,
+		negTtl:   c.dnsNegTtl,
+		capacity: c.dnsCacheSize,
+		lru:      list.New(),
+		entries:  make(map[string]*list.Element),
+		inFlight: make(map[string]*dnsCall),
+	}
+
+	if len(c.dnsUpstream) > 0 {
+		upstream, err := newDnsExchanger(c.dnsUpstream)
+		if err != nil {
+			return nil, err
+		}
+
+		ret.upstream = upstream
+	}
+
+	return ret, nil
+}
+
+// lookup returns the addresses of `host`, an IP literal is returned as is.
+func (self *resolver) lookup(host string) ([]net.IP, error) {
+	if ip := net.ParseIP(host); ip != nil {
+		return []net.IP{ip}, nil
+	}
+
+	host = strings.ToLower(host)
+	now := time.Now()
+
+	self.mutex.Lock()
+	if elem, ok := self.entries[host]; ok {
+		entry := elem.Value.(*dnsEntry)
+		if now.Before(entry.expires) {
+			self.lru.MoveToFront(elem)
+			self.mutex.Unlock()
+			return entry.ips, entry.err
+		}
+
+		self.lru.Remove(elem)
+		delete(self.entries, host)
+	}
+
+	if call, ok := self.inFlight[host]; ok {
+		self.mutex.Unlock()
+		<-call.done
+		return call.ips, call.err
+	}
+
+	call := &dnsCall{done: make(chan struct{})}
+	self.inFlight[host] = call
+	self.mutex.Unlock()
+
+	ips, ttl, err := self.query(host)
+	call.ips, call.err = ips, err
+
+	self.mutex.Lock()
+	delete(self.inFlight, host)
+	self.store(host, ips, err, ttl)
+	self.mutex.Unlock()
+
+	close(call.done)
+	return ips, err
+}
+
+// store must be called with `mutex` held.
+func (self *resolver) store(host string, ips []net.IP, err error, ttl time.Duration) {
+	if self.capacity <= 0 {
+		return
+	}
+
+	if err != nil && !isNotFound(err) {
+		// transport trouble, only remember it briefly
+		ttl = DNS_MIN_TTL
+	}
+
+	if ttl < DNS_MIN_TTL {
+		ttl = DNS_MIN_TTL
+	} else if ttl > DNS_MAX_TTL {
+		ttl = DNS_MAX_TTL
+	}
+
+	entry := &dnsEntry{name: host, ips: ips, err: err, expires: time.Now().Add(ttl)}
+	self.entries[host] = self.lru.PushFront(entry)
+
+	for self.lru.Len() > self.capacity {
+		oldest := self.lru.Back()
+		self.lru.Remove(oldest)
+		delete(self.entries, oldest.Value.(*dnsEntry).name)
+	}
+}
+
+func (self *resolver) query(host string) ([]net.IP, time.Duration, error) {
+	if self.upstream == nil {
+		return self.querySystem(host)
+	}
+
+	type result struct {
+		ans dnsAnswer
+		err error
+	}
+
+	// A and AAAA in parallel
+	results := make(chan result, 2)
+	for _, qtype := range [...]uint16{DNS_TYPE_AAAA, DNS_TYPE_A} {
+		go func(qtype uint16) {
+			ans, err := self.queryUpstream(host, qtype)
+			results <- result{ans, err}
+		}(qtype)
+	}
+
+	var ips []net.IP
+	var err error
+	ttl := DNS_MAX_TTL
+	for i := 0; i < 2; i++ {
+		r := <-results
+		if r.err != nil {
+			err = r.err
+			continue
+		}
+
+		ips = append(ips, r.ans.ips...)
+		if t := time.Duration(r.ans.ttl) * time.Second; t < ttl {
+			ttl = t
+		}
+	}
+
+	if len(ips) > 0 {
+		return ips, ttl, nil
+	}
+
+	if err != nil {
+		return nil, 0, err
+	}
+
+	if ttl > self.negTtl {
+		ttl = self.negTtl
+	}
+
+	return nil, ttl, &net.DNSError{Err: errDnsNoAddress.Error(), Name: host, IsNotFound: true}
+}
+
+func (self *resolver) queryUpstream(host string, qtype uint16) (dnsAnswer, error) {
+	query, id, err := newDnsQuery(host, qtype)
+	if err != nil {
+		return dnsAnswer{}, err
+	}
+
+	resp, err := self.upstream.exchange(query)
+	if err != nil {
+		return dnsAnswer{}, err
+	}
+
+	return parseDnsAnswer(resp, id, qtype)
+}
+
+func (self *resolver) querySystem(host string) ([]net.IP, time.Duration, error) {
+	ctx, cancel := context.WithTimeout(context.Background(), 2*DNS_TIMEOUT)
+	defer cancel()
+
+	addrs, err := net.DefaultResolver.LookupIPAddr(ctx, host)
+	if err != nil {
+		if isNotFound(err) {
+			return nil, self.negTtl, err
+		}
+
+		return nil, 0, err
+	}
+
+	ips := make([]net.IP, len(addrs))
+	for i := range addrs {
+		ips[i] = addrs[i].IP
+	}
+
+	return ips, self.sysTtl, nil
+}
+
+func isNotFound(err error) bool {
+	var dnsErr *net.DNSError
+	return errors.As(err, &dnsErr) && dnsErr.IsNotFound
+}
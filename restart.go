@@ -0,0 +1,257 @@
+package main
+
+import (
+	"errors"
+	"fmt"
+	"net"
+	"os"
+	"os/exec"
+	"os/signal"
+	"strconv"
+	"strings"
+	"time"
+)
+
+const (
+	ENV_INHERIT_FDS = "HOLYTUNNEL_FDS"   // roles of the inherited sockets
+	ENV_READY_FD    = "HOLYTUNNEL_READY" // pipe the new process reports on
+
+	LISTEN_FDS_START = 3 // first inherited FD, see sd_listen_fds(3)
+
+	ROLE_PROXY       = "proxy"
+	ROLE_TRANSPARENT = "transparent"
+	ROLE_MUX         = "mux"
+
+	RESTART_READY_TIMEOUT = 10 * time.Second
+	DRAIN_POLL_INTERVAL   = 100 * time.Millisecond
+)
+
+var errRestartNotReady = errors.New("new process did not come up")
+
+/*
+ * Graceful Restart
+ *
+ * On the restart signal the listening sockets are passed to a fresh copy of
+ * the executable, so the port never stops accepting: connections queue in
+ * the kernel until the new accept loops run. Once the new process reports
+ * back, the old one closes its listeners and waits for its connections to
+ * finish, `drainTimeout` at most. A new process that fails to start leaves
+ * the old one serving as before.
+ *
+ * Sockets from systemd socket activation (LISTEN_FDS) are picked up the same
+ * way, ones named "transparent" or "mux" in LISTEN_FDNAMES are those
+ * listeners.
+ */
+type inheritedSockets struct {
+	proxy       []net.Listener
+	transparent net.Listener
+	mux         net.Listener
+}
+
+// inheritListeners returns the sockets handed over by the previous process
+// or by systemd, or false when there are none.
+func inheritListeners() (inheritedSockets, bool, error) {
+	var ret inheritedSockets
+
+	var roles []string
+	if env := os.Getenv(ENV_INHERIT_FDS); len(env) > 0 {
+		roles = strings.Split(env, ",")
+	} else if pid, _ := strconv.Atoi(os.Getenv("LISTEN_PID")); pid == os.Getpid() {
+		count, _ := strconv.Atoi(os.Getenv("LISTEN_FDS"))
+		names := strings.Split(os.Getenv("LISTEN_FDNAMES"), ":")
+		for i := 0; i < count; i++ {
+			if i < len(names) && (names[i] == ROLE_TRANSPARENT || names[i] == ROLE_MUX) {
+				roles = append(roles, names[i])
+			} else {
+				roles = append(roles, ROLE_PROXY)
+			}
+		}
+	}
+
+	// children must not take them again
+	os.Unsetenv(ENV_INHERIT_FDS)
+	os.Unsetenv("LISTEN_PID")
+	os.Unsetenv("LISTEN_FDS")
+	os.Unsetenv("LISTEN_FDNAMES")
+
+	if len(roles) == 0 {
+		return ret, false, nil
+	}
+
+	for i, role := range roles {
+		file := os.NewFile(uintptr(LISTEN_FDS_START+i), role)
+		l, err := net.FileListener(file)
+		file.Close()
+		if err != nil {
+			return ret, false, fmt.Errorf("inherited socket %d: %w", i, err)
+		}
+
+		switch role {
+		case ROLE_TRANSPARENT:
+			ret.transparent = l
+		case ROLE_MUX:
+			ret.mux = l
+		default:
+			ret.proxy = append(ret.proxy, l)
+		}
+	}
+
+	if len(ret.proxy) == 0 {
+		return ret, false, errors.New("no inherited proxy socket")
+	}
+
+	return ret, true, nil
+}
+
+func (self *inheritedSockets) close() {
+	for _, l := range self.proxy {
+		l.Close()
+	}
+
+	if self.transparent != nil {
+		self.transparent.Close()
+	}
+
+	if self.mux != nil {
+		self.mux.Close()
+	}
+}
+
+// reportReady tells the previous process that the new one accepts.
+func reportReady() {
+	fd, err := strconv.Atoi(os.Getenv(ENV_READY_FD))
+	os.Unsetenv(ENV_READY_FD)
+	if err != nil {
+		return
+	}
+
+	pipe := os.NewFile(uintptr(fd), "ready")
+	pipe.Write([]byte{1})
+	pipe.Close()
+}
+
+// waitRestart returns once a new process took over the sockets.
+func waitRestart(sockets inheritedSockets) {
+	if len(restartSignals) == 0 {
+		select {}
+	}
+
+	sig := make(chan os.Signal, 1)
+	signal.Notify(sig, restartSignals...)
+	for range sig {
+		info("Restarting")
+
+		// the successor loads what was learned so far and saves from then on
+		strategies.stopSaving()
+		if err := startSuccessor(sockets); err != nil {
+			perror("restart: %s", err)
+			strategies.startSaving()
+			continue
+		}
+
+		// a second signal must not kill the draining process
+		signal.Ignore(restartSignals...)
+		return
+	}
+}
+
+func startSuccessor(sockets inheritedSockets) error {
+	var files []*os.File
+	var roles []string
+	defer func() {
+		for _, f := range files {
+			f.Close()
+		}
+	}()
+
+	add := func(l net.Listener, role string) error {
+		tcp, ok := l.(*net.TCPListener)
+		if !ok {
+			return fmt.Errorf("cannot pass a %T", l)
+		}
+
+		f, err := tcp.File()
+		if err != nil {
+			return err
+		}
+
+		files = append(files, f)
+		roles = append(roles, role)
+		return nil
+	}
+
+	for _, l := range sockets.proxy {
+		if err := add(l, ROLE_PROXY); err != nil {
+			return err
+		}
+	}
+
+	if sockets.transparent != nil {
+		if err := add(sockets.transparent, ROLE_TRANSPARENT); err != nil {
+			return err
+		}
+	}
+
+	if sockets.mux != nil {
+		if err := add(sockets.mux, ROLE_MUX); err != nil {
+			return err
+		}
+	}
+
+	readyR, readyW, err := os.Pipe()
+	if err != nil {
+		return err
+	}
+	defer readyR.Close()
+
+	files = append(files, readyW)
+
+	exe, err := os.Executable()
+	if err != nil {
+		return err
+	}
+
+	cmd := exec.Command(exe, os.Args[1:]...)
+	cmd.Stdin, cmd.Stdout, cmd.Stderr = os.Stdin, os.Stdout, os.Stderr
+	cmd.ExtraFiles = files
+	cmd.Env = append(os.Environ(),
+		ENV_INHERIT_FDS+"="+strings.Join(roles, ","),
+		ENV_READY_FD+"="+strconv.Itoa(LISTEN_FDS_START+len(roles)))
+
+	if err = cmd.Start(); err != nil {
+		return err
+	}
+
+	// ours has to go, or EOF would never come if the child dies
+	readyW.Close()
+	files = files[:len(files)-1]
+
+	readyR.SetReadDeadline(time.Now().Add(RESTART_READY_TIMEOUT))
+	var ready [1]byte
+	if n, _ := readyR.Read(ready[:]); n != 1 {
+		cmd.Process.Kill()
+		go cmd.Wait()
+		return errRestartNotReady
+	}
+
+	// reaped by init once we are gone
+	go cmd.Wait()
+	info("Handed over to pid %d", cmd.Process.Pid)
+	return nil
+}
+
+// drain waits for the connections in progress and the queued ones, `timeout`
+// at most.
+func drain(adm *admission, timeout time.Duration) {
+	deadline := time.Now().Add(timeout)
+	for metrics.active.Load() > 0 || len(adm.queue) > 0 {
+		if timeout > 0 && time.Now().After(deadline) {
+			info("Drain timeout, cutting %d connection(s)", metrics.active.Load())
+			return
+		}
+
+		time.Sleep(DRAIN_POLL_INTERVAL)
+	}
+
+	info("Drained")
+}
@@ -0,0 +1,10 @@
+//go:build linux
+
+package main
+
+import (
+	"os"
+	"syscall"
+)
+
+var restartSignals = []os.Signal{syscall.SIGUSR2}
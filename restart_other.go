@@ -0,0 +1,8 @@
+//go:build !linux
+
+package main
+
+import "os"
+
+// no graceful restart, passing sockets is only done on Linux
+var restartSignals []os.Signal
@@ -0,0 +1,22 @@
+//go:build linux
+
+package main
+
+import (
+	"syscall"
+)
+
+const _SO_REUSEPORT = 0xf
+
+func setReusePort(network, address string, c syscall.RawConn) error {
+	var serr error
+	err := c.Control(func(fd uintptr) {
+		serr = syscall.SetsockoptInt(int(fd), syscall.SOL_SOCKET, _SO_REUSEPORT, 1)
+	})
+
+	if err != nil {
+		return err
+	}
+
+	return serr
+}
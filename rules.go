@@ -0,0 +1,488 @@
+package main
+
+import (
+	"errors"
+	"fmt"
+	"net"
+	"os"
+	"sort"
+	"strings"
+	"time"
+)
+
+type ruleAction uint8
+
+const (
+	RULE_NONE ruleAction = iota
+	RULE_DIRECT
+	RULE_FRAGMENT
+	RULE_BLOCK
+	RULE_VIA
+)
+
+var ruleActionNames = [...]string{"", "direct", "fragment", "block", "via"}
+
+// sorts below every character of a label
+const RULE_KEY_SEP = '\x01'
+
+var errRuleBlocked = errors.New("blocked by rule")
+
+/*
+ * Domain Rules
+ *
+ * A rule file lists domains under the action they get, a domain covers all
+ * of its subdomains and the most specific one wins:
+ *
+ *	[direct]
+ *	example.org
+ *	[fragment]
+ *	youtube.com
+ *	[block]
+ *	ads.example.org
+ *	[via socks5://10.0.0.1:1080]
+ *	example.net
+ *	[direct rate=1m burst=4m]
+ *	downloads.example.com
+ *
+ * "direct" hosts are relayed as they are, "fragment" ones always get the
+ * -split-mode treatment (the adaptive table leaves both alone) and "block"
+ * ones are refused; "via" ones go through an upstream chain. A section with
+ * "rate=" shares that bandwidth (bytes/s each way, -rate-burst unless
+ * "burst=" is given) between all tunnels to its domains, on top of
+ * -rate-per-ip. The list is compiled into a trie of reversed labels
+ * kept in flat arrays: the children of a node are a sorted run of `edges`,
+ * and a lookup is one binary search per label of the host, without
+ * allocating. Building it is one sort of the reversed domains, no map,
+ * and the labels share a single string.
+ */
+type ruleEdge struct {
+	parent int32
+	child  int32
+	label  string
+}
+
+type ruleSet struct {
+	actions  []ruleAction // by node, the root is 0
+	first    []int32      // the children of n are edges[first[n]:first[n+1]]
+	edges    []ruleEdge
+	sections map[int32]*ruleSection // of the nodes whose section has one
+	domains  int
+}
+
+// ruleSection is what a section header says besides the action.
+type ruleSection struct {
+	via   *upstreamChain
+	limit *rateLimit // nil: unlimited
+}
+
+// loadRules compiles `path`, `burst` is the default of "rate=" sections.
+func loadRules(path string, burst int64) (*ruleSet, error) {
+	start := time.Now()
+	data, err := os.ReadFile(path)
+	if err != nil {
+		return nil, err
+	}
+
+	ret, err := compileRules(string(data), burst)
+	if err != nil {
+		return nil, fmt.Errorf("%s: %w", path, err)
+	}
+
+	info("rules: %d domains from %s in %v", ret.domains, path, time.Since(start))
+	return ret, nil
+}
+
+func compileRules(data string, burst int64) (*ruleSet, error) {
+	// every domain becomes its labels in reverse, "org\x01example", in one
+	// buffer; sorted, the domains under one node are next to each other
+	var keys ruleKeys
+	reversed := make([]byte, 0, len(data))
+
+	var sections []*ruleSection
+	action, section := RULE_NONE, int32(-1)
+	for lineNo := 1; len(data) > 0; lineNo++ {
+		line := data
+		if i := strings.IndexByte(data, '\n'); i >= 0 {
+			line, data = data[:i], data[i+1:]
+		} else {
+			data = ""
+		}
+
+		if i := strings.IndexByte(line, '#'); i >= 0 {
+			line = line[:i]
+		}
+
+		line = strings.TrimSpace(line)
+		if len(line) == 0 {
+			continue
+		}
+
+		if line[0] == '[' {
+			sec, err := parseRuleSection(line, &action, burst)
+			if err != nil {
+				return nil, fmt.Errorf("line %d: %w", lineNo, err)
+			}
+
+			if section = -1; sec != nil {
+				section = int32(len(sections))
+				sections = append(sections, sec)
+			}
+
+			continue
+		}
+
+		if action == RULE_NONE {
+			return nil, fmt.Errorf("line %d: domain outside a section", lineNo)
+		}
+
+		// "*.example.org" and ".example.org" mean the same as "example.org"
+		domain := strings.TrimPrefix(strings.TrimPrefix(line, "*"), ".")
+		domain = strings.TrimSuffix(domain, ".")
+		if !validRuleDomain(domain) {
+			return nil, fmt.Errorf("line %d: invalid domain %q", lineNo, line)
+		}
+
+		start := len(reversed)
+		for end := len(domain); end > 0; {
+			dot := strings.LastIndexByte(domain[:end], '.')
+			if len(reversed) > start {
+				reversed = append(reversed, RULE_KEY_SEP)
+			}
+
+			for i := dot + 1; i < end; i++ {
+				c := domain[i]
+				if 'A' <= c && c <= 'Z' {
+					c += 'a' - 'A'
+				}
+
+				reversed = append(reversed, c)
+			}
+
+			end = dot
+		}
+
+		keys.list = append(keys.list, ruleKey{
+			prefix:  keyPrefix(reversed[start:]),
+			start:   int32(start),
+			end:     int32(len(reversed)),
+			line:    int32(len(keys.list)),
+			section: section,
+			action:  action,
+		})
+	}
+
+	// the labels point into this from now on
+	keys.all = string(reversed)
+	sort.Sort(&keys)
+
+	// the sorted keys are a depth-first walk of the trie: a key shares the
+	// nodes of the labels it has in common with the one before, and new
+	// children of a node come in label order
+	ret := &ruleSet{
+		actions: make([]ruleAction, 1, 2*len(keys.list)+1),
+		edges:   make([]ruleEdge, 0, 2*len(keys.list)),
+	}
+
+	var path []ruleEdge
+	for _, k := range keys.list {
+		key := keys.all[k.start:k.end]
+		depth := 0
+		for len(key) > 0 {
+			label := key
+			if i := strings.IndexByte(key, RULE_KEY_SEP); i >= 0 {
+				label, key = key[:i], key[i+1:]
+			} else {
+				key = ""
+			}
+
+			if depth < len(path) && path[depth].label == label {
+				depth++
+				continue
+			}
+
+			parent := int32(0)
+			if depth > 0 {
+				parent = path[depth-1].child
+			}
+
+			e := ruleEdge{parent, int32(len(ret.actions)), label}
+			ret.actions = append(ret.actions, RULE_NONE)
+			ret.edges = append(ret.edges, e)
+			path = append(path[:depth], e)
+			depth++
+		}
+
+		// a domain listed twice keeps the action of the later line
+		node := path[depth-1].child
+		ret.actions[node] = k.action
+		if k.section >= 0 {
+			if ret.sections == nil {
+				ret.sections = make(map[int32]*ruleSection)
+			}
+
+			ret.sections[node] = sections[k.section]
+		} else {
+			delete(ret.sections, node)
+		}
+
+		path = path[:depth]
+	}
+
+	ret.domains = len(keys.list)
+
+	// bucket the edges by parent, which keeps every run in label order
+	ret.first = make([]int32, len(ret.actions)+1)
+	for _, e := range ret.edges {
+		ret.first[e.parent+1]++
+	}
+
+	for i := 1; i < len(ret.first); i++ {
+		ret.first[i] += ret.first[i-1]
+	}
+
+	edges := make([]ruleEdge, len(ret.edges))
+	next := append([]int32(nil), ret.first[:len(ret.actions)]...)
+	for _, e := range ret.edges {
+		edges[next[e.parent]] = e
+		next[e.parent]++
+	}
+
+	ret.edges = edges
+	return ret, nil
+}
+
+// ruleKeys sorts the reversed domains, in file order when equal. Most
+// comparisons are settled by the first eight bytes.
+type ruleKey struct {
+	prefix     uint64
+	start, end int32
+	line       int32
+	section    int32 // index of the ruleSection, -1: none
+	action     ruleAction
+}
+
+type ruleKeys struct {
+	all  string
+	list []ruleKey
+}
+
+func (self *ruleKeys) Len() int { return len(self.list) }
+
+func (self *ruleKeys) Less(i, j int) bool {
+	a, b := &self.list[i], &self.list[j]
+	if a.prefix != b.prefix {
+		return a.prefix < b.prefix
+	}
+
+	ka, kb := self.all[a.start:a.end], self.all[b.start:b.end]
+	if ka != kb {
+		return ka < kb
+	}
+
+	return a.line < b.line
+}
+
+func (self *ruleKeys) Swap(i, j int) {
+	self.list[i], self.list[j] = self.list[j], self.list[i]
+}
+
+// keyPrefix packs the start of `key` big-endian, so it orders like the key.
+func keyPrefix(key []byte) uint64 {
+	var ret uint64
+	for i := 0; i < 8; i++ {
+		ret <<= 8
+		if i < len(key) {
+			ret |= uint64(key[i])
+		}
+	}
+
+	return ret
+}
+
+// validRuleDomain takes names of non-empty labels, anything that looks like
+// a URL or a pattern is refused.
+func validRuleDomain(domain string) bool {
+	if len(domain) == 0 || domain[0] == '.' {
+		return false
+	}
+
+	for i := 0; i < len(domain); i++ {
+		switch c := domain[i]; {
+		case c == '.':
+			if i+1 == len(domain) || domain[i+1] == '.' {
+				return false
+			}
+		case c <= ' ', c == '/', c == ':', c == '*':
+			return false
+		}
+	}
+
+	return true
+}
+
+// parseRuleSection reads "[direct]" and the like, the chain of a
+// "[via CHAIN]" and the "rate=" and "burst=" attributes. It returns nil for
+// a plain action.
+func parseRuleSection(section string, action *ruleAction, burst int64) (*ruleSection, error) {
+	fields := strings.Fields(strings.TrimSuffix(strings.TrimPrefix(section, "["), "]"))
+	if len(fields) == 0 {
+		return nil, fmt.Errorf("unknown section %s", section)
+	}
+
+	var spec []string
+	rate := int64(0)
+	for _, f := range fields[1:] {
+		key, value, _ := strings.Cut(f, "=")
+		var err error
+		switch strings.ToLower(key) {
+		case "rate":
+			rate, err = parseByteRate(value)
+		case "burst":
+			if burst, err = parseByteRate(value); err == nil && burst < RATE_CHUNK_MIN {
+				err = fmt.Errorf("burst below %d", RATE_CHUNK_MIN)
+			}
+		default:
+			spec = append(spec, f)
+		}
+
+		if err != nil {
+			return nil, fmt.Errorf("%s: %w", section, err)
+		}
+	}
+
+	for i, n := range ruleActionNames {
+		if i == 0 || !strings.EqualFold(n, fields[0]) {
+			continue
+		}
+
+		*action = ruleAction(i)
+		ret := &ruleSection{}
+		if *action == RULE_VIA {
+			chain, err := parseUpstream(strings.Join(spec, " "))
+			if err != nil {
+				return nil, err
+			}
+
+			ret.via = chain
+		} else if len(spec) > 0 {
+			break
+		}
+
+		if rate > 0 {
+			ret.limit = newRateLimit(rate, burst)
+		}
+
+		if ret.via == nil && ret.limit == nil {
+			return nil, nil
+		}
+
+		return ret, nil
+	}
+
+	return nil, fmt.Errorf("unknown section %s", section)
+}
+
+// match returns the action of the most specific rule covering `host`.
+func (self *ruleSet) match(host string) ruleAction {
+	if self == nil {
+		return RULE_NONE
+	}
+
+	return self.actions[self.lookup(host)]
+}
+
+// lookup returns the node of the most specific rule, the root for none.
+func (self *ruleSet) lookup(host string) int32 {
+	host = strings.TrimSuffix(host, ".")
+
+	// no TLD is numeric, IP addresses never match
+	if len(host) == 0 || strings.IndexByte(host, ':') >= 0 || isDigit(host[len(host)-1]) {
+		return 0
+	}
+
+	ret := int32(0)
+	node := int32(0)
+	for end := len(host); end > 0; {
+		start := strings.LastIndexByte(host[:end], '.') + 1
+		if node = self.child(node, host[start:end]); node < 0 {
+			break
+		}
+
+		if self.actions[node] != RULE_NONE {
+			ret = node
+		}
+
+		end = start - 1
+	}
+
+	return ret
+}
+
+func (self *ruleSet) child(node int32, label string) int32 {
+	edges := self.edges[self.first[node]:self.first[node+1]]
+	lo, hi := 0, len(edges)
+	for lo < hi {
+		mid := int(uint(lo+hi) >> 1)
+		switch c := compareLabel(edges[mid].label, label); {
+		case c == 0:
+			return edges[mid].child
+		case c < 0:
+			lo = mid + 1
+		default:
+			hi = mid
+		}
+	}
+
+	return -1
+}
+
+// compareLabel orders like strings.Compare, `b` is lowered on the fly.
+func compareLabel(a, b string) int {
+	for i := 0; i < len(a) && i < len(b); i++ {
+		c := b[i]
+		if 'A' <= c && c <= 'Z' {
+			c += 'a' - 'A'
+		}
+
+		if a[i] != c {
+			if a[i] < c {
+				return -1
+			}
+
+			return 1
+		}
+	}
+
+	return len(a) - len(b)
+}
+
+func isDigit(c byte) bool {
+	return '0' <= c && c <= '9'
+}
+
+// limitFor returns the buckets of the rule covering `host`, nil for none.
+func (self *ruleSet) limitFor(host string) *rateLimit {
+	if self == nil || len(self.sections) == 0 || len(host) == 0 {
+		return nil
+	}
+
+	if sec := self.sections[self.lookup(host)]; sec != nil {
+		return sec.limit
+	}
+
+	return nil
+}
+
+// hostRule matches the host part of `hostPort`.
+func hostRule(c *config, hostPort string) ruleAction {
+	rules := c.rules
+	if rules == nil {
+		return RULE_NONE
+	}
+
+	if host, _, err := net.SplitHostPort(hostPort); err == nil {
+		return rules.match(host)
+	}
+
+	return rules.match(hostPort)
+}
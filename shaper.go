@@ -0,0 +1,262 @@
+package main
+
+import (
+	"fmt"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+const (
+	RATE_CHUNK_MAX    = 16384                 // largest read of a shaped direction
+	RATE_CHUNK_MIN    = 1024                  // smallest one, for very low rates
+	RATE_CHUNK_TIME   = 50 * time.Millisecond // a chunk is this much transfer time
+	RATE_SWEEP_PERIOD = time.Minute
+)
+
+// monotonic, unlike UnixNano
+var rateEpoch = time.Now()
+
+/*
+ * Bandwidth Shaping
+ *
+ * Token buckets as GCRA: a bucket is the single atomic time it has been
+ * drained until, taking bytes moves it forward by their transfer time and
+ * the taker sleeps off whatever lies beyond the burst. No lock, no refill
+ * timer, an idle bucket costs nothing.
+ *
+ * Every source IP gets a pair of buckets (one per direction) with
+ * -rate-per-ip, and a rule section with "rate=" one pair shared by all of its
+ * domains. A shaped direction reads at most one chunk at a time and waits on
+ * all of its buckets before passing it on. Tunnels sharing a bucket only take
+ * their next chunk after sleeping off the last one, so they get their turns
+ * in order: a small read waits behind one chunk per busy tunnel, not behind
+ * their backlog. Shaped tunnels are relayed by relayCopy, splice(2) and the
+ * epoll loops would bypass the buckets.
+ */
+type tokenBucket struct {
+	tat       atomic.Int64 // ns since rateEpoch the bucket is drained until
+	nsPerByte float64
+	tolerance int64 // the burst, in ns
+	chunk     int
+}
+
+func (self *tokenBucket) init(rate, burst int64) {
+	self.nsPerByte = float64(time.Second) / float64(rate)
+	self.tolerance = int64(float64(burst) * self.nsPerByte)
+
+	self.chunk = int(rate * int64(RATE_CHUNK_TIME) / int64(time.Second))
+	if self.chunk > RATE_CHUNK_MAX {
+		self.chunk = RATE_CHUNK_MAX
+	} else if self.chunk < RATE_CHUNK_MIN {
+		self.chunk = RATE_CHUNK_MIN
+	}
+}
+
+// reserve takes `n` bytes and returns how long to wait before they are due.
+func (self *tokenBucket) reserve(n int64) time.Duration {
+	cost := int64(float64(n) * self.nsPerByte)
+	for {
+		now := int64(time.Since(rateEpoch))
+		old := self.tat.Load()
+		tat := old
+		if tat < now {
+			tat = now
+		}
+
+		if self.tat.CompareAndSwap(old, tat+cost) {
+			if wait := tat + cost - self.tolerance - now; wait > 0 {
+				return time.Duration(wait)
+			}
+
+			return 0
+		}
+	}
+}
+
+func (self *tokenBucket) idle() bool {
+	return self.tat.Load() <= int64(time.Since(rateEpoch))
+}
+
+// rateLimit is a bucket per direction.
+type rateLimit struct {
+	rate, burst int64
+	buckets     [2]tokenBucket // by direction
+}
+
+func newRateLimit(rate, burst int64) *rateLimit {
+	ret := &rateLimit{rate: rate, burst: burst}
+	for i := range ret.buckets {
+		ret.buckets[i].init(rate, burst)
+	}
+
+	return ret
+}
+
+func (self *rateLimit) idle() bool {
+	for i := range self.buckets {
+		if !self.buckets[i].idle() {
+			return false
+		}
+	}
+
+	return true
+}
+
+// sourceRates keeps the buckets of the addresses with connections, and of
+// recent ones until their debt is paid, or reconnecting would reset it.
+type sourceRates struct {
+	mutex     sync.Mutex
+	entries   map[string]*sourceRate
+	lastSweep time.Time
+}
+
+type sourceRate struct {
+	limit *rateLimit
+	refs  int
+}
+
+var shaper = sourceRates{entries: make(map[string]*sourceRate)}
+
+// acquire returns the buckets of `ip`, new ones when the configured rate
+// changed since they were made.
+func (self *sourceRates) acquire(ip string, rate, burst int64) *rateLimit {
+	self.mutex.Lock()
+	defer self.mutex.Unlock()
+
+	if now := time.Now(); now.Sub(self.lastSweep) >= RATE_SWEEP_PERIOD {
+		self.lastSweep = now
+		for k, e := range self.entries {
+			if e.refs == 0 && e.limit.idle() {
+				delete(self.entries, k)
+			}
+		}
+	}
+
+	e := self.entries[ip]
+	if e == nil {
+		e = &sourceRate{}
+		self.entries[ip] = e
+	}
+
+	if e.limit == nil || e.limit.rate != rate || e.limit.burst != burst {
+		e.limit = newRateLimit(rate, burst)
+	}
+
+	e.refs++
+	return e.limit
+}
+
+func (self *sourceRates) release(ip string) {
+	self.mutex.Lock()
+	defer self.mutex.Unlock()
+
+	e := self.entries[ip]
+	if e == nil {
+		return
+	}
+
+	if e.refs--; e.refs <= 0 && e.limit.idle() {
+		delete(self.entries, ip)
+	}
+}
+
+// shape attaches the buckets of the client's address and of the rule
+// covering `host` to `m`.
+func (self *client) shape(m *relayMeter, host string) *relayMeter {
+	m.buckets = [2]*tokenBucket{}
+	m.chunk = 0
+	if self.rate != nil {
+		m.addBucket(&self.rate.buckets[m.direction])
+	}
+
+	if limit := self.cfg.rules.limitFor(host); limit != nil {
+		m.addBucket(&limit.buckets[m.direction])
+	}
+
+	return m
+}
+
+func (self *relayMeter) addBucket(b *tokenBucket) {
+	i := 0
+	if self.buckets[0] != nil {
+		i = 1
+	}
+
+	self.buckets[i] = b
+	if self.chunk == 0 || b.chunk < self.chunk {
+		self.chunk = b.chunk
+	}
+}
+
+// limited reports whether the direction has buckets to wait on.
+func (self *relayMeter) limited() bool {
+	return self != nil && self.buckets[0] != nil
+}
+
+// throttle waits until `n` more bytes are allowed through.
+func (self *relayMeter) throttle(n int64) {
+	if !self.limited() || n <= 0 {
+		return
+	}
+
+	var wait time.Duration
+	for _, b := range self.buckets {
+		if b == nil {
+			break
+		}
+
+		if w := b.reserve(n); w > wait {
+			wait = w
+		}
+	}
+
+	if wait > 0 {
+		time.Sleep(wait)
+	}
+}
+
+// byteRate is a flag of bytes per second, "512k", "2m" or plain bytes.
+type byteRate int64
+
+func (self *byteRate) String() string {
+	return strconv.FormatInt(int64(*self), 10)
+}
+
+func (self *byteRate) Set(s string) error {
+	v, err := parseByteRate(s)
+	if err != nil {
+		return err
+	}
+
+	*self = byteRate(v)
+	return nil
+}
+
+func parseByteRate(spec string) (int64, error) {
+	s := strings.ToLower(strings.TrimSpace(spec))
+	unit := int64(1)
+	if len(s) > 0 {
+		switch s[len(s)-1] {
+		case 'k':
+			unit = 1 << 10
+		case 'm':
+			unit = 1 << 20
+		case 'g':
+			unit = 1 << 30
+		}
+	}
+
+	if unit > 1 {
+		s = s[:len(s)-1]
+	}
+
+	v, err := strconv.ParseInt(s, 10, 64)
+	if err != nil || v < 0 || v > (1<<62)/unit {
+		return 0, fmt.Errorf("invalid rate %q", spec)
+	}
+
+	return v * unit, nil
+}
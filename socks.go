@@ -0,0 +1,278 @@
+package main
+
+import (
+	"context"
+	"errors"
+	"net"
+	"strconv"
+	"syscall"
+)
+
+const (
+	SOCKS_VERSION = 0x05
+
+	SOCKS_AUTH_NONE         = 0x00
+	SOCKS_AUTH_USER         = 0x02
+	SOCKS_AUTH_UNACCEPTABLE = 0xff
+
+	SOCKS_CMD_CONNECT       = 0x01
+	SOCKS_CMD_UDP_ASSOCIATE = 0x03
+
+	SOCKS_ATYP_IPV4   = 0x01
+	SOCKS_ATYP_DOMAIN = 0x03
+	SOCKS_ATYP_IPV6   = 0x04
+
+	SOCKS_REP_OK               = 0x00
+	SOCKS_REP_FAILURE          = 0x01
+	SOCKS_REP_NOT_ALLOWED      = 0x02
+	SOCKS_REP_HOST_UNREACHABLE = 0x04
+	SOCKS_REP_REFUSED          = 0x05
+	SOCKS_REP_CMD_UNSUPPORTED  = 0x07
+	SOCKS_REP_ATYP_UNSUPPORTED = 0x08
+
+	SOCKS_GREETING_HEADER_SIZE = 2
+	SOCKS_REQUEST_HEADER_SIZE  = 4
+)
+
+var (
+	errSocksInval       = errors.New("invalid SOCKS5 request")
+	errSocksNoAuth      = errors.New("no acceptable SOCKS5 auth method")
+	errSocksUnsupported = errors.New("unsupported SOCKS5 request")
+)
+
+// only the bound address is left unset, clients do not use it for CONNECT
+var resSocksOk = []byte{
+	SOCKS_VERSION, SOCKS_REP_OK, 0x00, SOCKS_ATYP_IPV4, 0, 0, 0, 0, 0, 0,
+}
+
+/*
+ * SOCKS5
+ *
+ * RFC 1928 CONNECT and UDP ASSOCIATE without authentication. The greeting
+ * and the request are
+ * parsed straight from the header buffer, clients that send them (or even
+ * the ClientHello) in one go are served without extra reads. Once the
+ * target is known the tunnel goes through handleHttps like CONNECT does.
+ */
+func (self *client) handleSocks(recvd int) error {
+	rAddr := self.source.RemoteAddr()
+
+	recvd, err := self.fillBuffer(recvd, SOCKS_GREETING_HEADER_SIZE)
+	if err != nil {
+		return atStage(STAGE_PARSE, err)
+	}
+
+	greetingLen := SOCKS_GREETING_HEADER_SIZE + int((*self.buffer)[1])
+	if recvd, err = self.fillBuffer(recvd, greetingLen); err != nil {
+		return atStage(STAGE_PARSE, err)
+	}
+
+	if !hasSocksMethod((*self.buffer)[2:greetingLen], SOCKS_AUTH_NONE) {
+		self.source.Write([]byte{SOCKS_VERSION, SOCKS_AUTH_UNACCEPTABLE})
+		return atStage(STAGE_PARSE, errSocksNoAuth)
+	}
+
+	if _, err = self.source.Write([]byte{SOCKS_VERSION, SOCKS_AUTH_NONE}); err != nil {
+		return atStage(STAGE_PARSE, err)
+	}
+
+	hostPort, reqLen, recvd, err := self.readSocksRequest(greetingLen, recvd)
+	if err != nil {
+		return atStage(STAGE_PARSE, err)
+	}
+
+	if (*self.buffer)[greetingLen+1] == SOCKS_CMD_UDP_ASSOCIATE {
+		return self.handleSocksUdp()
+	}
+
+	info("%s -> SOCKS5 %s", rAddr, hostPort)
+	self.trace.setTarget(hostPort)
+	self.trace.mark(TRACE_PARSE)
+
+	if hostRule(self.cfg, hostPort) == RULE_BLOCK {
+		metrics.blocked.Add(1)
+		self.replySocks(SOCKS_REP_NOT_ALLOWED)
+		info("%s -> %s: %s", rAddr, hostPort, errRuleBlocked)
+		return nil
+	}
+
+	early := (*self.buffer)[reqLen:recvd]
+	if self.cfg.pipelineConnect {
+		return self.handleHttps(resSocksOk, early, hostPort,
+			dialTargetAsync(self.cfg, hostPort))
+	}
+
+	if self.target, err = dialTarget(self.cfg, hostPort); err != nil {
+		self.replySocks(socksReplyCode(err))
+		return err
+	}
+
+	self.trace.mark(TRACE_DIAL)
+
+	return self.handleHttps(resSocksOk, early, hostPort, nil)
+}
+
+// readSocksRequest parses the request starting at `start` and returns the
+// target, the offset right behind the request and the bytes received so
+// far, refusing other commands with a proper reply code.
+func (self *client) readSocksRequest(start, recvd int) (string, int, int, error) {
+	recvd, err := self.fillBuffer(recvd, start+SOCKS_REQUEST_HEADER_SIZE+1)
+	if err != nil {
+		return "", 0, 0, err
+	}
+
+	buffer := *self.buffer
+	req := buffer[start:]
+	if req[0] != SOCKS_VERSION || req[2] != 0x00 {
+		return "", 0, 0, errSocksInval
+	}
+
+	addrLen, err := socksAddrLen(req[3:])
+	if err != nil {
+		if err == errSocksUnsupported {
+			self.replySocks(SOCKS_REP_ATYP_UNSUPPORTED)
+		}
+
+		return "", 0, 0, err
+	}
+
+	end := start + SOCKS_REQUEST_HEADER_SIZE - 1 + addrLen
+	if recvd, err = self.fillBuffer(recvd, end); err != nil {
+		return "", 0, 0, err
+	}
+
+	if req[1] != SOCKS_CMD_CONNECT && req[1] != SOCKS_CMD_UDP_ASSOCIATE {
+		self.replySocks(SOCKS_REP_CMD_UNSUPPORTED)
+		return "", 0, 0, errSocksUnsupported
+	}
+
+	host, port := parseSocksAddr(req[3:])
+	if req[3] == SOCKS_ATYP_DOMAIN && !validSocksDomain(host) {
+		// "a:1" or "[::1]" would not survive JoinHostPort as one host
+		self.replySocks(SOCKS_REP_HOST_UNREACHABLE)
+		return "", 0, 0, errSocksInval
+	}
+
+	return net.JoinHostPort(host, strconv.Itoa(port)), end, recvd, nil
+}
+
+func validSocksDomain(domain string) bool {
+	for i := 0; i < len(domain); i++ {
+		switch c := domain[i]; {
+		case c <= ' ', c >= 0x7f, c == ':', c == '/', c == '[', c == ']', c == '@':
+			return false
+		}
+	}
+
+	return true
+}
+
+// socksAddrLen returns the size of the ATYP, DST.ADDR, DST.PORT triple at
+// the start of `b`, which needs to hold the ATYP and one more byte.
+func socksAddrLen(b []byte) (int, error) {
+	switch b[0] {
+	case SOCKS_ATYP_IPV4:
+		return 1 + net.IPv4len + 2, nil
+	case SOCKS_ATYP_IPV6:
+		return 1 + net.IPv6len + 2, nil
+	case SOCKS_ATYP_DOMAIN:
+		if b[1] == 0 {
+			return 0, errSocksInval
+		}
+
+		return 2 + int(b[1]) + 2, nil
+	}
+
+	return 0, errSocksUnsupported
+}
+
+// parseSocksAddr reads a triple already checked by socksAddrLen.
+func parseSocksAddr(b []byte) (string, int) {
+	var host string
+	end := 0
+	switch b[0] {
+	case SOCKS_ATYP_DOMAIN:
+		end = 2 + int(b[1])
+		host = string(b[2:end])
+	case SOCKS_ATYP_IPV4:
+		end = 1 + net.IPv4len
+		host = net.IP(b[1:end]).String()
+	default:
+		end = 1 + net.IPv6len
+		host = net.IP(b[1:end]).String()
+	}
+
+	return host, int(b[end])<<8 | int(b[end+1])
+}
+
+// putSocksAddr writes `addr` as an IP triple and returns its size.
+func putSocksAddr(b []byte, addr *net.UDPAddr) int {
+	n := 0
+	if ip := addr.IP.To4(); ip != nil {
+		b[0] = SOCKS_ATYP_IPV4
+		n = 1 + copy(b[1:], ip)
+	} else {
+		b[0] = SOCKS_ATYP_IPV6
+		n = 1 + copy(b[1:], addr.IP.To16())
+	}
+
+	b[n] = byte(addr.Port >> 8)
+	b[n+1] = byte(addr.Port)
+	return n + 2
+}
+
+// fillBuffer reads until at least `need` bytes are in the header buffer. The
+// SOCKS messages are far smaller than BUFFER_SIZE_MIN, a buffer too small
+// for them all the same is an error rather than a read of nothing forever.
+func (self *client) fillBuffer(recvd, need int) (int, error) {
+	buffer := *self.buffer
+	if need > len(buffer) {
+		return recvd, errSocksInval
+	}
+
+	for recvd < need {
+		r, err := self.source.Read(buffer[recvd:])
+		recvd += r
+		if err != nil && recvd < need {
+			return recvd, err
+		}
+	}
+
+	return recvd, nil
+}
+
+func (self *client) replySocks(code byte) {
+	res := make([]byte, len(resSocksOk))
+	copy(res, resSocksOk)
+	res[1] = code
+	self.source.Write(res)
+}
+
+func hasSocksMethod(methods []byte, method byte) bool {
+	for _, m := range methods {
+		if m == method {
+			return true
+		}
+	}
+
+	return false
+}
+
+func socksReplyCode(err error) byte {
+	switch {
+	case errors.Is(err, syscall.ECONNREFUSED):
+		return SOCKS_REP_REFUSED
+	case isNotFound(err), isDialTimeout(err):
+		return SOCKS_REP_HOST_UNREACHABLE
+	}
+
+	return SOCKS_REP_FAILURE
+}
+
+// isDialTimeout takes whatever a dial or a lookup gives up with, which is
+// not always os.ErrDeadlineExceeded.
+func isDialTimeout(err error) bool {
+	var netErr net.Error
+	return isTimeout(err) || errors.Is(err, context.DeadlineExceeded) ||
+		(errors.As(err, &netErr) && netErr.Timeout())
+}
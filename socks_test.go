@@ -0,0 +1,121 @@
+package main
+
+import (
+	"bytes"
+	"context"
+	"fmt"
+	"net"
+	"os"
+	"syscall"
+	"testing"
+)
+
+// scriptedConn reads what the client would have sent and drops the replies.
+type scriptedConn struct {
+	net.Conn
+	r *bytes.Reader
+}
+
+func (self *scriptedConn) Read(b []byte) (int, error)  { return self.r.Read(b) }
+func (self *scriptedConn) Write(b []byte) (int, error) { return len(b), nil }
+
+func FuzzReadSocksRequest(f *testing.F) {
+	f.Add([]byte{5, 1, 0, SOCKS_ATYP_IPV4, 127, 0, 0, 1, 0x01, 0xbb})
+	f.Add([]byte{5, 1, 0, SOCKS_ATYP_DOMAIN, 11, 'e', 'x', 'a', 'm', 'p', 'l', 'e', '.', 'c', 'o', 'm', 0, 80})
+	f.Add(append([]byte{5, 3, 0, SOCKS_ATYP_IPV6}, make([]byte, 18)...))
+	f.Add([]byte{5, 2, 0, SOCKS_ATYP_IPV4, 10, 0, 0, 1, 0, 1})
+	f.Add([]byte{5, 1, 0, SOCKS_ATYP_DOMAIN, 0})
+
+	f.Fuzz(func(t *testing.T, data []byte) {
+		buffer := make([]byte, 1024)
+		self := &client{
+			source: &scriptedConn{r: bytes.NewReader(data)},
+			buffer: &buffer,
+		}
+
+		// what a single read would have brought along with the greeting
+		recvd := copy(buffer, data)
+		self.source.(*scriptedConn).r.Seek(int64(recvd), 0)
+
+		hostPort, end, recvd, err := self.readSocksRequest(0, recvd)
+		if err != nil {
+			return
+		}
+
+		if end > recvd || recvd > len(data) {
+			t.Fatalf("request ends at %d of %d received, %d sent", end, recvd, len(data))
+		}
+
+		if _, _, err := net.SplitHostPort(hostPort); err != nil {
+			t.Fatalf("target %q: %v", hostPort, err)
+		}
+	})
+}
+
+func FuzzSocksAddr(f *testing.F) {
+	f.Add([]byte{SOCKS_ATYP_IPV4, 127, 0, 0, 1, 0x01, 0xbb})
+	f.Add([]byte{SOCKS_ATYP_DOMAIN, 1, 'a', 0, 80})
+	f.Add(append([]byte{SOCKS_ATYP_IPV6}, make([]byte, 18)...))
+
+	f.Fuzz(func(t *testing.T, data []byte) {
+		if len(data) < 2 {
+			return
+		}
+
+		n, err := socksAddrLen(data)
+		if err != nil || n > len(data) {
+			return
+		}
+
+		host, port := parseSocksAddr(data)
+		if data[0] == SOCKS_ATYP_DOMAIN {
+			return
+		}
+
+		ip := net.ParseIP(host)
+
+		// an IP triple survives the round trip, IPv4-mapped ones as IPv4
+		out := make([]byte, 1+net.IPv6len+2)
+		out = out[:putSocksAddr(out, &net.UDPAddr{IP: ip, Port: port})]
+		if h, p := parseSocksAddr(out); h != host || p != port {
+			t.Fatalf("%x came back as %x", data[:n], out)
+		}
+	})
+}
+
+func TestFillBufferTooSmall(t *testing.T) {
+	buffer := make([]byte, 8)
+	self := &client{
+		source: &scriptedConn{r: bytes.NewReader(make([]byte, 64))},
+		buffer: &buffer,
+	}
+
+	if _, err := self.fillBuffer(0, 8); err != nil {
+		t.Fatal(err)
+	}
+
+	if _, err := self.fillBuffer(8, 9); err != errSocksInval {
+		t.Fatalf("got %v", err)
+	}
+}
+
+func TestSocksReplyCode(t *testing.T) {
+	cases := []struct {
+		err  error
+		want byte
+	}{
+		{&net.OpError{Op: "dial", Err: syscall.ECONNREFUSED}, SOCKS_REP_REFUSED},
+		{&net.DNSError{Err: "no such host", IsNotFound: true}, SOCKS_REP_HOST_UNREACHABLE},
+		{&net.OpError{Op: "dial", Err: os.ErrDeadlineExceeded}, SOCKS_REP_HOST_UNREACHABLE},
+		{&net.DNSError{Err: "i/o timeout", IsTimeout: true}, SOCKS_REP_HOST_UNREACHABLE},
+		{fmt.Errorf("dial: %w", context.DeadlineExceeded), SOCKS_REP_HOST_UNREACHABLE},
+		{atStage(STAGE_DIAL, &net.DNSError{IsTimeout: true}), SOCKS_REP_HOST_UNREACHABLE},
+		{os.ErrClosed, SOCKS_REP_FAILURE},
+	}
+
+	for _, tc := range cases {
+		if got := socksReplyCode(tc.err); got != tc.want {
+			t.Errorf("%v: got %#x, want %#x", tc.err, got, tc.want)
+		}
+	}
+}
@@ -0,0 +1,316 @@
+package main
+
+import (
+	"io"
+	"net"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+const (
+	// RSV, RSV, FRAG, then the address as in requests
+	SOCKS_UDP_HEADER_SIZE = 3
+	SOCKS_UDP_MAX_HEADER  = SOCKS_UDP_HEADER_SIZE + 1 + net.IPv6len + 2
+	SOCKS_UDP_BUF_SIZE    = 65536
+
+	QUIC_PORT             = 443
+	QUIC_MIN_INITIAL_SIZE = 1200
+	QUIC_LONG_HEADER      = 0x80
+)
+
+// a greasing version (RFC 9000 15), no client supports it
+var quicUnsupportedVersion = [...]byte{0x1a, 0x2a, 0x3a, 0x4a}
+
+/*
+ * SOCKS5 UDP
+ *
+ * UDP ASSOCIATE gets two sockets: one the client sends its wrapped datagrams
+ * to, bound next to the control connection, and one facing the Internet.
+ * The association lasts as long as the control connection, or until no
+ * datagram went either way for `idleTimeout`.
+ *
+ * DPI that throttles QUIC makes browsers wait for the handshake to time out
+ * before they use TCP. Depending on `quicMode` the QUIC Initial packets are
+ * answered with a Version Negotiation that lists no usable version, which
+ * makes the client give up on QUIC at once (RFC 9000 6.2). "auto" only does
+ * so for hosts whose TCP connections need a bypass strategy.
+ */
+type udpAssociation struct {
+	peer   net.IP // only the owner of the control connection may use it
+	client atomic.Pointer[net.UDPAddr]
+	inner  *net.UDPConn
+	outer  *net.UDPConn
+	cfg    *config // of the control connection
+	act    *relayActivity
+	shard  uint32
+
+	closeOnce sync.Once
+	source    net.Conn
+}
+
+func (self *client) handleSocksUdp() error {
+	local, _ := self.source.LocalAddr().(*net.TCPAddr)
+	peer, _ := self.source.RemoteAddr().(*net.TCPAddr)
+	if local == nil || peer == nil {
+		self.replySocks(SOCKS_REP_FAILURE)
+		return errSocksUnsupported
+	}
+
+	inner, err := net.ListenUDP("udp", &net.UDPAddr{IP: local.IP})
+	if err != nil {
+		self.replySocks(SOCKS_REP_FAILURE)
+		return err
+	}
+	defer inner.Close()
+
+	outer, err := net.ListenUDP("udp", nil)
+	if err != nil {
+		self.replySocks(SOCKS_REP_FAILURE)
+		return err
+	}
+	defer outer.Close()
+
+	bound := inner.LocalAddr().(*net.UDPAddr)
+	res := make([]byte, SOCKS_REQUEST_HEADER_SIZE-1+1+net.IPv6len+2)
+	res[0], res[1], res[2] = SOCKS_VERSION, SOCKS_REP_OK, 0x00
+	n := putSocksAddr(res[3:], bound)
+	if _, err = self.source.Write(res[:3+n]); err != nil {
+		return err
+	}
+
+	info("%s -> SOCKS5 UDP %s", peer, bound)
+	self.releaseBuffer()
+
+	assoc := &udpAssociation{
+		peer:   peer.IP,
+		inner:  inner,
+		outer:  outer,
+		cfg:    self.cfg,
+		act:    newRelayActivity(self.cfg),
+		shard:  self.shard,
+		source: self.source,
+	}
+
+	// the control connection carries nothing, it only ends the association
+	self.source.SetReadDeadline(time.Time{})
+	go func() {
+		io.Copy(io.Discard, self.source)
+		assoc.close()
+	}()
+
+	done := make(chan struct{})
+	go func() {
+		assoc.relayUp()
+		assoc.close()
+		close(done)
+	}()
+
+	assoc.relayDown()
+	assoc.close()
+	<-done
+	return nil
+}
+
+func (self *udpAssociation) close() {
+	self.closeOnce.Do(func() {
+		self.inner.Close()
+		self.outer.Close()
+		self.source.Close()
+	})
+}
+
+// wait arms the read deadline of `conn` from the shared activity clock.
+func (self *udpAssociation) wait(conn *net.UDPConn) bool {
+	deadline, ok := self.act.next()
+	if ok {
+		conn.SetReadDeadline(deadline)
+	}
+
+	return ok
+}
+
+// relayUp unwraps the datagrams of the client and sends them on.
+func (self *udpAssociation) relayUp() {
+	buffer := getBuffer(SOCKS_UDP_BUF_SIZE)
+	defer putBuffer(buffer)
+
+	buf := *buffer
+	for self.wait(self.inner) {
+		n, from, err := self.inner.ReadFromUDP(buf)
+		if err != nil {
+			if isTimeout(err) {
+				continue
+			}
+
+			return
+		}
+
+		if !from.IP.Equal(self.peer) {
+			continue
+		}
+
+		self.client.Store(from)
+
+		// fragments (FRAG != 0) are not supported, drop them
+		if n < SOCKS_UDP_HEADER_SIZE+2 || buf[2] != 0x00 {
+			continue
+		}
+
+		addrLen, err := socksAddrLen(buf[SOCKS_UDP_HEADER_SIZE:n])
+		if err != nil || SOCKS_UDP_HEADER_SIZE+addrLen > n {
+			continue
+		}
+
+		host, port := parseSocksAddr(buf[SOCKS_UDP_HEADER_SIZE:])
+		payload := buf[SOCKS_UDP_HEADER_SIZE+addrLen : n]
+
+		if self.cfg.rules.match(host) == RULE_BLOCK {
+			continue
+		}
+
+		if port == QUIC_PORT && len(payload) > 0 && payload[0]&QUIC_LONG_HEADER != 0 &&
+			rejectQuic(self.cfg, host) {
+			self.refuseQuic(buf[:SOCKS_UDP_HEADER_SIZE+addrLen], payload, from)
+			continue
+		}
+
+		dst, err := resolveUdp(host, port)
+		if err != nil {
+			debug("%s -> SOCKS5 UDP %s: %s", from, host, err)
+			continue
+		}
+
+		if _, err = self.outer.WriteToUDP(payload, dst); err == nil {
+			self.act.touch()
+			metrics.bytes[DIRECTION_UP].add(self.shard, uint64(len(payload)))
+		}
+	}
+}
+
+// relayDown wraps what comes back and hands it to the client.
+func (self *udpAssociation) relayDown() {
+	buffer := getBuffer(SOCKS_UDP_BUF_SIZE)
+	defer putBuffer(buffer)
+
+	buf := *buffer
+	for self.wait(self.outer) {
+		n, from, err := self.outer.ReadFromUDP(buf[SOCKS_UDP_MAX_HEADER:])
+		if err != nil {
+			if isTimeout(err) {
+				continue
+			}
+
+			return
+		}
+
+		client := self.client.Load()
+		if client == nil {
+			continue
+		}
+
+		// the header goes right in front of the payload
+		var hdr [SOCKS_UDP_MAX_HEADER]byte
+		hdrLen := SOCKS_UDP_HEADER_SIZE + putSocksAddr(hdr[SOCKS_UDP_HEADER_SIZE:], from)
+		start := SOCKS_UDP_MAX_HEADER - hdrLen
+		copy(buf[start:], hdr[:hdrLen])
+
+		if _, err = self.inner.WriteToUDP(buf[start:SOCKS_UDP_MAX_HEADER+n], client); err == nil {
+			self.act.touch()
+			metrics.bytes[DIRECTION_DOWN].add(self.shard, uint64(n))
+		}
+	}
+}
+
+// refuseQuic answers a QUIC Initial with a Version Negotiation packet from
+// the destination, anything else sent to a refused host is dropped. `hdr`
+// is the SOCKS header of the datagram, which addresses the reply as well.
+func (self *udpAssociation) refuseQuic(hdr []byte, initial []byte, client *net.UDPAddr) {
+	// a version of 0 is a Version Negotiation already
+	if len(initial) < QUIC_MIN_INITIAL_SIZE ||
+		(initial[1]|initial[2]|initial[3]|initial[4]) == 0 {
+		return
+	}
+
+	vn, ok := quicVersionNegotiation(initial)
+	if !ok {
+		return
+	}
+
+	debug("%s -> SOCKS5 UDP: QUIC refused", client)
+	self.inner.WriteToUDP(append(append([]byte{}, hdr...), vn...), client)
+}
+
+// quicVersionNegotiation swaps the connection IDs of a long header packet
+// and offers only a version nobody speaks.
+func quicVersionNegotiation(packet []byte) ([]byte, bool) {
+	// flags(1) version(4) dcid_len(1) dcid scid_len(1) scid
+	if len(packet) < 7 {
+		return nil, false
+	}
+
+	dcidEnd := 6 + int(packet[5])
+	if dcidEnd >= len(packet) {
+		return nil, false
+	}
+
+	scidEnd := dcidEnd + 1 + int(packet[dcidEnd])
+	if scidEnd > len(packet) {
+		return nil, false
+	}
+
+	dcid, scid := packet[6:dcidEnd], packet[dcidEnd+1:scidEnd]
+
+	ret := make([]byte, 0, 7+len(dcid)+len(scid)+len(quicUnsupportedVersion))
+	ret = append(ret, QUIC_LONG_HEADER|0x40, 0, 0, 0, 0)
+	ret = append(ret, byte(len(scid)))
+	ret = append(ret, scid...)
+	ret = append(ret, byte(len(dcid)))
+	ret = append(ret, dcid...)
+	ret = append(ret, quicUnsupportedVersion[:]...)
+	return ret, true
+}
+
+func rejectQuic(c *config, host string) bool {
+	switch c.quicMode {
+	case QUIC_MODE_BLOCK:
+		return true
+	case QUIC_MODE_AUTO:
+		switch c.rules.match(host) {
+		case RULE_BLOCK, RULE_FRAGMENT:
+			return true
+		}
+
+		// datagrams do not go through upstreams, the TCP fallback does
+		if upstreamFor(c, host) != nil {
+			return true
+		}
+
+		// only hosts known to need a bypass, not every host the default
+		// strategy would split
+		st, ok := strategies.learned(c, host, true)
+		return ok && st.kind != STRATEGY_NONE
+	}
+
+	return false
+}
+
+func resolveUdp(host string, port int) (*net.UDPAddr, error) {
+	ips, err := dnsResolver.lookup(host)
+	if err != nil {
+		return nil, err
+	}
+
+	if len(ips) == 0 {
+		return nil, errDnsNoAddress
+	}
+
+	// there is no racing for datagrams, IPv4 is the safer bet
+	for _, ip := range ips {
+		if ip.To4() != nil {
+			return &net.UDPAddr{IP: ip, Port: port}, nil
+		}
+	}
+
+	return &net.UDPAddr{IP: ips[0], Port: port}, nil
+}
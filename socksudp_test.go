@@ -0,0 +1,41 @@
+package main
+
+import (
+	"os"
+	"path/filepath"
+	"testing"
+)
+
+func TestRejectQuicAuto(t *testing.T) {
+	rules := filepath.Join(t.TempDir(), "rules.txt")
+	data := "[direct]\nopen.test\n[fragment]\nsplit.test\n"
+	if err := os.WriteFile(rules, []byte(data), 0o600); err != nil {
+		t.Fatal(err)
+	}
+
+	c, err := loadConfig([]string{"-quic", "auto", "-rules", rules})
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	oldStrategies := strategies
+	defer func() {
+		strategies = oldStrategies
+	}()
+
+	for _, adaptive := range []bool{false, true} {
+		c.adaptive = adaptive
+		strategies = newStrategyTable(c)
+		if rejectQuic(c, "other.test") || rejectQuic(c, "open.test") || !rejectQuic(c, "split.test") {
+			t.Fatalf("adaptive %v: a host without a known bypass refused", adaptive)
+		}
+	}
+
+	// the table learned that "blocked.test" needs one, and "fine.test" not
+	st := strategies.pick(c, "blocked.test", true)
+	strategies.report(c, "blocked.test", true, st, OUTCOME_BLOCKED)
+	strategies.entries[strategyKey("fine.test", true)] = &strategyEntry{Level: 0, Floor: -1}
+	if !rejectQuic(c, "blocked.test") || rejectQuic(c, "fine.test") {
+		t.Fatal("learned strategies ignored")
+	}
+}
@@ -0,0 +1,128 @@
+//go:build linux
+
+package main
+
+import (
+	"io"
+	"net"
+	"os"
+	"time"
+)
+
+// longest stretch a splicing direction goes without counting its bytes
+const SPLICE_TICK = time.Second
+
+/*
+ * Relay (Linux)
+ *
+ * Both ends of a tunnel are plain TCP sockets once the bypass request has been
+ * written, and (*net.TCPConn).ReadFrom already moves TCP -> TCP with
+ * splice(2), so the payload never gets copied into user space. ReadFrom
+ * only returns at EOF or a deadline, so while bytes move the read side gets
+ * one every SPLICE_TICK (or half the idle timeout, when that is shorter):
+ * the bytes so far are counted, which keeps the tunnel from looking idle,
+ * and the deadlines are moved on. A direction that moved nothing in a tick
+ * sleeps until the tunnel's own idle or lifetime deadline instead, and
+ * takes its first byte alone to go back to ticking, so an idle tunnel is
+ * not woken up at all. Anything that is not a *net.TCPConn pair, or is
+ * shaped, falls back to relayCopy.
+ */
+func relayN(dst, src net.Conn, n int64, m *relayMeter) (int64, error) {
+	if m.limited() {
+		return relayCopy(dst, src, n, m)
+	}
+
+	dTcp, ok := dst.(*net.TCPConn)
+	if !ok {
+		return relayCopy(dst, src, n, m)
+	}
+
+	sTcp, ok := src.(*net.TCPConn)
+	if !ok {
+		return relayCopy(dst, src, n, m)
+	}
+
+	return relaySplice(dTcp, sTcp, n, m)
+}
+
+func relaySplice(dst, src *net.TCPConn, n int64, m *relayMeter) (int64, error) {
+	if m == nil || m.act == nil {
+		if n < 0 {
+			return dst.ReadFrom(src)
+		}
+
+		total, err := dst.ReadFrom(&io.LimitedReader{R: src, N: n})
+		if err == nil {
+			err = eofAt(total, n)
+		}
+
+		return total, err
+	}
+
+	interval := SPLICE_TICK
+	if half := m.act.idle / 2; half > 0 && half < interval {
+		// the other direction waits for the idle deadline, these bytes
+		// must be counted well before it
+		interval = half
+	}
+
+	var total int64
+	moving := false
+	for n < 0 || total < n {
+		deadline, ok := m.act.next()
+		if !ok {
+			return total, os.ErrDeadlineExceeded
+		}
+
+		// the write side gets one tick more, so a timeout before that
+		// is always the read side
+		readDeadline := deadline
+		var writeDeadline time.Time
+		if !deadline.IsZero() {
+			writeDeadline = deadline.Add(SPLICE_TICK)
+		}
+
+		if moving {
+			if tick := time.Now().Add(interval); deadline.IsZero() || tick.Before(deadline) {
+				readDeadline = tick
+			}
+		}
+
+		src.SetReadDeadline(readDeadline)
+		dst.SetWriteDeadline(writeDeadline)
+
+		// a first byte, still to be timed or ending an idle spell,
+		// comes on its own
+		var r io.Reader = src
+		limit := n - total
+		if !moving || !m.sentAt.IsZero() {
+			limit = 1
+		}
+
+		if limit > 0 {
+			r = &io.LimitedReader{R: src, N: limit}
+		}
+
+		snd, err := dst.ReadFrom(r)
+		total += snd
+		m.add(snd)
+		moving = snd > 0
+
+		if err == nil {
+			if limit <= 0 || snd < limit {
+				// EOF
+				return total, eofAt(total, n)
+			}
+
+			continue
+		}
+
+		// a write timeout drops whatever was spliced into the pipe, the
+		// tunnel cannot go on after that
+		if !isTimeout(err) || (!writeDeadline.IsZero() && !time.Now().Before(writeDeadline)) {
+			return total, err
+		}
+	}
+
+	return total, nil
+}
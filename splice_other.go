@@ -0,0 +1,12 @@
+//go:build !linux
+
+package main
+
+import "net"
+
+/*
+ * Relay (generic)
+ */
+func relayN(dst, src net.Conn, n int64, m *relayMeter) (int64, error) {
+	return relayCopy(dst, src, n, m)
+}
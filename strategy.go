@@ -0,0 +1,424 @@
+package main
+
+import (
+	"encoding/json"
+	"errors"
+	"io"
+	"os"
+	"path/filepath"
+	"strings"
+	"sync"
+	"syscall"
+	"time"
+)
+
+const (
+	STRATEGY_NONE = "none"
+	STRATEGY_TCP  = "tcp"
+	STRATEGY_TLS  = "tls"
+
+	STRATEGY_PROBE_AFTER   = 16
+	STRATEGY_FLOOR_TTL     = 24 * time.Hour
+	STRATEGY_SAVE_INTERVAL = time.Minute
+	STRATEGY_MAX_ENTRIES   = 65536
+)
+
+/*
+ * Bypass Strategy
+ *
+ * Every destination (SNI, or host for plain HTTP) climbs a ladder of bypass
+ * strategies, cheapest first. A reset, a silent drop or an early EOF after
+ * the request moves it one rung up; after STRATEGY_PROBE_AFTER successes the
+ * cheaper rung below is tried again, unless it failed within
+ * STRATEGY_FLOOR_TTL. Uncensored hosts so end up on "none", blocked ones on
+ * the cheapest strategy that works, and the table survives restarts.
+ */
+type strategy struct {
+	kind string
+	size int
+}
+
+// newLadder puts the TCP rungs on top of `base`: the configured split size
+// first, then the ones in `smaller` that are below it.
+func newLadder(base []strategy, size int, smaller ...int) []strategy {
+	ret := append(base, strategy{STRATEGY_TCP, size})
+	for _, s := range smaller {
+		if s < size {
+			ret = append(ret, strategy{STRATEGY_TCP, s})
+		}
+	}
+
+	return ret
+}
+
+type outcome int
+
+const (
+	OUTCOME_OK outcome = iota
+	OUTCOME_BLOCKED
+	OUTCOME_TIMEOUT
+	OUTCOME_UNKNOWN
+)
+
+type strategyEntry struct {
+	Level     int       `json:"level"`
+	Floor     int       `json:"floor"`
+	FloorAt   time.Time `json:"floor_at,omitempty"`
+	Successes int       `json:"-"`
+}
+
+type strategyTable struct {
+	adaptive bool
+	path     string
+
+	// taken from the split sizes when the table is created
+	httpsLadder []strategy
+	httpLadder  []strategy
+
+	mutex   sync.Mutex
+	entries map[string]*strategyEntry
+	dirty   bool
+
+	// the saver takes a reply channel, saves one last time and quits
+	stopSaver chan chan error
+	saving    bool
+}
+
+var strategies *strategyTable
+
+func newStrategyTable(c *config) *strategyTable {
+	ret := &strategyTable{
+		adaptive: c.adaptive,
+		path:     c.strategyFile,
+		httpsLadder: newLadder([]strategy{{STRATEGY_NONE, 0}, {STRATEGY_TLS, 0}},
+			c.helloSplitSize, 32, 4),
+		httpLadder: newLadder([]strategy{{STRATEGY_NONE, 0}},
+			c.headerSplitSize, 1),
+		entries:   make(map[string]*strategyEntry),
+		stopSaver: make(chan chan error),
+	}
+
+	if !ret.adaptive {
+		return ret
+	}
+
+	if len(ret.path) > 0 {
+		if err := ret.load(); err != nil && !errors.Is(err, os.ErrNotExist) {
+			perror("strategy: cannot load %s: %s", ret.path, err)
+		}
+
+		ret.startSaving()
+	}
+
+	return ret
+}
+
+func strategyKey(host string, isTls bool) string {
+	if isTls {
+		return "tls:" + strings.ToLower(host)
+	}
+
+	return "http:" + strings.ToLower(host)
+}
+
+// ladder returns the rungs and where new hosts start, which follows
+// -split-mode.
+func (self *strategyTable) ladder(c *config, isTls bool) ([]strategy, int) {
+	if !isTls {
+		return self.httpLadder, 1
+	}
+
+	if c.splitMode == SPLIT_MODE_TLS {
+		return self.httpsLadder, 1
+	}
+
+	return self.httpsLadder, 2
+}
+
+// defaultStrategy is used for every host without -adaptive.
+func defaultStrategy(c *config, isTls bool) strategy {
+	if !isTls {
+		return strategy{STRATEGY_TCP, c.headerSplitSize}
+	}
+
+	if c.splitMode == SPLIT_MODE_TLS {
+		return strategy{STRATEGY_TLS, 0}
+	}
+
+	return strategy{STRATEGY_TCP, c.helloSplitSize}
+}
+
+// fixedStrategy is what a rule or an upstream chain decides for `host`, the
+// table is not asked then.
+func fixedStrategy(c *config, host string, isTls bool) (strategy, bool) {
+	switch c.rules.match(host) {
+	case RULE_FRAGMENT:
+		return defaultStrategy(c, isTls), true
+	case RULE_NONE:
+		if c.upstream == nil {
+			return strategy{}, false
+		}
+	}
+
+	// direct, blocked, or the far end of the chain takes care of it
+	return strategy{STRATEGY_NONE, 0}, true
+}
+
+func (self *strategyTable) pick(c *config, host string, isTls bool) strategy {
+	if st, ok := fixedStrategy(c, host, isTls); ok {
+		return st
+	}
+
+	if !self.adaptive {
+		return defaultStrategy(c, isTls)
+	}
+
+	ladder, start := self.ladder(c, isTls)
+
+	key := strategyKey(host, isTls)
+
+	self.mutex.Lock()
+	defer self.mutex.Unlock()
+
+	if entry, ok := self.entries[key]; ok {
+		return ladder[entry.Level]
+	}
+
+	return ladder[start]
+}
+
+// learned returns the rung the table settled on for `host`, false when it
+// has not seen the host yet or -adaptive is off.
+func (self *strategyTable) learned(c *config, host string, isTls bool) (strategy, bool) {
+	if !self.adaptive {
+		return strategy{}, false
+	}
+
+	ladder, _ := self.ladder(c, isTls)
+	key := strategyKey(host, isTls)
+
+	self.mutex.Lock()
+	defer self.mutex.Unlock()
+
+	if entry, ok := self.entries[key]; ok {
+		return ladder[entry.Level], true
+	}
+
+	return strategy{}, false
+}
+
+func (self *strategyTable) report(c *config, host string, isTls bool, used strategy, res outcome) {
+	if !self.adaptive || res == OUTCOME_UNKNOWN {
+		return
+	}
+
+	if _, ok := fixedStrategy(c, host, isTls); ok {
+		return
+	}
+
+	ladder, start := self.ladder(c, isTls)
+	key := strategyKey(host, isTls)
+	now := time.Now()
+
+	self.mutex.Lock()
+	defer self.mutex.Unlock()
+
+	entry, ok := self.entries[key]
+	if !ok {
+		if len(self.entries) >= STRATEGY_MAX_ENTRIES {
+			return
+		}
+
+		entry = &strategyEntry{Level: start, Floor: -1}
+		self.entries[key] = entry
+		self.dirty = true
+	}
+
+	if ladder[entry.Level] != used {
+		// raced with another connection that already moved it
+		return
+	}
+
+	if entry.Floor >= 0 && now.Sub(entry.FloorAt) > STRATEGY_FLOOR_TTL {
+		entry.Floor = -1
+	}
+
+	if res == OUTCOME_OK {
+		entry.Successes++
+		if entry.Successes >= STRATEGY_PROBE_AFTER && entry.Level-1 > entry.Floor {
+			entry.Level--
+			entry.Successes = 0
+			self.dirty = true
+		}
+
+		return
+	}
+
+	entry.Successes = 0
+	entry.Floor, entry.FloorAt = entry.Level, now
+	if entry.Level+1 < len(ladder) {
+		entry.Level++
+	}
+
+	self.dirty = true
+	info("strategy: %s failed with %s/%d, next: %s/%d", key, used.kind, used.size,
+		ladder[entry.Level].kind, ladder[entry.Level].size)
+}
+
+func (self *strategyTable) load() error {
+	data, err := os.ReadFile(self.path)
+	if err != nil {
+		return err
+	}
+
+	entries := make(map[string]*strategyEntry)
+	if err = json.Unmarshal(data, &entries); err != nil {
+		return err
+	}
+
+	for key, entry := range entries {
+		ladder := self.httpLadder
+		if strings.HasPrefix(key, "tls:") {
+			ladder = self.httpsLadder
+		}
+
+		if entry.Level < 0 || entry.Level >= len(ladder) || entry.Floor > entry.Level {
+			continue
+		}
+
+		self.entries[key] = entry
+	}
+
+	return nil
+}
+
+// startSaving and stopSaving are only called on startup and by the restart
+// handler.
+func (self *strategyTable) startSaving() {
+	if !self.saving {
+		self.saving = true
+		go self.saver()
+	}
+}
+
+// stopSaving waits for a last save. A process handing over stops before the
+// successor starts, it would overwrite the successor's table while it drains.
+func (self *strategyTable) stopSaving() {
+	if !self.saving {
+		return
+	}
+
+	self.saving = false
+	done := make(chan error)
+	self.stopSaver <- done
+	if err := <-done; err != nil {
+		perror("strategy: cannot save %s: %s", self.path, err)
+	}
+}
+
+func (self *strategyTable) saver() {
+	ticker := time.NewTicker(STRATEGY_SAVE_INTERVAL)
+	defer ticker.Stop()
+
+	for {
+		select {
+		case <-ticker.C:
+			if err := self.save(); err != nil {
+				perror("strategy: cannot save %s: %s", self.path, err)
+			}
+		case done := <-self.stopSaver:
+			done <- self.save()
+			return
+		}
+	}
+}
+
+func (self *strategyTable) save() error {
+	self.mutex.Lock()
+	if !self.dirty {
+		self.mutex.Unlock()
+		return nil
+	}
+
+	// a report from now on makes it dirty again, a failed write does too
+	data, err := json.Marshal(self.entries)
+	self.dirty = false
+	self.mutex.Unlock()
+
+	if err == nil {
+		err = self.write(data)
+	}
+
+	if err != nil {
+		self.mutex.Lock()
+		self.dirty = true
+		self.mutex.Unlock()
+	}
+
+	return err
+}
+
+// write then rename, a crash never leaves a truncated table behind
+func (self *strategyTable) write(data []byte) error {
+	tmp, err := os.CreateTemp(filepath.Dir(self.path), ".strategy-*")
+	if err != nil {
+		return err
+	}
+	defer os.Remove(tmp.Name())
+
+	if _, err = tmp.Write(data); err != nil {
+		tmp.Close()
+		return err
+	}
+
+	if err = tmp.Close(); err != nil {
+		return err
+	}
+
+	return os.Rename(tmp.Name(), self.path)
+}
+
+// responseProbe tells whether the request got past DPI from the first thing
+// the target answers. The tunnel is relayed both ways meanwhile, the client
+// may well send more before the target says anything.
+type responseProbe struct {
+	once   sync.Once
+	timer  *time.Timer
+	report func(outcome)
+}
+
+func newResponseProbe(timeout time.Duration, report func(outcome)) *responseProbe {
+	ret := &responseProbe{report: report}
+	ret.timer = time.AfterFunc(timeout, func() {
+		ret.finish(OUTCOME_TIMEOUT)
+	})
+
+	return ret
+}
+
+// done takes the first read of the response direction, an EOF is `err`
+// io.EOF. Only the first call or the timeout counts.
+func (self *responseProbe) done(recvd int, err error) {
+	self.timer.Stop()
+	self.finish(classifyResponse(recvd, err))
+}
+
+func (self *responseProbe) finish(res outcome) {
+	self.once.Do(func() {
+		self.report(res)
+	})
+}
+
+// classifyResponse maps the result of waiting for the first response byte.
+func classifyResponse(recvd int, err error) outcome {
+	switch {
+	case recvd > 0:
+		return OUTCOME_OK
+	case errors.Is(err, io.EOF), errors.Is(err, syscall.ECONNRESET):
+		return OUTCOME_BLOCKED
+	case errors.Is(err, os.ErrDeadlineExceeded):
+		return OUTCOME_TIMEOUT
+	}
+
+	return OUTCOME_UNKNOWN
+}
@@ -0,0 +1,125 @@
+package main
+
+import (
+	"io"
+	"os"
+	"path/filepath"
+	"strings"
+	"syscall"
+	"testing"
+	"time"
+)
+
+func TestResponseProbe(t *testing.T) {
+	cases := []struct {
+		recvd int
+		err   error
+		want  outcome
+	}{
+		{1, nil, OUTCOME_OK},
+		{0, io.EOF, OUTCOME_BLOCKED},
+		{0, syscall.ECONNRESET, OUTCOME_BLOCKED},
+		{0, os.ErrDeadlineExceeded, OUTCOME_TIMEOUT},
+		{0, os.ErrClosed, OUTCOME_UNKNOWN},
+	}
+
+	for _, tc := range cases {
+		got := make(chan outcome, 2)
+		probe := newResponseProbe(time.Hour, func(res outcome) { got <- res })
+		probe.done(tc.recvd, tc.err)
+		probe.done(1, nil)
+		if res := <-got; res != tc.want || len(got) > 0 {
+			t.Errorf("%d, %v: got %v, want only %v", tc.recvd, tc.err, res, tc.want)
+		}
+	}
+
+	// nothing from the target in time, data later does not count any more
+	got := make(chan outcome, 2)
+	probe := newResponseProbe(10*time.Millisecond, func(res outcome) { got <- res })
+	if res := <-got; res != OUTCOME_TIMEOUT {
+		t.Fatalf("got %v", res)
+	}
+
+	probe.done(1, nil)
+	if len(got) > 0 {
+		t.Fatal("reported twice")
+	}
+}
+
+func TestStopSaving(t *testing.T) {
+	c := defaultCfg
+	c.adaptive = true
+	c.strategyFile = filepath.Join(t.TempDir(), "strategies.json")
+	table := newStrategyTable(&c)
+
+	table.report(&c, "a.test", true, table.pick(&c, "a.test", true), OUTCOME_BLOCKED)
+	table.stopSaving()
+
+	data, err := os.ReadFile(c.strategyFile)
+	if err != nil || !strings.Contains(string(data), "tls:a.test") {
+		t.Fatalf("no last save: %q, %v", data, err)
+	}
+
+	// nothing is written behind a successor's back, until saving resumes
+	table.report(&c, "b.test", true, table.pick(&c, "b.test", true), OUTCOME_BLOCKED)
+	table.stopSaving()
+	if data, _ = os.ReadFile(c.strategyFile); strings.Contains(string(data), "b.test") {
+		t.Fatal("saved after stopping")
+	}
+
+	table.startSaving()
+	table.stopSaving()
+	if data, _ = os.ReadFile(c.strategyFile); !strings.Contains(string(data), "b.test") {
+		t.Fatal("not saved after resuming")
+	}
+}
+
+func TestLadderSplitSizes(t *testing.T) {
+	c := defaultCfg
+	c.adaptive = true
+	c.helloSplitSize = 16
+	c.headerSplitSize = 1
+	table := newStrategyTable(&c)
+
+	// new hosts start on the configured sizes, the next rungs are smaller
+	want := []strategy{{STRATEGY_TCP, 16}, {STRATEGY_TCP, 4}, {STRATEGY_TCP, 4}}
+	for i, w := range want {
+		st := table.pick(&c, "a.test", true)
+		if st != w {
+			t.Fatalf("rung %d: got %v, want %v", i, st, w)
+		}
+
+		table.report(&c, "a.test", true, st, OUTCOME_BLOCKED)
+	}
+
+	if st := table.pick(&c, "a.test", false); st != (strategy{STRATEGY_TCP, 1}) {
+		t.Fatalf("http: got %v", st)
+	}
+}
+
+func TestSaveRetries(t *testing.T) {
+	dir := filepath.Join(t.TempDir(), "missing")
+	c := defaultCfg
+	c.adaptive = true
+	c.strategyFile = filepath.Join(dir, "strategies.json")
+	table := newStrategyTable(&c)
+	table.stopSaving()
+
+	// a failed write keeps the changes for the next save
+	table.report(&c, "a.test", true, table.pick(&c, "a.test", true), OUTCOME_BLOCKED)
+	if err := table.save(); err == nil {
+		t.Fatal("saved into a missing directory")
+	}
+
+	if err := os.Mkdir(dir, 0o700); err != nil {
+		t.Fatal(err)
+	}
+
+	if err := table.save(); err != nil {
+		t.Fatal(err)
+	}
+
+	if data, err := os.ReadFile(c.strategyFile); err != nil || !strings.Contains(string(data), "tls:a.test") {
+		t.Fatalf("not saved on retry: %q, %v", data, err)
+	}
+}
@@ -0,0 +1,134 @@
+package main
+
+import (
+	"encoding/binary"
+)
+
+const (
+	TLS_RECORD_HEADER_SIZE  = 5
+	TLS_RECORD_HANDSHAKE    = 0x16
+	TLS_HANDSHAKE_HELLO     = 0x01
+	TLS_EXT_SERVER_NAME     = 0x0000
+	TLS_SNI_HOST_NAME       = 0x00
+	TLS_MAX_RECORD_SIZE     = 1 << 14
+	TLS_CLIENT_RANDOM_SIZE  = 32
+	TLS_HANDSHAKE_HDR_SIZE  = 4
+	TLS_HELLO_VERSION_SIZE  = 2
+	TLS_HELLO_FIXED_SIZE    = TLS_HANDSHAKE_HDR_SIZE + TLS_HELLO_VERSION_SIZE + TLS_CLIENT_RANDOM_SIZE
+	TLS_EXT_HEADER_SIZE     = 4
+	TLS_SNI_NAME_HEADER_LEN = 5 // list length, name type, name length
+)
+
+/*
+ * TLS ClientHello
+ */
+
+// findSni locates the server name inside the first record of `buffer` and
+// returns its offsets in `buffer`. ok is false when `buffer` does not start
+// with a complete ClientHello record.
+func findSni(buffer []byte) (start int, end int, ok bool) {
+	if len(buffer) < TLS_RECORD_HEADER_SIZE || buffer[0] != TLS_RECORD_HANDSHAKE {
+		return 0, 0, false
+	}
+
+	recEnd := TLS_RECORD_HEADER_SIZE + int(binary.BigEndian.Uint16(buffer[3:]))
+	if recEnd > len(buffer) {
+		return 0, 0, false
+	}
+
+	p := TLS_RECORD_HEADER_SIZE
+	if recEnd-p < TLS_HELLO_FIXED_SIZE+1 || buffer[p] != TLS_HANDSHAKE_HELLO {
+		return 0, 0, false
+	}
+
+	p += TLS_HELLO_FIXED_SIZE
+
+	// session id
+	p += 1 + int(buffer[p])
+	if p+2 > recEnd {
+		return 0, 0, false
+	}
+
+	// cipher suites
+	p += 2 + int(binary.BigEndian.Uint16(buffer[p:]))
+	if p+1 > recEnd {
+		return 0, 0, false
+	}
+
+	// compression methods
+	p += 1 + int(buffer[p])
+	if p+2 > recEnd {
+		return 0, 0, false
+	}
+
+	extEnd := p + 2 + int(binary.BigEndian.Uint16(buffer[p:]))
+	if extEnd > recEnd {
+		return 0, 0, false
+	}
+
+	p += 2
+	for p+TLS_EXT_HEADER_SIZE <= extEnd {
+		extType := binary.BigEndian.Uint16(buffer[p:])
+		extLen := int(binary.BigEndian.Uint16(buffer[p+2:]))
+		p += TLS_EXT_HEADER_SIZE
+		if p+extLen > extEnd {
+			return 0, 0, false
+		}
+
+		if extType != TLS_EXT_SERVER_NAME {
+			p += extLen
+			continue
+		}
+
+		if extLen < TLS_SNI_NAME_HEADER_LEN || buffer[p+2] != TLS_SNI_HOST_NAME {
+			return 0, 0, false
+		}
+
+		nameLen := int(binary.BigEndian.Uint16(buffer[p+3:]))
+		start = p + TLS_SNI_NAME_HEADER_LEN
+		if start+nameLen > p+extLen || nameLen == 0 {
+			return 0, 0, false
+		}
+
+		return start, start + nameLen, true
+	}
+
+	return 0, 0, false
+}
+
+// parseSni returns the server name of the ClientHello in `buffer`, or nil.
+func parseSni(buffer []byte) []byte {
+	start, end, ok := findSni(buffer)
+	if !ok {
+		return nil
+	}
+
+	return buffer[start:end]
+}
+
+// splitTlsRecord re-frames the first record of `hello` as two records, cut in
+// the middle of the server name, into `dst`. Bytes after the first record
+// are copied as they are. `dst` needs TLS_RECORD_HEADER_SIZE bytes more than
+// `hello`.
+func splitTlsRecord(dst, hello []byte) ([]byte, bool) {
+	start, end, ok := findSni(hello)
+	if !ok || len(dst) < len(hello)+TLS_RECORD_HEADER_SIZE {
+		return nil, false
+	}
+
+	cut := start + (end-start)/2
+	recEnd := TLS_RECORD_HEADER_SIZE + int(binary.BigEndian.Uint16(hello[3:]))
+
+	// first record: header + payload up to `cut`
+	n := copy(dst, hello[:cut])
+	binary.BigEndian.PutUint16(dst[3:], uint16(cut-TLS_RECORD_HEADER_SIZE))
+
+	// second record: same type and version, the rest of the payload
+	n += copy(dst[n:], hello[:3])
+	dst[n] = byte((recEnd - cut) >> 8)
+	dst[n+1] = byte(recEnd - cut)
+	n += 2
+	n += copy(dst[n:], hello[cut:])
+
+	return dst[:n], true
+}
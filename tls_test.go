@@ -0,0 +1,94 @@
+package main
+
+import (
+	"encoding/binary"
+	"testing"
+)
+
+func TestSplitTlsRecord(t *testing.T) {
+	hello := newClientHello("example.com")
+	if sni := string(parseSni(hello)); sni != "example.com" {
+		t.Fatalf("sni %q", sni)
+	}
+
+	dst := make([]byte, len(hello)+TLS_RECORD_HEADER_SIZE)
+	out, ok := splitTlsRecord(dst, hello)
+	if !ok {
+		t.Fatal("not split")
+	}
+
+	checkSplitRecord(t, hello, out)
+}
+
+func BenchmarkSplitTlsRecord(b *testing.B) {
+	hello := newClientHello("example.com")
+	dst := make([]byte, len(hello)+TLS_RECORD_HEADER_SIZE)
+	b.ReportAllocs()
+	b.SetBytes(int64(len(hello)))
+	for i := 0; i < b.N; i++ {
+		if _, ok := splitTlsRecord(dst, hello); !ok {
+			b.Fatal("not split")
+		}
+	}
+}
+
+// checkSplitRecord checks that `out` is `hello` with its first record cut in
+// two, somewhere inside the server name.
+func checkSplitRecord(t *testing.T, hello, out []byte) {
+	start, end, _ := findSni(hello)
+	recEnd := TLS_RECORD_HEADER_SIZE + int(binary.BigEndian.Uint16(hello[3:]))
+	if len(out) != len(hello)+TLS_RECORD_HEADER_SIZE {
+		t.Fatalf("split to %d bytes out of %d", len(out), len(hello))
+	}
+
+	cut := int(binary.BigEndian.Uint16(out[3:])) + TLS_RECORD_HEADER_SIZE
+	if cut <= start || cut >= end {
+		t.Fatalf("cut at %d outside of the name at %d-%d", cut, start, end)
+	}
+
+	second := out[cut:]
+	if string(out[:3]) != string(hello[:3]) || string(second[:3]) != string(hello[:3]) {
+		t.Fatal("record headers differ")
+	}
+
+	if n := int(binary.BigEndian.Uint16(second[3:])); cut+n != recEnd {
+		t.Fatalf("records hold %d bytes, want %d", cut+n, recEnd)
+	}
+
+	payload := string(out[TLS_RECORD_HEADER_SIZE:cut]) + string(second[TLS_RECORD_HEADER_SIZE:])
+	if payload != string(hello[TLS_RECORD_HEADER_SIZE:]) {
+		t.Fatal("payload changed")
+	}
+}
+
+func FuzzParseSni(f *testing.F) {
+	f.Add(newClientHello("example.com"))
+	f.Add(newClientHello("a"))
+	f.Add(append(newClientHello("www.example.org"), TLS_RECORD_HANDSHAKE, 3, 3, 0, 0))
+	f.Add([]byte{TLS_RECORD_HANDSHAKE, 3, 1, 0, 0})
+
+	f.Fuzz(func(t *testing.T, data []byte) {
+		start, end, ok := findSni(data)
+		if !ok {
+			if parseSni(data) != nil {
+				t.Fatal("server name without a hello")
+			}
+
+			return
+		}
+
+		if start <= 0 || start >= end || end > len(data) {
+			t.Fatalf("name at %d-%d of %d bytes", start, end, len(data))
+		}
+
+		dst := make([]byte, len(data)+TLS_RECORD_HEADER_SIZE)
+		out, ok := splitTlsRecord(dst, data)
+		if !ok {
+			t.Fatal("hello not split")
+		}
+
+		if end-start > 1 {
+			checkSplitRecord(t, data, out)
+		}
+	})
+}
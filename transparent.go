@@ -0,0 +1,37 @@
+package main
+
+import (
+	"errors"
+)
+
+var errTransparentLoop = errors.New("connection is addressed to the transparent listener itself")
+
+/*
+ * Transparent Proxy
+ *
+ * The firewall hands over connections meant for somebody else, so there is
+ * no CONNECT or SOCKS5 exchange: the destination comes from the socket, the
+ * dial starts right away and the first bytes the client sends are split the
+ * same way a tunnelled ClientHello is. Protocols where the server speaks
+ * first wait for the idle timeout, only redirect HTTP(S) here.
+ */
+func (self *client) handleTransparent() error {
+	hostPort, err := originalDst(self.source, self.cfg)
+	if err != nil {
+		return atStage(STAGE_PARSE, err)
+	}
+
+	self.trace.setTarget(hostPort)
+	self.trace.mark(TRACE_PARSE)
+
+	dialed := dialTargetAsync(self.cfg, hostPort)
+	recvd, err := self.readHello(0)
+	if err != nil {
+		go closeLosers(dialed, 1)
+		return err
+	}
+
+	sni := parseSni((*self.buffer)[:recvd])
+	info("%s -> TRANSPARENT %s %s", self.source.RemoteAddr(), hostPort, sni)
+	return self.handleHttps(nil, (*self.buffer)[:recvd], hostPort, dialed)
+}
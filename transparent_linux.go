@@ -0,0 +1,136 @@
+//go:build linux
+
+package main
+
+import (
+	"context"
+	"fmt"
+	"net"
+	"strconv"
+	"syscall"
+	"unsafe"
+)
+
+const (
+	_SO_ORIGINAL_DST  = 80 // also IP6T_SO_ORIGINAL_DST
+	_IP_TRANSPARENT   = 19
+	_IPV6_TRANSPARENT = 75
+)
+
+// listenTransparent opens the listener iptables REDIRECT or TPROXY rules
+// point to. TPROXY needs IP_TRANSPARENT to accept connections for addresses
+// that are not local.
+func listenTransparent(address string, tproxy bool) (net.Listener, error) {
+	var lc net.ListenConfig
+	if tproxy {
+		lc.Control = setTransparent
+	}
+
+	return lc.Listen(context.Background(), "tcp", address)
+}
+
+func setTransparent(network, address string, c syscall.RawConn) error {
+	var serr error
+	err := c.Control(func(fd uintptr) {
+		level, opt := syscall.SOL_IP, _IP_TRANSPARENT
+		if network == "tcp6" {
+			level, opt = syscall.SOL_IPV6, _IPV6_TRANSPARENT
+		}
+
+		serr = syscall.SetsockoptInt(int(fd), level, opt, 1)
+	})
+
+	if err != nil {
+		return err
+	}
+
+	return serr
+}
+
+// isListenerAddr tells the listener's own address from a TPROXY destination
+// that merely shares its port.
+func isListenerAddr(local *net.TCPAddr, listen string) bool {
+	host, port, err := net.SplitHostPort(listen)
+	if err != nil || port != strconv.Itoa(local.Port) {
+		return false
+	}
+
+	if ip := net.ParseIP(host); ip != nil && !ip.IsUnspecified() {
+		return ip.Equal(local.IP)
+	}
+
+	// bound to all addresses, or to a name
+	if local.IP.IsLoopback() {
+		return true
+	}
+
+	addrs, err := net.InterfaceAddrs()
+	if err != nil {
+		return false
+	}
+
+	for _, a := range addrs {
+		if ipNet, ok := a.(*net.IPNet); ok && ipNet.IP.Equal(local.IP) {
+			return true
+		}
+	}
+
+	return false
+}
+
+// originalDst returns where the client was heading for. With TPROXY the
+// socket is bound to it already, REDIRECT leaves it in conntrack.
+func originalDst(conn net.Conn, c *config) (string, error) {
+	local, ok := conn.LocalAddr().(*net.TCPAddr)
+	if !ok {
+		return "", syscall.EAFNOSUPPORT
+	}
+
+	if c.tproxy {
+		// somebody connected to the listener without a firewall rule
+		if isListenerAddr(local, c.transparentAddr) {
+			return "", errTransparentLoop
+		}
+
+		return local.String(), nil
+	}
+
+	raw, err := conn.(*net.TCPConn).SyscallConn()
+	if err != nil {
+		return "", err
+	}
+
+	var dst net.TCPAddr
+	var serr error
+	err = raw.Control(func(fd uintptr) {
+		if local.IP.To4() != nil {
+			// sockaddr_in fits the 16 bytes of an ipv6_mreq address
+			var mreq *syscall.IPv6Mreq
+			mreq, serr = syscall.GetsockoptIPv6Mreq(int(fd), syscall.SOL_IP, _SO_ORIGINAL_DST)
+			if serr == nil {
+				dst.IP = net.IPv4(mreq.Multiaddr[4], mreq.Multiaddr[5], mreq.Multiaddr[6], mreq.Multiaddr[7])
+				dst.Port = int(mreq.Multiaddr[2])<<8 | int(mreq.Multiaddr[3])
+			}
+			return
+		}
+
+		// sockaddr_in6 comes back in the address part of ip6_mtuinfo
+		var mtu *syscall.IPv6MTUInfo
+		mtu, serr = syscall.GetsockoptIPv6MTUInfo(int(fd), syscall.SOL_IPV6, _SO_ORIGINAL_DST)
+		if serr == nil {
+			port := (*[2]byte)(unsafe.Pointer(&mtu.Addr.Port))
+			dst.IP = net.IP(mtu.Addr.Addr[:])
+			dst.Port = int(port[0])<<8 | int(port[1])
+		}
+	})
+
+	if err != nil {
+		return "", err
+	}
+
+	if serr != nil {
+		return "", fmt.Errorf("SO_ORIGINAL_DST: %w", serr)
+	}
+
+	return dst.String(), nil
+}
@@ -0,0 +1,34 @@
+package main
+
+import (
+	"net"
+	"testing"
+)
+
+func TestIsListenerAddr(t *testing.T) {
+	cases := []struct {
+		local  string
+		listen string
+		want   bool
+	}{
+		{"127.0.0.1:12345", ":12345", true},
+		{"127.0.0.1:12345", "0.0.0.0:12345", true},
+		{"[::1]:12345", "[::]:12345", true},
+		{"127.0.0.1:443", ":12345", false},
+		// a remote destination that happens to use the listener's port
+		{"203.0.113.7:12345", ":12345", false},
+		{"203.0.113.7:12345", "203.0.113.7:12345", true},
+		{"127.0.0.1:12345", "127.0.0.2:12345", false},
+	}
+
+	for _, tc := range cases {
+		local, err := net.ResolveTCPAddr("tcp", tc.local)
+		if err != nil {
+			t.Fatal(err)
+		}
+
+		if got := isListenerAddr(local, tc.listen); got != tc.want {
+			t.Errorf("%s on %s: %v, want %v", tc.local, tc.listen, got, tc.want)
+		}
+	}
+}